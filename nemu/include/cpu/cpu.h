@@ -23,6 +23,11 @@ void cpu_exec(uint64_t n);
 void set_nemu_state(int state, vaddr_t pc, int halt_ret);
 void invalid_inst(vaddr_t thispc);
 
+/* pc breakpoints of sdb, only looked up when nr_bp > 0 */
+extern int nr_bp;
+bool has_bp(vaddr_t pc);
+void check_bp(vaddr_t pc);
+
 #define NEMUTRAP(thispc, code) set_nemu_state(NEMU_END, thispc, code)
 #define INV(thispc) invalid_inst(thispc)
 
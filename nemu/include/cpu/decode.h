@@ -87,16 +87,27 @@ finish:
 
 
 // --- pattern matching wrappers for decode ---
+#ifdef CONFIG_DECODE_TREE
+// INSTPAT_TREE() is generated by tools/gen-decode-tree from the INSTPAT list of the ISA,
+// it jumps to the body of the matching pattern, which is labeled with the line of INSTPAT
+#include <decode-tree.h>
+#define INSTPAT_LABEL concat(__instpat_, __LINE__): __attribute__((unused));
+#else
+#define INSTPAT_LABEL
+#endif
+
 #define INSTPAT(pattern, ...) do { \
   uint64_t key, mask, shift; \
   pattern_decode(pattern, STRLEN(pattern), &key, &mask, &shift); \
   if ((((uint64_t)INSTPAT_INST(s) >> shift) & mask) == key) { \
+    INSTPAT_LABEL \
     INSTPAT_MATCH(s, ##__VA_ARGS__); \
     goto *(__instpat_end); \
   } \
 } while (0)
 
-#define INSTPAT_START(name) { const void ** __instpat_end = &&concat(__instpat_end_, name);
+#define INSTPAT_START(name) { const void ** __instpat_end = &&concat(__instpat_end_, name); \
+  IFDEF(CONFIG_DECODE_TREE, INSTPAT_TREE(INSTPAT_INST(s)));
 #define INSTPAT_END(name)   concat(__instpat_end_, name): ; }
 
 #endif
@@ -22,15 +22,21 @@
 #ifdef CONFIG_DIFFTEST
 void difftest_skip_ref();
 void difftest_skip_dut(int nr_ref, int nr_dut);
+void difftest_mmio_read(paddr_t addr, int len, word_t data);
+void difftest_mmio_write();
 void difftest_set_patch(void (*fn)(void *arg), void *arg);
-void difftest_step(vaddr_t pc, vaddr_t npc);
+void difftest_step(vaddr_t pc, vaddr_t npc, int rd);
+void difftest_sync();
 void difftest_detach();
 void difftest_attach();
 #else
 static inline void difftest_skip_ref() {}
 static inline void difftest_skip_dut(int nr_ref, int nr_dut) {}
+static inline void difftest_mmio_read(paddr_t addr, int len, word_t data) {}
+static inline void difftest_mmio_write() {}
 static inline void difftest_set_patch(void (*fn)(void *arg), void *arg) {}
-static inline void difftest_step(vaddr_t pc, vaddr_t npc) {}
+static inline void difftest_step(vaddr_t pc, vaddr_t npc, int rd) {}
+static inline void difftest_sync() {}
 static inline void difftest_detach() {}
 static inline void difftest_attach() {}
 #endif
@@ -39,6 +45,17 @@ extern void (*ref_difftest_memcpy)(paddr_t addr, void *buf, size_t n, bool direc
 extern void (*ref_difftest_regcpy)(void *dut, bool direction);
 extern void (*ref_difftest_exec)(uint64_t n);
 extern void (*ref_difftest_raise_intr)(uint64_t NO);
+extern bool (*ref_difftest_snapshot)(bool restore);
+extern int (*ref_difftest_step_and_compare)(const DifftestCommit *dut, int n, DifftestCommit *ref);
+extern bool (*ref_difftest_pmem_compare)(const DifftestPage *dut, int n, uint64_t *addr);
+extern void (*ref_difftest_mmio_load)(uint64_t addr, int len, uint64_t data);
+
+#ifdef CONFIG_TARGET_SHARE
+// the REF is comparing the instructions it runs with those of the DUT
+extern bool ref_comparing;
+void difftest_ref_commit(vaddr_t pc, int rd);
+word_t difftest_ref_mmio_load(paddr_t addr, int len);
+#endif
 
 static inline bool difftest_check_reg(const char *name, vaddr_t pc, word_t ref, word_t dut) {
   if (ref != dut) {
@@ -50,4 +67,8 @@ static inline bool difftest_check_reg(const char *name, vaddr_t pc, word_t ref,
   return true;
 }
 
+static inline bool difftest_commit_equal(const DifftestCommit *a, const DifftestCommit *b) {
+  return a->pc == b->pc && a->rd == b->rd && (a->rd == 0 || a->wdata == b->wdata);
+}
+
 #endif
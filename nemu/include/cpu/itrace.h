@@ -0,0 +1,72 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_ITRACE_H__
+#define __CPU_ITRACE_H__
+
+#include <stdint.h>
+
+/* Binary instruction trace, written by NEMU with CONFIG_ITRACE_BINARY and
+*  read by tools/nemu-trace. The file is an ItraceHeader, the initial values
+*  of the nr_gpr registers as uint64_t, and then records of
+*    tag                  1 byte
+*    skipped instructions varint,        if tag & ITRACE_TAG_SKIP
+*    pc - (last pc + ilen) zigzag varint, if tag & ITRACE_TAG_JUMP
+*    instruction          ilen bytes, little endian
+*    register writes      ITRACE_TAG_NR_REG(tag) times:
+*                         1 byte of the register index, and the zigzag
+*                         varint of (new value - old value)
+*  The first record is relative to pc = start_pc - ilen. Sequential
+*  instructions without register writes take 1 + ilen bytes.
+*/
+#define ITRACE_MAGIC "NEMUITRC"
+#define ITRACE_VERSION 2
+
+#define ITRACE_TAG_JUMP 0x1
+#define ITRACE_TAG_SKIP 0x2
+#define ITRACE_TAG_NR_REG(tag) ((tag) >> 2)
+#define ITRACE_MAX_RECORD 512 // upper bound of the size of a record
+
+enum { ITRACE_FLAG_REG = 0x1 };
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t ilen, nr_gpr;
+  uint64_t start_inst, start_pc;
+  uint64_t end; // file offset after the last record, the file may be longer after an abort
+} ItraceHeader;
+
+static inline uint64_t itrace_zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static inline int64_t itrace_unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+static inline uint8_t *itrace_put_varint(uint8_t *p, uint64_t v) {
+  while (v >= 0x80) { *p ++ = (v & 0x7f) | 0x80; v >>= 7; }
+  *p ++ = v;
+  return p;
+}
+
+static inline const uint8_t *itrace_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+  uint64_t x = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t b = *p ++;
+    x |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) { *v = x; return p; }
+  }
+  return NULL;
+}
+
+#endif
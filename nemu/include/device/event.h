@@ -0,0 +1,40 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_EVENT_H__
+#define __DEVICE_EVENT_H__
+
+#include <common.h>
+
+/* Device events are scheduled in guest instructions rather than host time,
+*  so the main loop only needs to compare g_nr_guest_inst against the
+*  earliest deadline before dropping into device code.
+*  A handler returns the number of instructions until it should run again,
+*  or 0 to remove itself.
+*/
+typedef uint64_t (*event_handler_t) ();
+
+extern uint64_t g_nr_guest_inst;
+extern uint64_t g_next_event;
+
+void add_event(event_handler_t h, uint64_t delay);
+void event_dispatch();
+void event_rebase(uint64_t old);
+
+static inline void event_update() {
+  if (unlikely(g_nr_guest_inst >= g_next_event)) event_dispatch();
+}
+
+#endif
@@ -37,4 +37,46 @@ enum { DIFFTEST_TO_DUT, DIFFTEST_TO_REF };
 # error Unsupport ISA
 #endif
 
+/* An instruction committed by the DUT, compared by difftest_step_and_compare()
+*  of the REF with the one it runs. Only the gpr written by the instruction is
+*  reported, the whole state is compared every once in a while.
+*/
+typedef struct {
+  uint64_t pc;
+  uint64_t wdata; // the value written to gpr[rd]
+  uint32_t rd;    // 0 if no gpr is written
+} DifftestCommit;
+
+/* A page of pmem written by the DUT since the last comparison of memory, with
+*  its hash, compared by difftest_pmem_compare() of the REF.
+*/
+typedef struct {
+  uint64_t addr;
+  uint64_t hash;
+} DifftestPage;
+
+#define DIFFTEST_PAGE_SIZE 4096
+
+/* Each of the four lanes keeps the sum of its words and the sum of the sums,
+*  as Fletcher's checksum, so that changing any word or swapping two words
+*  changes the hash. The lanes are independent, so a page is hashed about as
+*  fast as memcmp() compares it.
+*/
+static inline uint64_t difftest_page_hash(const void *page) {
+  const uint64_t *p = (const uint64_t *)page;
+  uint64_t a0 = 0, a1 = 0, a2 = 0, a3 = 0, b0 = 0, b1 = 0, b2 = 0, b3 = 0;
+  for (int i = 0; i < DIFFTEST_PAGE_SIZE / 8; i += 4) {
+    a0 += p[i];     b0 += a0;
+    a1 += p[i + 1]; b1 += a1;
+    a2 += p[i + 2]; b2 += a2;
+    a3 += p[i + 3]; b3 += a3;
+  }
+  uint64_t lane[8] = { a0, b0, a1, b1, a2, b2, a3, b3 }, h = 0;
+  for (int i = 0; i < 8; i ++) {
+    h = (h ^ lane[i]) * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
 #endif
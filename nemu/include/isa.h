@@ -32,10 +32,18 @@ void init_isa();
 extern CPU_state cpu;
 void isa_reg_display();
 word_t isa_reg_str2val(const char *name, bool *success);
+word_t *isa_reg_str2ptr(const char *name); // NULL if there is no such register
 
 // exec
 struct Decode;
 int isa_exec_once(struct Decode *s);
+#ifdef CONFIG_DECODE_CACHE
+void isa_decode_cache_invalidate(paddr_t addr, int len);
+void isa_decode_cache_flush();
+#endif
+#ifdef CONFIG_ENGINE_THREADED
+uint64_t isa_exec_block(struct Decode *s, uint64_t n);
+#endif
 
 // memory
 enum { MMU_DIRECT, MMU_TRANSLATE, MMU_FAIL };
@@ -45,6 +53,10 @@ enum { MEM_RET_OK, MEM_RET_FAIL, MEM_RET_CROSS_PAGE };
 int isa_mmu_check(vaddr_t vaddr, int len, int type);
 #endif
 paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type);
+#ifdef CONFIG_RV_SV32
+void isa_mmu_sfence(vaddr_t vaddr, bool all_vaddr, word_t asid, bool all_asid);
+void isa_mmu_statistic();
+#endif
 
 // interrupt/exception
 vaddr_t isa_raise_intr(word_t NO, vaddr_t epc);
@@ -33,5 +33,17 @@ static inline bool in_pmem(paddr_t addr) {
 
 word_t paddr_read(paddr_t addr, int len);
 void paddr_write(paddr_t addr, int len, word_t data);
+void paddr_watch(paddr_t addr, int len, bool watch);
+
+#ifdef CONFIG_TARGET_SHARE
+extern bool pmem_logging;
+void pmem_log_start();
+bool pmem_log_undo();
+#endif
+
+#ifdef CONFIG_PMEM_DIRTY
+int pmem_dirty_pages(paddr_t **pages);
+void pmem_dirty_clear();
+#endif
 
 #endif
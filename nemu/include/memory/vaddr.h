@@ -21,9 +21,61 @@
 word_t vaddr_ifetch(vaddr_t addr, int len);
 word_t vaddr_read(vaddr_t addr, int len);
 void vaddr_write(vaddr_t addr, int len, word_t data);
+bool vaddr_debug_translate(vaddr_t addr, int type, paddr_t *paddr);
+bool vaddr_debug_read(vaddr_t addr, int len, word_t *data);
 
 #define PAGE_SHIFT        12
 #define PAGE_SIZE         (1ul << PAGE_SHIFT)
 #define PAGE_MASK         (PAGE_SIZE - 1)
 
+#ifdef CONFIG_SOFT_TLB
+#include <isa.h>
+#include <memory/host.h>
+
+/* A direct-mapped software TLB from guest virtual pages to host pointers,
+*  filled by the slow path for pages in pmem only. MMIO pages and pages
+*  marked slow by stlb_set_slow() never hit, and keep going through
+*  vaddr_read()/vaddr_write(). The tag keeps the alignment bits of the
+*  access, so a misaligned access always misses.
+*/
+typedef struct {
+  vaddr_t rtag, wtag;
+  uintptr_t hoffset; // host address = vaddr + hoffset
+  paddr_t poffset;   // paddr = vaddr + poffset
+} SoftTLBEntry;
+
+#define STLB_INVALID ((vaddr_t)-1) // never a tag, as bits above the alignment are masked
+#define stlb_entry(addr) (&stlb[((addr) >> PAGE_SHIFT) & (CONFIG_SOFT_TLB_SIZE - 1)])
+#define stlb_tag(addr, len) ((addr) & (~(vaddr_t)PAGE_MASK | ((len) - 1)))
+
+extern SoftTLBEntry stlb[CONFIG_SOFT_TLB_SIZE];
+extern uint64_t stlb_hit, stlb_miss;
+
+void stlb_flush();
+void stlb_flush_write();
+void stlb_set_slow(paddr_t addr, bool slow);
+void jit_invalidate(paddr_t addr, int len);
+
+static inline word_t stlb_read(vaddr_t addr, int len) {
+  SoftTLBEntry *e = stlb_entry(addr);
+  if (likely(e->rtag == stlb_tag(addr, len))) {
+    IFDEF(CONFIG_SOFT_TLB_STAT, stlb_hit ++);
+    return host_read((void *)(addr + e->hoffset), len);
+  }
+  return vaddr_read(addr, len);
+}
+
+static inline void stlb_write(vaddr_t addr, int len, word_t data) {
+  SoftTLBEntry *e = stlb_entry(addr);
+  if (likely(e->wtag == stlb_tag(addr, len))) {
+    IFDEF(CONFIG_SOFT_TLB_STAT, stlb_hit ++);
+    host_write((void *)(addr + e->hoffset), len, data);
+    IFDEF(CONFIG_DECODE_CACHE, isa_decode_cache_invalidate(addr + e->poffset, len));
+    IFDEF(CONFIG_ENGINE_JIT, jit_invalidate(addr + e->poffset, len));
+    return;
+  }
+  vaddr_write(addr, len, data);
+}
+#endif
+
 #endif
@@ -73,5 +73,16 @@ uint64_t get_time();
     log_write(__VA_ARGS__); \
   } while (0)
 
+// ----------- checkpoint -----------
+
+typedef void (*checkpoint_hook_t)(bool is_load);
+void checkpoint_add_state(const char *name, void *addr, size_t size, checkpoint_hook_t hook);
+bool checkpoint_save(const char *path);
+bool checkpoint_load(const char *path);
+uint64_t checkpoint_sample_len();
+void checkpoint_save_at(uint64_t inst, char *path);
+void checkpoint_save_simpoints(uint64_t interval, const char *prefix);
+bool checkpoint_take_scheduled();
+
 
 #endif
@@ -18,6 +18,21 @@ include $(NEMU_HOME)/scripts/build.mk
 
 include $(NEMU_HOME)/tools/difftest.mk
 
+ifdef CONFIG_DECODE_TREE
+DECODE_TREE_GEN = $(NEMU_HOME)/tools/gen-decode-tree/build/gen-decode-tree
+DECODE_TREE_H = $(DECODE_TREE_DIR)/decode-tree.h
+
+$(DECODE_TREE_GEN):
+	@$(MAKE) -s -C $(NEMU_HOME)/tools/gen-decode-tree
+
+$(DECODE_TREE_H): src/isa/$(GUEST_ISA)/inst.c $(DECODE_TREE_GEN)
+	@echo + GEN $@
+	@mkdir -p $(dir $@)
+	@$(DECODE_TREE_GEN) $< $@
+
+$(OBJS): | $(DECODE_TREE_H)
+endif
+
 compile_git:
 	$(call git_commit, "compile NEMU")
 $(BINARY):: compile_git
@@ -25,6 +40,7 @@ $(BINARY):: compile_git
 # Some convenient rules
 
 override ARGS ?= --log=$(BUILD_DIR)/nemu-log.txt
+override ARGS += $(if $(CONFIG_ITRACE_BINARY),--itrace=$(BUILD_DIR)/nemu-itrace.bin,)
 override ARGS += $(ARGS_DIFF)
 
 # Command to execute NEMU
@@ -16,6 +16,8 @@
 #include <cpu/cpu.h>
 #include <cpu/decode.h>
 #include <cpu/difftest.h>
+#include <device/event.h>
+#include <memory/vaddr.h>
 #include <locale.h>
 
 /* The assembly code of instructions executed is only output to the screen
@@ -30,30 +32,67 @@ uint64_t g_nr_guest_inst = 0;
 static uint64_t g_timer = 0; // unit: us
 static bool g_print_step = false;
 
-void device_update();
 void check_wp();
+void simpoint_profile(vaddr_t pc, vaddr_t snpc, vaddr_t dnpc);
 void inst_trace(Decode *s);
+void inst_format(Decode *s);
 void print_ring_buffer();
+void disasm_statistic(uint64_t *hit, uint64_t *miss);
+extern uint64_t profile_next;
+void profile_sample(vaddr_t pc);
+void profile_report();
 
 static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
-#ifdef CONFIG_ITRACE_COND
-  // if itrace open, write log into logbuf
+#if defined(CONFIG_ITRACE_COND) && !defined(CONFIG_ITRACE_BINARY)
+  // if itrace open, format the instruction into logbuf and write it into log
   if (ITRACE_COND) { 
+    inst_format(_this);
     log_write("%s\n", _this->logbuf); 
   }
 #endif
   // if itrace open and g_print_step is true, output the log on terminal
   if (g_print_step) { 
+    IFDEF(CONFIG_ITRACE, inst_format(_this));
     IFDEF(CONFIG_ITRACE, puts(_this->logbuf)); 
   }
 
+  IFDEF(CONFIG_SIMPOINT, simpoint_profile(_this->pc, _this->snpc, dnpc));
+  IFDEF(CONFIG_PROFILE, if (unlikely(g_nr_guest_inst >= profile_next)) profile_sample(cpu.pc));
+
   // difftest check
-  IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
+  IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc, isa_inst_rd(_this)));
+  IFDEF(CONFIG_TARGET_SHARE, if (unlikely(ref_comparing)) difftest_ref_commit(_this->pc, isa_inst_rd(_this)));
 
   // checkpoint check
   IFDEF(CONFIG_WATCHPOINT, check_wp());
 }
 
+#if defined(CONFIG_ENGINE_THREADED) || defined(CONFIG_ENGINE_JIT)
+uint64_t jit_exec(Decode *s, uint64_t n);
+
+/* Chained blocks run at most this number of instructions before coming back here.
+ * Difftest and watchpoints need to be checked after every instruction.
+ */
+#if defined(CONFIG_DIFFTEST) || defined(CONFIG_WATCHPOINT)
+#define MAX_INST_PER_CHAIN 1
+#elif defined(CONFIG_TARGET_SHARE)
+#define MAX_INST_PER_CHAIN (ref_comparing ? 1 : 4096) // as the REF, comparing with the DUT
+#else
+#define MAX_INST_PER_CHAIN 4096
+#endif
+
+static void execute(uint64_t n) {
+  Decode s;
+  while (n > 0) {
+    uint64_t nr = MUXDEF(CONFIG_ENGINE_JIT, jit_exec, isa_exec_block)(&s, (n < MAX_INST_PER_CHAIN ? n : MAX_INST_PER_CHAIN));
+    n -= nr;
+    g_nr_guest_inst += nr;
+    trace_and_difftest(&s, cpu.pc);
+    if (nemu_state.state != NEMU_RUNNING) break;
+    IFDEF(CONFIG_DEVICE, event_update());
+  }
+}
+#else
 static void exec_once(Decode *s, vaddr_t pc) {
   s->pc = pc;
   s->snpc = pc;
@@ -72,10 +111,12 @@ static void execute(uint64_t n) {
     exec_once(&s, cpu.pc);
     g_nr_guest_inst ++;
     trace_and_difftest(&s, cpu.pc);
+    if (unlikely(nr_bp > 0)) check_bp(cpu.pc);
     if (nemu_state.state != NEMU_RUNNING) break;
-    IFDEF(CONFIG_DEVICE, device_update());
+    IFDEF(CONFIG_DEVICE, event_update());
   }
 }
+#endif
 
 static void statistic() {
   IFNDEF(CONFIG_TARGET_AM, setlocale(LC_NUMERIC, ""));
@@ -84,6 +125,20 @@ static void statistic() {
   Log("total guest instructions = " NUMBERIC_FMT, g_nr_guest_inst);
   if (g_timer > 0) Log("simulation frequency = " NUMBERIC_FMT " inst/s", g_nr_guest_inst * 1000000 / g_timer);
   else Log("Finish running in less than 1 us and can not calculate the simulation frequency");
+#ifdef CONFIG_SOFT_TLB_STAT
+  if (stlb_hit + stlb_miss > 0) Log("soft tlb hit = " NUMBERIC_FMT ", miss = " NUMBERIC_FMT ", hit rate = %.2f%%",
+      stlb_hit, stlb_miss, 100.0 * stlb_hit / (stlb_hit + stlb_miss));
+#elif defined(CONFIG_SOFT_TLB)
+  Log("soft tlb miss = " NUMBERIC_FMT, stlb_miss);
+#endif
+  IFDEF(CONFIG_RV_SV32, isa_mmu_statistic());
+#ifdef CONFIG_ITRACE
+  uint64_t disasm_hit, disasm_miss;
+  disasm_statistic(&disasm_hit, &disasm_miss);
+  if (disasm_hit + disasm_miss > 0) Log("disasm cache hit = " NUMBERIC_FMT ", miss = " NUMBERIC_FMT ", hit rate = %.2f%%",
+      disasm_hit, disasm_miss, 100.0 * disasm_hit / (disasm_hit + disasm_miss));
+#endif
+  IFDEF(CONFIG_PROFILE, profile_report());
 }
 
 void assert_fail_msg() {
@@ -105,6 +160,8 @@ void cpu_exec(uint64_t n) {
   uint64_t timer_start = get_time();
 
   execute(n);
+  // the last batch of difftest, before the state is reported
+  IFDEF(CONFIG_DIFFTEST, difftest_sync());
 
   uint64_t timer_end = get_time();
   g_timer += timer_end - timer_start;
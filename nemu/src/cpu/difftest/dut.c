@@ -17,20 +17,50 @@
 
 #include <isa.h>
 #include <cpu/cpu.h>
+#include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <utils.h>
-#include <difftest-def.h>
+#include <cpu/difftest.h>
 
 void (*ref_difftest_memcpy)(paddr_t addr, void *buf, size_t n, bool direction) = NULL;
 void (*ref_difftest_regcpy)(void *dut, bool direction) = NULL;
 void (*ref_difftest_exec)(uint64_t n) = NULL;
 void (*ref_difftest_raise_intr)(uint64_t NO) = NULL;
+bool (*ref_difftest_snapshot)(bool restore) = NULL;
+int (*ref_difftest_step_and_compare)(const DifftestCommit *dut, int n, DifftestCommit *ref) = NULL;
+bool (*ref_difftest_pmem_compare)(const DifftestPage *dut, int n, uint64_t *addr) = NULL;
+void (*ref_difftest_mmio_load)(uint64_t addr, int len, uint64_t data) = NULL;
 
 #ifdef CONFIG_DIFFTEST
 
 static bool is_skip_ref = false;
 static int skip_dut_nr_inst = 0;
 
+/* The REF runs a batch of instructions at a time, and is compared with the
+*  DUT at the end only. The DUT keeps its registers after each instruction of
+*  the batch, so that on a mismatch the REF can be rewound to a snapshot taken
+*  at the start of the batch, and bisected to the first diverging instruction.
+*/
+typedef struct {
+  vaddr_t pc;
+  CPU_state state; // after the instruction at pc
+} CommitRecord;
+
+static CommitRecord commit[CONFIG_DIFFTEST_BATCH];
+static int nr_commit = 0;
+static int batch_size = CONFIG_DIFFTEST_BATCH;
+
+/* If the REF exports difftest_step_and_compare(), only the pc and the gpr
+*  written by each instruction are kept instead, and the REF compares them
+*  with its own instructions one by one, so that the first mismatch is found
+*  without rewinding. All the registers are compared every
+*  CONFIG_DIFFTEST_SWEEP instructions.
+*/
+static DifftestCommit dirty[CONFIG_DIFFTEST_BATCH];
+static vaddr_t last_pc; // of the last instruction compared
+static int nr_unswept = 0;
+
 // this is used to let ref skip instructions which
 // can not produce consistent behavior with NEMU
 void difftest_skip_ref() {
@@ -45,6 +75,23 @@ void difftest_skip_ref() {
   skip_dut_nr_inst = 0;
 }
 
+/* The value loaded from a device is passed to the REF, which has no device,
+*  so that it runs the instruction with the value instead of being skipped and
+*  having its registers overwritten. Loads done by sdb or gdb while the guest
+*  is stopped are not run by the REF.
+*/
+void difftest_mmio_read(paddr_t addr, int len, word_t data) {
+  if (nemu_state.state != NEMU_RUNNING) return;
+  if (ref_difftest_mmio_load == NULL) difftest_skip_ref();
+  else ref_difftest_mmio_load(addr, len, data);
+}
+
+// a REF taking the values loaded from devices drops the stores to them
+void difftest_mmio_write() {
+  if (nemu_state.state != NEMU_RUNNING) return;
+  if (ref_difftest_mmio_load == NULL) difftest_skip_ref();
+}
+
 // this is used to deal with instruction packing in QEMU.
 // Sometimes letting QEMU step once will execute multiple instructions.
 // We should skip checking until NEMU's pc catches up with QEMU's pc.
@@ -52,6 +99,7 @@ void difftest_skip_ref() {
 //   Let REF run `nr_ref` instructions first.
 //   We expect that DUT will catch up with REF within `nr_dut` instructions.
 void difftest_skip_dut(int nr_ref, int nr_dut) {
+  difftest_sync();
   skip_dut_nr_inst += nr_dut;
 
   while (nr_ref -- > 0) {
@@ -81,25 +129,177 @@ void init_difftest(char *ref_so_file, long img_size, int port) {
   void (*ref_difftest_init)(int) = dlsym(handle, "difftest_init");
   assert(ref_difftest_init);
 
+  // optional, batches can not be bisected without either of them
+  ref_difftest_snapshot = dlsym(handle, "difftest_snapshot");
+  ref_difftest_step_and_compare = dlsym(handle, "difftest_step_and_compare");
+  if (ref_difftest_snapshot == NULL && ref_difftest_step_and_compare == NULL) batch_size = 1;
+  ref_difftest_pmem_compare = dlsym(handle, "difftest_pmem_compare");
+  ref_difftest_mmio_load = dlsym(handle, "difftest_mmio_load");
+
   Log("Differential testing: %s", ANSI_FMT("ON", ANSI_FG_GREEN));
-  Log("The result of every instruction will be compared with %s. "
+  Log("The result of every instruction will be compared with %s, %d instructions at a time. "
       "This will help you a lot for debugging, but also significantly reduce the performance. "
-      "If it is not necessary, you can turn it off in menuconfig.", ref_so_file);
+      "If it is not necessary, you can turn it off in menuconfig.", ref_so_file, batch_size);
 
   ref_difftest_init(port);
   ref_difftest_memcpy(RESET_VECTOR, guest_to_host(RESET_VECTOR), img_size, DIFFTEST_TO_REF);
   ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
 }
 
-static void checkregs(CPU_state *ref, vaddr_t pc) {
+static bool checkregs(CPU_state *ref, vaddr_t pc) {
   if (!isa_difftest_checkregs(ref, pc)) {
     nemu_state.state = NEMU_ABORT;
     nemu_state.halt_pc = pc;
     isa_reg_display();
+    return false;
+  }
+  return true;
+}
+
+// run the REF from the snapshot to the end of commit[i]
+static bool ref_replay(int i, CPU_state *ref_r) {
+  if (!ref_difftest_snapshot(true)) return false;
+  ref_difftest_exec(i + 1);
+  ref_difftest_regcpy(ref_r, DIFFTEST_TO_DUT);
+  return true;
+}
+
+/* the first instruction of the batch after which the registers in
+*  DIFFTEST_REG_SIZE differ, or -1 if the REF can not be rewound
+*/
+static int bisect() {
+  CPU_state ref_r;
+  int lo = 0, hi = nr_commit - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (!ref_replay(mid, &ref_r)) return -1;
+    if (memcmp(&ref_r, &commit[mid].state, DIFFTEST_REG_SIZE) == 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+static void commit_str(char *buf, size_t size, const DifftestCommit *c) {
+  if (c->rd == 0) snprintf(buf, size, "no gpr");
+  else snprintf(buf, size, "gpr[%d] = " FMT_WORD, c->rd, (word_t)c->wdata);
+}
+
+static void sync_dirty() {
+  DifftestCommit ref_c;
+  int i = ref_difftest_step_and_compare(dirty, nr_commit, &ref_c);
+  int n = nr_commit;
+  nr_commit = 0;
+  if (i == n) {
+    last_pc = dirty[n - 1].pc;
+    return;
+  }
+
+  // the registers of the DUT are ahead, only the records are reported
+  DifftestCommit *c = &dirty[i];
+  vaddr_t pc = c->pc;
+  if (c->pc != ref_c.pc) {
+    // the instruction before has gone to a wrong pc
+    pc = (i > 0 ? dirty[i - 1].pc : last_pc);
+    Log("The next pc of the instruction at pc = " FMT_WORD " is different, right = " FMT_WORD ", wrong = " FMT_WORD,
+        pc, (word_t)ref_c.pc, (word_t)c->pc);
+  } else if (difftest_commit_equal(c, &ref_c)) {
+    // the REF has stopped at a load from a device, whose address it reports
+    Log("The instruction at pc = " FMT_WORD " does not load from the device the REF loads from", pc);
+  } else {
+    char right[64], wrong[64];
+    commit_str(right, sizeof(right), &ref_c);
+    commit_str(wrong, sizeof(wrong), c);
+    Log("The instruction at pc = " FMT_WORD " writes %s, but it should write %s", pc, wrong, right);
+  }
+  nemu_state.state = NEMU_ABORT;
+  nemu_state.halt_pc = pc;
+  isa_reg_display();
+}
+
+/* run the REF over the instructions committed by the DUT since the last call,
+*  and compare their results
+*/
+void difftest_sync() {
+  if (nr_commit == 0) return;
+  if (ref_difftest_step_and_compare != NULL) {
+    sync_dirty();
+    return;
+  }
+  if (nr_commit > 1) ref_difftest_snapshot(false);
+  ref_difftest_exec(nr_commit);
+
+  CPU_state ref_r;
+  ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+  int i = nr_commit - 1;
+  if (nr_commit > 1 && memcmp(&ref_r, &commit[i].state, DIFFTEST_REG_SIZE) != 0) {
+    int first = bisect();
+    if (first < 0) Log("Can not rewind the REF, the mismatch is reported at the end of the batch");
+    else {
+      Log("The first mismatch is after instruction %d of a batch of %d", first, nr_commit);
+      if (first < i) {
+        ref_replay(first, &ref_r);
+        i = first;
+      }
+    }
+  }
+
+  // isa_difftest_checkregs() compares with cpu, which may be ahead of the batch,
+  // and the registers right after the diverging instruction are reported
+  CPU_state dut = cpu;
+  cpu = commit[i].state;
+  if (checkregs(&ref_r, commit[i].pc)) cpu = dut;
+  nr_commit = 0;
+}
+
+#ifdef CONFIG_DIFFTEST_MEM
+static DifftestPage page_hash[CONFIG_MSIZE >> PAGE_SHIFT];
+
+// report the first word of the page at addr which is different from the REF
+static void report_page(paddr_t addr) {
+  uint8_t ref_page[PAGE_SIZE], *dut_page = guest_to_host(addr);
+  ref_difftest_memcpy(addr, ref_page, PAGE_SIZE, DIFFTEST_TO_DUT);
+  int off = 0;
+  while (off < PAGE_SIZE && memcmp(ref_page + off, dut_page + off, sizeof(word_t)) == 0) off += sizeof(word_t);
+  if (off == PAGE_SIZE) {
+    Log("The page at " FMT_PADDR " is written by the REF, but not by the DUT", addr);
+    return;
+  }
+  Log("The memory at " FMT_PADDR " is different, right = " FMT_WORD ", wrong = " FMT_WORD
+      ", written in the last %d instructions. Set a watchpoint on it to find the store",
+      addr + off, host_read(ref_page + off, sizeof(word_t)), host_read(dut_page + off, sizeof(word_t)),
+      CONFIG_DIFFTEST_SWEEP);
+}
+
+// compare the pages written by either of the DUT and the REF since the last call
+static void checkmem(vaddr_t pc) {
+  if (ref_difftest_pmem_compare == NULL) return;
+  paddr_t *pages;
+  int n = pmem_dirty_pages(&pages);
+  for (int i = 0; i < n; i ++) {
+    page_hash[i] = (DifftestPage){ .addr = pages[i], .hash = difftest_page_hash(guest_to_host(pages[i])) };
   }
+  uint64_t addr;
+  bool ok = ref_difftest_pmem_compare(page_hash, n, &addr);
+  pmem_dirty_clear();
+  if (ok) return;
+  report_page(addr);
+  nemu_state.state = NEMU_ABORT;
+  nemu_state.halt_pc = pc;
+}
+#endif
+
+// compare all the registers, including those not in the commit records, and the memory written
+static void sweep(vaddr_t pc) {
+  difftest_sync();
+  nr_unswept = 0;
+  if (nemu_state.state == NEMU_ABORT) return;
+  CPU_state ref_r;
+  ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+  if (!checkregs(&ref_r, pc)) return;
+  IFDEF(CONFIG_DIFFTEST_MEM, checkmem(pc));
 }
 
-void difftest_step(vaddr_t pc, vaddr_t npc) {
+void difftest_step(vaddr_t pc, vaddr_t npc, int rd) {
   CPU_state ref_r;
 
   if (skip_dut_nr_inst > 0) {
@@ -116,16 +316,22 @@ void difftest_step(vaddr_t pc, vaddr_t npc) {
   }
 
   if (is_skip_ref) {
-    // to skip the checking of an instruction, just copy the reg state to reference design
+    // check the instructions before, then just copy the reg state to reference design
+    difftest_sync();
     ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
     is_skip_ref = false;
     return;
   }
 
-  ref_difftest_exec(1);
-  ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
-
-  checkregs(&ref_r, pc);
+  if (ref_difftest_step_and_compare != NULL) {
+    dirty[nr_commit] = (DifftestCommit){ .pc = pc, .rd = rd, .wdata = cpu.gpr[rd] };
+  } else {
+    commit[nr_commit].pc = pc;
+    commit[nr_commit].state = cpu;
+  }
+  nr_commit ++;
+  if (nr_commit == batch_size) difftest_sync();
+  if (++ nr_unswept == CONFIG_DIFFTEST_SWEEP) sweep(pc);
 }
 #else
 void init_difftest(char *ref_so_file, long img_size, int port) { }
@@ -17,25 +17,89 @@
 #include <cpu/cpu.h>
 #include <difftest-def.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <cpu/difftest.h>
 
 /*
   dut = npc
   ref = nemu
 */
 
-/* copying dut's memory data to the reference memory */
+#ifdef CONFIG_ENGINE_JIT
+void jit_flush();
+void jit_invalidate(paddr_t addr, int len);
+#endif
+
+/* Code decoded or translated from memory copied in by the DUT is stale, as
+*  the DUT also copies into a REF which is running (checkpoints, GDB).
+*  A small copy drops only the code it overlaps, like a store does.
+*/
+static void ref_code_invalidate(paddr_t addr, size_t n) {
+  if (n <= 4) {
+    IFDEF(CONFIG_DECODE_CACHE, isa_decode_cache_invalidate(addr, n));
+    IFDEF(CONFIG_ENGINE_JIT, jit_invalidate(addr, n));
+  } else {
+    IFDEF(CONFIG_DECODE_CACHE, isa_decode_cache_flush());
+    IFDEF(CONFIG_ENGINE_JIT, jit_flush());
+  }
+}
+
+/* copying dut's memory data to the reference memory, or back to report a mismatch */
 __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction) {
   if (direction == DIFFTEST_TO_REF) {
     memcpy(guest_to_host(addr), buf, n);
+    if (n > 0) ref_code_invalidate(addr, n);
   } else {
-    assert(0);
+    memcpy(buf, guest_to_host(addr), n);
+  }
+}
+
+#ifdef CONFIG_TARGET_SHARE
+/* Values loaded from devices by the DUT, in the order of its instructions, to
+*  be loaded by the same instructions of the REF, which has no device.
+*/
+#define MMIO_QUEUE_SIZE 4096 // must be no less than the number of instructions the DUT runs at a time
+typedef struct { paddr_t addr; int len; uint64_t data; } MMIOLoad;
+static MMIOLoad mmio_queue[MMIO_QUEUE_SIZE];
+static uint32_t mmio_head = 0, mmio_tail = 0;
+static uint32_t snapshot_mmio_head = 0;
+static bool mmio_mismatch = false; // the REF has loaded from a device where the DUT has not
+#define mmio_at(i) mmio_queue[(i) % MMIO_QUEUE_SIZE]
+
+__EXPORT void difftest_mmio_load(uint64_t addr, int len, uint64_t data) {
+  // those loaded since the snapshot are kept to be loaded again after rewinding
+  uint32_t head = (pmem_logging ? snapshot_mmio_head : mmio_head);
+  Assert(mmio_tail - head < MMIO_QUEUE_SIZE, "too many loads from devices are passed before the REF runs them");
+  mmio_at(mmio_tail ++) = (MMIOLoad){ .addr = addr, .len = len, .data = data };
+}
+
+/* called by paddr_read() out of pmem. If the DUT has not loaded the same
+*  bytes, the REF stops after this instruction, which the DUT reports as a
+*  mismatch of it.
+*/
+word_t difftest_ref_mmio_load(paddr_t addr, int len) {
+  MMIOLoad *l = (mmio_head == mmio_tail ? NULL : &mmio_at(mmio_head));
+  // the DUT may load a whole word, of which the REF takes some bytes
+  if (l == NULL || addr < l->addr || addr + len > l->addr + l->len) {
+    if (l == NULL) Log("The REF loads %d bytes from the device at " FMT_PADDR ", but the DUT does not", len, addr);
+    else Log("The REF loads %d bytes from the device at " FMT_PADDR ", but the DUT loads %d bytes at " FMT_PADDR,
+        len, addr, l->len, l->addr);
+    mmio_mismatch = true;
+    nemu_state.state = NEMU_STOP;
+    return 0;
   }
+  mmio_head ++;
+  uint64_t v = l->data >> ((addr - l->addr) * 8);
+  return (len < 8 ? v & ((1ull << (len * 8)) - 1) : v);
 }
+#endif
 
 /* copying dut's reg data to the reference reg */
 __EXPORT void difftest_regcpy(void *dut, bool direction) {
   CPU_state *dut_state = (CPU_state*) dut;
   if (direction == DIFFTEST_TO_REF) {
+    // the instruction skipped does not load what is passed for it
+    IFDEF(CONFIG_TARGET_SHARE, mmio_head = mmio_tail; mmio_mismatch = false);
     for (int i = 0; i < ARRLEN(cpu.gpr); i++) {
       cpu.gpr[i] = dut_state->gpr[i];
     }
@@ -60,6 +124,90 @@ __EXPORT void difftest_exec(uint64_t n) {
   cpu_exec(n);
 }
 
+#ifdef CONFIG_TARGET_SHARE
+static CPU_state snapshot;
+
+/* take a snapshot of the REF, or rewind to the last one. Rewinding fails if
+*  too much memory has been written since the snapshot.
+*/
+__EXPORT bool difftest_snapshot(bool restore) {
+  if (!restore) {
+    snapshot = cpu;
+    snapshot_mmio_head = mmio_head;
+    pmem_log_start();
+    return true;
+  }
+  if (!pmem_log_undo()) return false;
+  cpu = snapshot;
+  mmio_head = snapshot_mmio_head;
+  mmio_mismatch = false;
+  IFDEF(CONFIG_SOFT_TLB, stlb_flush());
+  return true;
+}
+
+bool ref_comparing = false;
+static const DifftestCommit *dut_commit;
+static DifftestCommit *ref_commit;
+static int nr_compared;
+
+// called by cpu_exec() after each instruction while comparing
+void difftest_ref_commit(vaddr_t pc, int rd) {
+  DifftestCommit c = { .pc = pc, .rd = rd, .wdata = cpu.gpr[rd] };
+  if (mmio_mismatch || !difftest_commit_equal(&c, &dut_commit[nr_compared])) {
+    *ref_commit = c;
+    nemu_state.state = NEMU_STOP;
+    return;
+  }
+  nr_compared ++;
+}
+
+/* run n instructions, and compare each of them with the one committed by the DUT.
+*  Return the number of them before the first mismatch, after which the REF stops,
+*  with its own commit record in ref.
+*/
+__EXPORT int difftest_step_and_compare(const DifftestCommit *dut, int n, DifftestCommit *ref) {
+  dut_commit = dut;
+  ref_commit = ref;
+  nr_compared = 0;
+  ref_comparing = true;
+  cpu_exec(n);
+  ref_comparing = false;
+  if (nr_compared < n && nemu_state.state != NEMU_STOP) {
+    // stopped before a mismatch, e.g. at the end of the program
+    *ref = (DifftestCommit){ .pc = cpu.pc, .rd = 0, .wdata = 0 };
+  }
+  return nr_compared;
+}
+
+static bool dut_written[CONFIG_MSIZE >> PAGE_SHIFT];
+
+/* compare the hashes of the pages written by the DUT since the last call with
+*  those of the REF. A page written by the REF only is different as well.
+*  Return false with the address of the first different page in addr.
+*/
+__EXPORT bool difftest_pmem_compare(const DifftestPage *dut, int n, uint64_t *addr) {
+  bool ok = true;
+  for (int i = 0; i < n; i ++) {
+    dut_written[(dut[i].addr - CONFIG_MBASE) >> PAGE_SHIFT] = true;
+    if (ok && difftest_page_hash(guest_to_host(dut[i].addr)) != dut[i].hash) {
+      *addr = dut[i].addr;
+      ok = false;
+    }
+  }
+  paddr_t *pages;
+  int nr = pmem_dirty_pages(&pages);
+  for (int i = 0; i < nr && ok; i ++) {
+    if (!dut_written[(pages[i] - CONFIG_MBASE) >> PAGE_SHIFT]) {
+      *addr = pages[i];
+      ok = false;
+    }
+  }
+  for (int i = 0; i < n; i ++) dut_written[(dut[i].addr - CONFIG_MBASE) >> PAGE_SHIFT] = false;
+  pmem_dirty_clear();
+  return ok;
+}
+#endif
+
 __EXPORT void difftest_raise_intr(word_t NO) {
   cpu.pc = isa_raise_intr(NO, cpu.pc);
 }
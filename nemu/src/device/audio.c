@@ -129,4 +129,5 @@ void init_audio() {
 
   sbuf = (uint8_t *)new_space(CONFIG_SB_SIZE);
   add_mmio_map("audio-sbuf", CONFIG_SB_ADDR, sbuf, CONFIG_SB_SIZE, NULL);
+  IFDEF(CONFIG_CHECKPOINT, checkpoint_add_state("audio", &sbuf_count, sizeof(sbuf_count), NULL));
 }
@@ -16,6 +16,7 @@
 #include <common.h>
 #include <utils.h>
 #include <device/alarm.h>
+#include <device/event.h>
 #ifndef CONFIG_TARGET_AM
 #include <SDL2/SDL.h>
 #endif
@@ -33,11 +34,13 @@ void init_alarm();
 void send_key(uint8_t, bool);
 void vga_update_screen();
 
-void device_update() {
+// polled every CONFIG_DEVICE_POLL_INTERVAL instructions, so get_time() is
+// not called on every instruction any more
+static uint64_t device_update() {
   static uint64_t last = 0;
   uint64_t now = get_time();
   if (now - last < 1000000 / TIMER_HZ) {
-    return;
+    return CONFIG_DEVICE_POLL_INTERVAL;
   }
   last = now;
 
@@ -64,6 +67,7 @@ void device_update() {
     }
   }
 #endif
+  return CONFIG_DEVICE_POLL_INTERVAL;
 }
 
 void sdl_clear_event_queue() {
@@ -86,4 +90,5 @@ void init_device() {
   IFDEF(CONFIG_HAS_SDCARD, init_sdcard());
 
   IFNDEF(CONFIG_TARGET_AM, init_alarm());
+  add_event(device_update, CONFIG_DEVICE_POLL_INTERVAL);
 }
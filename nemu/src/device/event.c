@@ -0,0 +1,64 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/event.h>
+
+#define MAX_EVENT 8
+
+typedef struct {
+  event_handler_t handler;
+  uint64_t deadline;
+} Event;
+
+static Event event[MAX_EVENT] = {};
+static int nr_event = 0;
+uint64_t g_next_event = UINT64_MAX;
+
+static void event_rearm() {
+  g_next_event = UINT64_MAX;
+  for (int i = 0; i < nr_event; i ++) {
+    if (event[i].deadline < g_next_event) g_next_event = event[i].deadline;
+  }
+}
+
+void add_event(event_handler_t h, uint64_t delay) {
+  assert(nr_event < MAX_EVENT);
+  event[nr_event ++] = (Event) { .handler = h, .deadline = g_nr_guest_inst + delay };
+  event_rearm();
+}
+
+void event_dispatch() {
+  int i = 0;
+  while (i < nr_event) {
+    if (event[i].deadline > g_nr_guest_inst) { i ++; continue; }
+    uint64_t delay = event[i].handler();
+    if (delay == 0) {
+      event[i] = event[-- nr_event];
+      continue;
+    }
+    event[i].deadline = g_nr_guest_inst + delay;
+    i ++;
+  }
+  event_rearm();
+}
+
+// g_nr_guest_inst has been set from `old`, keep the delays to the deadlines
+void event_rebase(uint64_t old) {
+  for (int i = 0; i < nr_event; i ++) {
+    uint64_t delay = (event[i].deadline > old ? event[i].deadline - old : 0);
+    event[i].deadline = g_nr_guest_inst + delay;
+  }
+  event_rearm();
+}
@@ -53,6 +53,7 @@ void init_map() {
   io_space = malloc(IO_SPACE_MAX);
   assert(io_space);
   p_space = io_space;
+  IFDEF(CONFIG_CHECKPOINT, checkpoint_add_state("io_space", io_space, IO_SPACE_MAX, NULL));
 }
 
 word_t map_read(paddr_t addr, int len, IOMap *map) {
@@ -61,6 +62,7 @@ word_t map_read(paddr_t addr, int len, IOMap *map) {
   paddr_t offset = addr - map->low;
   invoke_callback(map->callback, offset, len, false); // prepare data to read
   word_t ret = host_read(map->space + offset, len);
+  difftest_mmio_read(addr, len, ret);
   IFDEF(CONFIG_DTRACE, device_read_trace(addr, len, map));
   return ret;
 }
@@ -68,6 +70,7 @@ word_t map_read(paddr_t addr, int len, IOMap *map) {
 void map_write(paddr_t addr, int len, word_t data, IOMap *map) {
   assert(len >= 1 && len <= 8);
   check_bound(map, addr);
+  difftest_mmio_write();
   paddr_t offset = addr - map->low;
   host_write(map->space + offset, len, data);
   invoke_callback(map->callback, offset, len, true);
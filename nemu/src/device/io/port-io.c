@@ -17,9 +17,10 @@
 
 #define PORT_IO_SPACE_MAX 65535
 
-#define NR_MAP 16
+#define NR_MAP 64
 static IOMap maps[NR_MAP] = {};
 static int nr_map = 0;
+static uint8_t port_map[PORT_IO_SPACE_MAX] = {}; // map index + 1 of each port, 0 if unmapped
 
 /* device interface */
 void add_pio_map(const char *name, ioaddr_t addr, void *space, uint32_t len, io_callback_t callback) {
@@ -30,20 +31,24 @@ void add_pio_map(const char *name, ioaddr_t addr, void *space, uint32_t len, io_
   Log("Add port-io map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
       maps[nr_map].name, maps[nr_map].low, maps[nr_map].high);
 
+  for (uint32_t i = 0; i < len; i ++) {
+    assert(port_map[addr + i] == 0);
+    port_map[addr + i] = nr_map + 1;
+  }
   nr_map ++;
 }
 
 /* CPU interface */
 uint32_t pio_read(ioaddr_t addr, int len) {
   assert(addr + len - 1 < PORT_IO_SPACE_MAX);
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  assert(mapid != -1);
-  return map_read(addr, len, &maps[mapid]);
+  int mapid = port_map[addr];
+  assert(mapid != 0);
+  return map_read(addr, len, &maps[mapid - 1]);
 }
 
 void pio_write(ioaddr_t addr, int len, uint32_t data) {
   assert(addr + len - 1 < PORT_IO_SPACE_MAX);
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  assert(mapid != -1);
-  map_write(addr, len, data, &maps[mapid]);
+  int mapid = port_map[addr];
+  assert(mapid != 0);
+  map_write(addr, len, data, &maps[mapid - 1]);
 }
@@ -97,4 +97,9 @@ void init_i8042() {
   add_mmio_map("keyboard", CONFIG_I8042_DATA_MMIO, i8042_data_port_base, 4, i8042_data_io_handler);
 #endif
   IFNDEF(CONFIG_TARGET_AM, init_keymap());
+#ifdef CONFIG_CHECKPOINT
+  checkpoint_add_state("key_queue", key_queue, sizeof(key_queue), NULL);
+  checkpoint_add_state("key_f", &key_f, sizeof(key_f), NULL);
+  checkpoint_add_state("key_r", &key_r, sizeof(key_r), NULL);
+#endif
 }
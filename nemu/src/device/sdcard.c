@@ -122,6 +122,27 @@ static void sdcard_io_handler(uint32_t offset, int len, bool is_write) {
   }
 }
 
+#ifdef CONFIG_CHECKPOINT
+static struct {
+  uint32_t blkcnt, addr;
+  long blk_addr, pos;
+  bool write_cmd, read_ext_csd;
+} ckpt;
+
+// the position in the image file is part of the state of a transfer
+static void sdcard_checkpoint(bool is_load) {
+  if (is_load) {
+    blkcnt = ckpt.blkcnt; addr = ckpt.addr; blk_addr = ckpt.blk_addr;
+    write_cmd = ckpt.write_cmd; read_ext_csd = ckpt.read_ext_csd;
+    if (fp) fseek(fp, ckpt.pos, SEEK_SET);
+  } else {
+    ckpt.blkcnt = blkcnt; ckpt.addr = addr; ckpt.blk_addr = blk_addr;
+    ckpt.write_cmd = write_cmd; ckpt.read_ext_csd = read_ext_csd;
+    ckpt.pos = (fp ? ftell(fp) : 0);
+  }
+}
+#endif
+
 void init_sdcard() {
   base = (uint32_t *)new_space(0x80);
   add_mmio_map("sdhci", CONFIG_SDCARD_CTL_MMIO, base, 0x80, sdcard_io_handler);
@@ -131,4 +152,5 @@ void init_sdcard() {
   const char *img = CONFIG_SDCARD_IMG_PATH;
   fp = fopen(img, "r+");
   if (fp == NULL) Log("Can not find sdcard image: %s", img);
+  IFDEF(CONFIG_CHECKPOINT, checkpoint_add_state("sdcard", &ckpt, sizeof(ckpt), sdcard_checkpoint));
 }
@@ -15,3 +15,4 @@
 
 INC_PATH += $(NEMU_HOME)/src/engine/$(ENGINE)
 DIRS-y += src/engine/$(ENGINE)
+SRCS-$(CONFIG_ENGINE_JIT) += src/engine/interpreter/hostcall.c
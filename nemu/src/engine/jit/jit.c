@@ -0,0 +1,439 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <memory/host.h>
+#include <memory/paddr.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#ifndef __x86_64__
+#error "the JIT engine only supports x86-64 hosts"
+#endif
+
+/* Hot riscv32 basic blocks are compiled into x86-64 code. Within a block the
+ * most used guest registers live in host registers, and loads/stores to pmem
+ * are done inline. Anything else (MMIO, stores into code, CSRs, ecall, mret,
+ * div/rem ...) leaves the block and is run by the interpreter.
+ *
+ * Host registers in compiled code:
+ *   rbx: &cpu, r12: host address of pmem, rbp: code_map,
+ *   rax/rcx/rdx: scratch, the others in host_pool: guest registers
+ */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xc, CC_GE = 0xd };
+
+static const int host_pool[] = { R13, R14, R15, RSI, RDI, R8, R9, R10, R11 };
+
+#define JIT_HOT_THRESHOLD 16 // number of visits before a block is compiled
+#define JIT_MAX_INST 64
+#define JIT_MAX_BLOCK_SIZE (JIT_MAX_INST * 128 + 256)
+#define JIT_NR_BLOCK 16384
+#define JIT_CODE_SIZE (32 * 1024 * 1024)
+#define JIT_INVALID ((vaddr_t)1)
+// granularity of the map recording which pmem holds executed code
+#define CODE_LINE_SHIFT 6
+
+typedef uint32_t (*jit_code_t)(void);
+
+typedef struct {
+  vaddr_t pc;
+  uint32_t nr_inst;
+  uint32_t hot;
+  jit_code_t code; // returns the number of instructions retired
+} JitBlock;
+
+static JitBlock jblock[JIT_NR_BLOCK];
+static uint8_t *code_buf = NULL, *code_ptr = NULL;
+static uint8_t code_map[(CONFIG_MSIZE >> CODE_LINE_SHIFT) + 1];
+static int8_t gmap[32]; // host register holding each guest register, -1 if none
+
+#define GPR_OFF(r) (offsetof(CPU_state, gpr) + (r) * sizeof(word_t))
+#define PC_OFF offsetof(CPU_state, pc)
+#define code_line(addr) code_map[((addr) - CONFIG_MBASE) >> CODE_LINE_SHIFT]
+
+// --- x86-64 emitter ---
+static inline void emit8(uint8_t b) { *code_ptr ++ = b; }
+static inline void emit32(uint32_t v) { memcpy(code_ptr, &v, 4); code_ptr += 4; }
+static inline void emit64(uint64_t v) { memcpy(code_ptr, &v, 8); code_ptr += 8; }
+
+static void emit_rex(int w, int reg, int rm) {
+  uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+  if (rex != 0x40) emit8(rex);
+}
+
+// op reg, rm (register direct); opcodes above 0xff are 0x0f-escaped
+static void emit_rr(int op, int reg, int rm) {
+  emit_rex(0, reg, rm);
+  if (op > 0xff) emit8(op >> 8);
+  emit8(op & 0xff);
+  emit8(0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// op reg, [rbx + off]
+static void emit_rcpu(int op, int reg, uint32_t off) {
+  emit_rex(0, reg, RBX);
+  emit8(op);
+  emit8(0x80 | (reg & 7) << 3 | RBX);
+  emit32(off);
+}
+
+// op reg, [r12 + rcx]
+static void emit_rpmem(int op, int reg) {
+  emit_rex(0, reg, R12);
+  if (op > 0xff) emit8(op >> 8);
+  emit8(op & 0xff);
+  emit8(0x04 | (reg & 7) << 3);
+  emit8(0x0c);
+}
+
+static void emit_mov_ri(int reg, uint32_t imm) {
+  emit_rex(0, 0, reg);
+  emit8(0xb8 + (reg & 7));
+  emit32(imm);
+}
+
+// group-1 alu with imm32: /0 add, /1 or, /4 and, /5 sub, /6 xor, /7 cmp
+static void emit_alu_ri(int ext, int reg, uint32_t imm) {
+  emit_rex(0, 0, reg);
+  emit8(0x81);
+  emit8(0xc0 | ext << 3 | (reg & 7));
+  emit32(imm);
+}
+
+// shift: /4 shl, /5 shr, /7 sar, by imm8 or by cl when imm < 0
+static void emit_shift(int ext, int reg, int imm) {
+  emit_rex(0, 0, reg);
+  emit8(imm < 0 ? 0xd3 : 0xc1);
+  emit8(0xc0 | ext << 3 | (reg & 7));
+  if (imm >= 0) emit8(imm);
+}
+
+// eax = cc ? 1 : 0
+static void emit_setcc(int cc) {
+  emit8(0x0f); emit8(0x90 | cc); emit8(0xc0); // setcc al
+  emit8(0x0f); emit8(0xb6); emit8(0xc0);      // movzx eax, al
+}
+
+// high 32 bits of rax * rcx, both already extended to 64 bits
+static void emit_mul_high() {
+  emit8(0x48); emit8(0x0f); emit8(0xaf); emit8(0xc1); // imul rax, rcx
+  emit8(0x48); emit8(0xc1); emit8(0xe8); emit8(32);   // shr rax, 32
+}
+
+// returns the end of the rel32 field, for patch()
+static uint8_t *emit_jcc(int cc) { emit8(0x0f); emit8(0x80 | cc); emit32(0); return code_ptr; }
+static uint8_t *emit_jmp() { emit8(0xe9); emit32(0); return code_ptr; }
+static void patch(uint8_t *end, uint8_t *target) { int32_t rel = target - end; memcpy(end - 4, &rel, 4); }
+
+// --- guest register access ---
+static void load_gpr(int reg, int g) {
+  if (g == 0) emit_rr(0x31, reg, reg); // xor reg, reg
+  else if (gmap[g] >= 0) emit_rr(0x8b, reg, gmap[g]);
+  else emit_rcpu(0x8b, reg, GPR_OFF(g));
+}
+
+static void store_gpr(int g, int reg) {
+  if (g == 0) return;
+  if (gmap[g] >= 0) emit_rr(0x89, reg, gmap[g]);
+  else emit_rcpu(0x89, reg, GPR_OFF(g));
+}
+
+// set cpu.pc and leave the block with `nr` instructions retired
+static void emit_exit(uint8_t *exit_stub, vaddr_t npc, uint32_t nr) {
+  emit8(0xc7); emit8(0x80 | RBX); emit32(PC_OFF); emit32(npc); // mov dword [rbx + pc], npc
+  emit_mov_ri(RAX, nr);
+  patch(emit_jmp(), exit_stub);
+}
+
+// ecx = guest address - MBASE, or leave the block if the access can not be done inline
+static void emit_pmem_check(uint8_t *exit_stub, int rs1, word_t imm, int len, vaddr_t pc, int k, bool is_write) {
+  load_gpr(RCX, rs1);
+  emit_alu_ri(0, RCX, imm - CONFIG_MBASE);
+  emit_alu_ri(7, RCX, CONFIG_MSIZE - len + 1); // the last byte must be in pmem as well
+  uint8_t *slow = emit_jcc(CC_AE), *slow2 = NULL, *slow3 = NULL;
+  if (is_write) {
+    // stores into lines holding executed code go through paddr_write()
+    emit_rr(0x89, RCX, RAX);        // mov eax, ecx
+    emit_shift(5, RAX, CODE_LINE_SHIFT);
+    emit8(0x80); emit8(0x7c); emit8(0x05); emit8(0x00); emit8(0x00); // cmp byte [rbp + rax], 0
+    slow2 = emit_jcc(CC_NE);
+    if (len > 1) {
+      // a misaligned store may reach into the next line
+      emit_rr(0x89, RCX, RAX);      // mov eax, ecx
+      emit_alu_ri(0, RAX, len - 1);
+      emit_shift(5, RAX, CODE_LINE_SHIFT);
+      emit8(0x80); emit8(0x7c); emit8(0x05); emit8(0x00); emit8(0x00); // cmp byte [rbp + rax], 0
+      slow3 = emit_jcc(CC_NE);
+    }
+  }
+  uint8_t *fast = emit_jmp();
+  patch(slow, code_ptr);
+  if (slow2 != NULL) patch(slow2, code_ptr);
+  if (slow3 != NULL) patch(slow3, code_ptr);
+  emit_exit(exit_stub, pc, k);
+  patch(fast, code_ptr);
+}
+
+// --- riscv32 decoding ---
+enum { KIND_NONE, KIND_NORMAL, KIND_END };
+
+static int inst_kind(uint32_t i, int *rd, int *rs1, int *rs2) {
+  int f3 = BITS(i, 14, 12), f7 = BITS(i, 31, 25);
+  *rd = BITS(i, 11, 7); *rs1 = BITS(i, 19, 15); *rs2 = BITS(i, 24, 20);
+  switch (BITS(i, 6, 0)) {
+    case 0x37: case 0x17: *rs1 = *rs2 = 0; return KIND_NORMAL;      // lui, auipc
+    case 0x6f: *rs1 = *rs2 = 0; return KIND_END;                    // jal
+    case 0x67: *rs2 = 0; return (f3 == 0 ? KIND_END : KIND_NONE);   // jalr
+    case 0x63: *rd = 0; return (f3 != 2 && f3 != 3 ? KIND_END : KIND_NONE);
+    case 0x03: *rs2 = 0; return (f3 != 3 && f3 < 6 ? KIND_NORMAL : KIND_NONE);
+    case 0x23: *rd = 0; return (f3 < 3 ? KIND_NORMAL : KIND_NONE);
+    case 0x13: *rs2 = 0;
+      if (f3 == 1) return (f7 == 0 ? KIND_NORMAL : KIND_NONE);
+      if (f3 == 5) return (f7 == 0 || f7 == 0x20 ? KIND_NORMAL : KIND_NONE);
+      return KIND_NORMAL;
+    case 0x33:
+      if (f7 == 0) return KIND_NORMAL;
+      if (f7 == 0x20) return (f3 == 0 || f3 == 5 ? KIND_NORMAL : KIND_NONE);
+      if (f7 == 0x01) return (f3 == 0 || f3 == 1 || f3 == 3 ? KIND_NORMAL : KIND_NONE); // mul, mulh, mulhu
+      return KIND_NONE;
+    default: return KIND_NONE;
+  }
+}
+
+#define immI(i) ((word_t)SEXT(BITS(i, 31, 20), 12))
+#define immU(i) ((word_t)SEXT(BITS(i, 31, 12), 20) << 12)
+#define immS(i) ((word_t)(SEXT(BITS(i, 31, 25), 7) << 5) | BITS(i, 11, 7))
+#define immJ(i) ((word_t)(SEXT(BITS(i, 31, 31), 1) << 20) | BITS(i, 19, 12) << 12 | BITS(i, 20, 20) << 11 | BITS(i, 30, 21) << 1)
+#define immB(i) ((word_t)(SEXT(BITS(i, 31, 31), 1) << 12) | BITS(i, 7, 7) << 11 | BITS(i, 30, 25) << 5 | BITS(i, 11, 8) << 1)
+
+// translate the k-th instruction of a block
+static void jit_gen(uint8_t *exit_stub, uint32_t i, vaddr_t pc, int k) {
+  int rd = BITS(i, 11, 7), rs1 = BITS(i, 19, 15), rs2 = BITS(i, 24, 20);
+  int f3 = BITS(i, 14, 12), f7 = BITS(i, 31, 25);
+  switch (BITS(i, 6, 0)) {
+    case 0x37: emit_mov_ri(RAX, immU(i)); store_gpr(rd, RAX); break;
+    case 0x17: emit_mov_ri(RAX, pc + immU(i)); store_gpr(rd, RAX); break;
+    case 0x6f:
+      if (rd != 0) { emit_mov_ri(RAX, pc + 4); store_gpr(rd, RAX); }
+      emit_exit(exit_stub, pc + immJ(i), k + 1);
+      break;
+    case 0x67:
+      load_gpr(RAX, rs1);
+      emit_alu_ri(0, RAX, immI(i));
+      emit_alu_ri(4, RAX, ~1u);
+      emit_rcpu(0x89, RAX, PC_OFF);
+      if (rd != 0) { emit_mov_ri(RCX, pc + 4); store_gpr(rd, RCX); }
+      emit_mov_ri(RAX, k + 1);
+      patch(emit_jmp(), exit_stub);
+      break;
+    case 0x63: {
+      static const int cc[] = { CC_E, CC_NE, 0, 0, CC_L, CC_GE, CC_B, CC_AE };
+      load_gpr(RAX, rs1);
+      load_gpr(RCX, rs2);
+      emit_rr(0x39, RCX, RAX); // cmp eax, ecx
+      uint8_t *taken = emit_jcc(cc[f3]);
+      emit_exit(exit_stub, pc + 4, k + 1);
+      patch(taken, code_ptr);
+      emit_exit(exit_stub, pc + immB(i), k + 1);
+      break;
+    }
+    case 0x03: {
+      static const int op[] = { 0x0fbe, 0x0fbf, 0x8b, 0, 0x0fb6, 0x0fb7 };
+      emit_pmem_check(exit_stub, rs1, immI(i), 1 << (f3 & 3), pc, k, false);
+      emit_rpmem(op[f3], RAX);
+      store_gpr(rd, RAX);
+      break;
+    }
+    case 0x23:
+      emit_pmem_check(exit_stub, rs1, immS(i), 1 << f3, pc, k, true);
+      load_gpr(RDX, rs2);
+      if (f3 == 1) emit8(0x66);
+      emit_rpmem(f3 == 0 ? 0x88 : 0x89, RDX);
+      break;
+    case 0x13: {
+      word_t imm = immI(i);
+      load_gpr(RAX, rs1);
+      switch (f3) {
+        case 0: emit_alu_ri(0, RAX, imm); break;
+        case 2: emit_alu_ri(7, RAX, imm); emit_setcc(CC_L); break;
+        case 3: emit_alu_ri(7, RAX, imm); emit_setcc(CC_B); break;
+        case 4: emit_alu_ri(6, RAX, imm); break;
+        case 6: emit_alu_ri(1, RAX, imm); break;
+        case 7: emit_alu_ri(4, RAX, imm); break;
+        case 1: emit_shift(4, RAX, imm & 0x1f); break;
+        case 5: emit_shift(f7 == 0 ? 5 : 7, RAX, imm & 0x1f); break;
+      }
+      store_gpr(rd, RAX);
+      break;
+    }
+    case 0x33:
+      load_gpr(RAX, rs1);
+      load_gpr(RCX, rs2);
+      if (f7 == 0x01) {
+        switch (f3) {
+          case 0: emit_rr(0x0faf, RAX, RCX); break; // imul eax, ecx
+          case 1: emit8(0x48); emit8(0x63); emit8(0xc0);  // movsxd rax, eax
+                  emit8(0x48); emit8(0x63); emit8(0xc9);  // movsxd rcx, ecx
+                  emit_mul_high(); break;
+          case 3: emit_mul_high(); break;
+        }
+      } else {
+        switch (f3) {
+          case 0: emit_rr(f7 == 0 ? 0x01 : 0x29, RCX, RAX); break;
+          case 1: emit_shift(4, RAX, -1); break;
+          case 2: emit_rr(0x39, RCX, RAX); emit_setcc(CC_L); break;
+          case 3: emit_rr(0x39, RCX, RAX); emit_setcc(CC_B); break;
+          case 4: emit_rr(0x31, RCX, RAX); break;
+          case 5: emit_shift(f7 == 0 ? 5 : 7, RAX, -1); break;
+          case 6: emit_rr(0x09, RCX, RAX); break;
+          case 7: emit_rr(0x21, RCX, RAX); break;
+        }
+      }
+      store_gpr(rd, RAX);
+      break;
+  }
+}
+
+// --- block cache ---
+void jit_flush() {
+  for (int i = 0; i < JIT_NR_BLOCK; i ++) {
+    jblock[i].pc = JIT_INVALID;
+  }
+  memset(code_map, 0, sizeof(code_map));
+  code_ptr = code_buf;
+  // interpreted instructions are tracked by code_map as well
+  IFDEF(CONFIG_DECODE_CACHE, isa_decode_cache_flush());
+}
+
+static jit_code_t jit_compile(vaddr_t pc, uint32_t *nr_inst) {
+  uint32_t inst[JIT_MAX_INST];
+  int nr = 0, use[32] = {}, def[32] = {};
+  while (nr < JIT_MAX_INST && in_pmem(pc + nr * 4)) {
+    if (nr > 0 && unlikely(nr_bp > 0) && has_bp(pc + nr * 4)) break; // a breakpoint starts a new block
+    int rd, rs1, rs2;
+    uint32_t i = host_read(guest_to_host(pc + nr * 4), 4);
+    int kind = inst_kind(i, &rd, &rs1, &rs2);
+    if (kind == KIND_NONE) break;
+    inst[nr ++] = i;
+    use[rd] ++; use[rs1] ++; use[rs2] ++;
+    def[rd] = 1;
+    if (kind == KIND_END) break;
+  }
+  if (nr == 0) return NULL;
+
+  // keep the most used guest registers in host registers
+  memset(gmap, -1, sizeof(gmap));
+  use[0] = 0;
+  for (int h = 0; h < ARRLEN(host_pool); h ++) {
+    int best = 0;
+    for (int g = 1; g < 32; g ++) {
+      if (gmap[g] < 0 && use[g] > use[best]) best = g;
+    }
+    if (use[best] < 2) break;
+    gmap[best] = host_pool[h];
+  }
+
+  // the common exit comes first, so that every exit jumps backward to it
+  uint8_t *exit_stub = code_ptr;
+  for (int g = 1; g < 32; g ++) {
+    if (gmap[g] >= 0 && def[g]) emit_rcpu(0x89, gmap[g], GPR_OFF(g));
+  }
+  emit8(0x41); emit8(0x5f); emit8(0x41); emit8(0x5e); // pop r15, r14
+  emit8(0x41); emit8(0x5d); emit8(0x41); emit8(0x5c); // pop r13, r12
+  emit8(0x5d); emit8(0x5b); emit8(0xc3);              // pop rbp, rbx; ret
+
+  jit_code_t entry = (jit_code_t)code_ptr;
+  emit8(0x53); emit8(0x55); emit8(0x41); emit8(0x54); // push rbx, rbp, r12
+  emit8(0x41); emit8(0x55); emit8(0x41); emit8(0x56); // push r13, r14
+  emit8(0x41); emit8(0x57);                           // push r15
+  emit8(0x48); emit8(0xbb); emit64((uintptr_t)&cpu);
+  emit8(0x49); emit8(0xbc); emit64((uintptr_t)guest_to_host(CONFIG_MBASE));
+  emit8(0x48); emit8(0xbd); emit64((uintptr_t)code_map);
+  for (int g = 1; g < 32; g ++) {
+    if (gmap[g] >= 0) emit_rcpu(0x8b, gmap[g], GPR_OFF(g));
+  }
+
+  for (int k = 0; k < nr; k ++) {
+    jit_gen(exit_stub, inst[k], pc + k * 4, k);
+    code_line(pc + k * 4) = 1;
+  }
+  int rd, rs1, rs2;
+  if (inst_kind(inst[nr - 1], &rd, &rs1, &rs2) != KIND_END) emit_exit(exit_stub, pc + nr * 4, nr);
+
+  *nr_inst = nr;
+  return entry;
+}
+
+static JitBlock *jit_lookup(vaddr_t pc) {
+  JitBlock *b = &jblock[(pc >> 2) & (JIT_NR_BLOCK - 1)];
+  if (b->pc != pc) {
+    b->pc = pc;
+    b->hot = 0;
+    b->code = NULL;
+  }
+  if (b->code == NULL && ++ b->hot == JIT_HOT_THRESHOLD) {
+    if (code_ptr + JIT_MAX_BLOCK_SIZE > code_buf + JIT_CODE_SIZE) {
+      jit_flush();
+      b->pc = pc;
+      b->hot = JIT_HOT_THRESHOLD;
+    }
+    b->code = jit_compile(pc, &b->nr_inst);
+  }
+  return b;
+}
+
+void jit_invalidate(paddr_t addr, int len) {
+  if (code_line(addr) || code_line(addr + len - 1)) jit_flush();
+}
+
+uint64_t jit_exec(Decode *s, uint64_t n) {
+  uint64_t nr_exec = 0;
+  while (nr_exec < n) {
+    // difftest compares after every instruction, so it single-steps with the interpreter.
+    // So do watchpoints, which hook the stores done inline by compiled code.
+    if (!ISDEF(CONFIG_DIFFTEST) && !ISDEF(CONFIG_WATCHPOINT)) {
+      JitBlock *b = jit_lookup(cpu.pc);
+      if (b->code != NULL && b->nr_inst <= n - nr_exec) {
+        uint32_t nr = b->code();
+        nr_exec += nr;
+        if (nr == b->nr_inst) {
+          if (unlikely(nr_bp > 0)) check_bp(cpu.pc);
+          if (nemu_state.state != NEMU_RUNNING) break;
+          continue;
+        }
+        // a side exit, the instruction at cpu.pc is left to the interpreter
+      }
+    }
+    s->pc = s->snpc = cpu.pc;
+    if (in_pmem(s->pc)) code_line(s->pc) = 1;
+    isa_exec_once(s);
+    cpu.pc = s->dnpc;
+    nr_exec ++;
+    if (unlikely(nr_bp > 0)) check_bp(cpu.pc);
+    if (nemu_state.state != NEMU_RUNNING) break;
+  }
+  return nr_exec;
+}
+
+void init_jit() {
+  code_buf = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  Assert(code_buf != MAP_FAILED, "can not allocate code buffer for the JIT");
+  jit_flush();
+  Log("JIT code buffer = %p, size = %d KB", code_buf, JIT_CODE_SIZE / 1024);
+}
@@ -15,3 +15,8 @@
 
 INC_PATH += $(NEMU_HOME)/src/isa/$(GUEST_ISA)/include
 DIRS-y += src/isa/$(GUEST_ISA)
+
+ifdef CONFIG_DECODE_TREE
+DECODE_TREE_DIR = $(NEMU_HOME)/build/$(GUEST_ISA)-decode-tree
+INC_PATH += $(DECODE_TREE_DIR)
+endif
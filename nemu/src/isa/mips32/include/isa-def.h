@@ -32,5 +32,6 @@ typedef struct {
 } mips32_ISADecodeInfo;
 
 #define isa_mmu_check(vaddr, len, type) (MMU_DIRECT)
+#define isa_inst_rd(s) 0 // not recorded, gprs are only compared as a whole
 
 #endif
@@ -19,8 +19,8 @@
 #include <cpu/decode.h>
 
 #define R(i) gpr(i)
-#define Mr vaddr_read
-#define Mw vaddr_write
+#define Mr MUXDEF(CONFIG_SOFT_TLB, stlb_read, vaddr_read)
+#define Mw MUXDEF(CONFIG_SOFT_TLB, stlb_write, vaddr_write)
 
 enum {
   TYPE_I, TYPE_U,
@@ -31,6 +31,7 @@ typedef struct {
   word_t gpr[MUXDEF(CONFIG_RVE, 16, 32)];
   vaddr_t pc;
   word_t csr[csr_num];
+  word_t satp; // kept out of csr[], whose layout is shared with the difftest REF
 } MUXDEF(CONFIG_RV64, riscv64_CPU_state, riscv32_CPU_state);
 
 // decode
@@ -38,8 +39,15 @@ typedef struct {
   union {
     uint32_t val;
   } inst;
+  uint8_t rd; // the gpr written by the instruction, 0 if none
 } MUXDEF(CONFIG_RV64, riscv64_ISADecodeInfo, riscv32_ISADecodeInfo);
 
+#define isa_inst_rd(s) ((s)->isa.rd)
+
+#ifdef CONFIG_RV_SV32
+#define isa_mmu_check(vaddr, len, type) ((cpu.satp >> 31) ? MMU_TRANSLATE : MMU_DIRECT)
+#else
 #define isa_mmu_check(vaddr, len, type) (MMU_DIRECT)
+#endif
 
 #endif
@@ -43,4 +43,6 @@ void init_isa() {
 
   /* Initialize this virtual computer system. */
   restart();
+
+  IFDEF(CONFIG_DECODE_CACHE, isa_decode_cache_flush());
 }
@@ -17,11 +17,12 @@
 #include <cpu/cpu.h>
 #include <cpu/ifetch.h>
 #include <cpu/decode.h>
+#include <memory/paddr.h>
 
 #define R(i) gpr(i)
 #define CSR(i) csr(i)
-#define Mr vaddr_read
-#define Mw vaddr_write
+#define Mr MUXDEF(CONFIG_SOFT_TLB, stlb_read, vaddr_read)
+#define Mw MUXDEF(CONFIG_SOFT_TLB, stlb_write, vaddr_write)
 #define Byte 1
 
 /* modify difftest.cc would found spike has different event NO send in ecall 
@@ -36,6 +37,15 @@
 */
 #define MRET(dnpc) {cpu.csr[mstatus] = 0x80; dnpc = cpu.csr[mepc]; } 
 
+#ifdef CONFIG_RV_SV32
+void isa_mmu_satp_write(word_t old);
+#define CSRW(i, val) { word_t __old = CSR(i); CSR(i) = (val); if ((i) == CSR_SATP && __old != CSR(i)) isa_mmu_satp_write(__old); }
+#define SFENCE_VMA(s, src1, src2) isa_mmu_sfence(src1, BITS((s)->isa.inst.val, 19, 15) == 0, src2, BITS((s)->isa.inst.val, 24, 20) == 0)
+#else
+#define CSRW(i, val) { CSR(i) = (val); }
+#define SFENCE_VMA(s, src1, src2)
+#endif
+
 enum {
   TYPE_I, TYPE_U, TYPE_S,
   TYPE_J, TYPE_R, TYPE_B,
@@ -54,7 +64,7 @@ static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_
   uint32_t i = s->isa.inst.val;
   int rs1 = BITS(i, 19, 15);
   int rs2 = BITS(i, 24, 20);
-  *rd     = BITS(i, 11, 7);
+  *rd     = (type == TYPE_S || type == TYPE_B ? 0 : BITS(i, 11, 7)); // the bits are imm otherwise
   switch (type) {
     case TYPE_I: src1R();          immI(); break;
     case TYPE_U:                   immU(); break;
@@ -65,31 +75,91 @@ static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_
   }
 }
 
+#ifdef CONFIG_DECODE_CACHE
+/* A direct-mapped table indexed by pc, keeping the result of decode_exec()'s
+*  pattern matching so that a hit jumps straight to the execute body.
+*  rs1/rs2 are set to 0 for types which do not read them, so reading
+*  R(rs1)/R(rs2) unconditionally on a hit is always safe.
+*/
+typedef struct {
+  vaddr_t pc;
+  uint32_t inst;
+  const void *handler;
+  uint8_t rd, rs1, rs2;
+  word_t imm;
+  IFDEF(CONFIG_RV_SV32, paddr_t ppc); // physical pc, looked up by stores
+} DecodeCache;
+
+#define DCACHE_INVALID ((vaddr_t)1) // never a valid pc, as pc is 4-byte aligned
+#define dcache_line(addr) (&dcache[((addr) >> 2) & (CONFIG_DECODE_CACHE_SIZE - 1)])
+
+static DecodeCache dcache[CONFIG_DECODE_CACHE_SIZE];
+
+#ifdef CONFIG_RV_SV32
+static paddr_t dcache_ppc(vaddr_t pc) {
+  if (isa_mmu_check(pc, 4, MEM_TYPE_IFETCH) == MMU_DIRECT) return pc;
+  return (isa_mmu_translate(pc, 4, MEM_TYPE_IFETCH) & ~(paddr_t)PAGE_MASK) | (pc & PAGE_MASK);
+}
+#endif
+
+static void decode_cache_fill(DecodeCache *c, Decode *s, const void *handler, int rd, word_t imm, int type) {
+  uint32_t i = s->isa.inst.val;
+  bool use_src1 = (type == TYPE_I || type == TYPE_S || type == TYPE_R || type == TYPE_B);
+  bool use_src2 = (type == TYPE_S || type == TYPE_R || type == TYPE_B);
+  c->pc = s->pc;
+  c->inst = i;
+  c->handler = handler;
+  c->rd = rd;
+  c->rs1 = use_src1 ? BITS(i, 19, 15) : 0;
+  c->rs2 = use_src2 ? BITS(i, 24, 20) : 0;
+  c->imm = imm;
+  IFDEF(CONFIG_RV_SV32, c->ppc = dcache_ppc(s->pc));
+}
+#else
+typedef struct DecodeCache DecodeCache;
+#endif
+
 void func_call_trace(vaddr_t addr_curr, vaddr_t addr_func);
-void func_ret_trace(vaddr_t addr_curr);
+void func_ret_trace(vaddr_t addr_curr, vaddr_t addr_ret);
 
 void func_trace_check(int rd, vaddr_t addr_curr, vaddr_t addr_func, word_t *src1) {
   #ifdef CONFIG_FTRACE
   if (rd == 1) {
     func_call_trace(addr_curr, addr_func);
   } else if (rd == 0 && src1 != NULL && *src1 == R(1)) {
-    func_ret_trace(addr_curr);
+    func_ret_trace(addr_curr, addr_func);
   }
   #endif
 }
 
-static int decode_exec(Decode *s) {
+/* With nr == 0, match the instruction in `s` and execute it, recording the
+*  decoded result into `op` if it is not NULL.
+*  With nr > 0, run the already decoded op[0 .. nr-1] back to back, threading
+*  from one execute body to the next. The run stops early if an op has been
+*  invalidated by a store. Returns the number of instructions executed.
+*/
+static int decode_exec(Decode *s, DecodeCache *op, int nr) {
   int rd = 0;
   word_t src1 = 0, src2 = 0, imm = 0;
   s->dnpc = s->snpc;
+#ifdef CONFIG_DECODE_CACHE
+  const DecodeCache *first = op, *last = NULL;
+#endif
 
   #define INSTPAT_INST(s) ((s)->isa.inst.val)
   #define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
     decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
-    __VA_ARGS__ ; \
+    IFDEF(CONFIG_DECODE_CACHE, if (op != NULL) decode_cache_fill(op, s, &&concat(__exec_, name), rd, imm, concat(TYPE_, type))); \
+    IFDEF(CONFIG_DECODE_CACHE, concat(__exec_, name):) __VA_ARGS__ ; \
   }
 
-  INSTPAT_START();
+#ifdef CONFIG_DECODE_CACHE
+  // decoded ops skip the pattern matching, including the decode tree
+  const void **done = &&__instpat_end_rv;
+  if (nr > 0) goto __op_start;
+#endif
+
+  INSTPAT_START(rv);
   INSTPAT("??????? ????? ????? ??? ????? 01101 11", lui    , U, R(rd) = imm); // Load Unsigned Imm
   INSTPAT("??????? ????? ????? ??? ????? 00101 11", auipc  , U, R(rd) = s->pc + imm); // Add Upper Imm to PC
 
@@ -119,7 +189,7 @@ static int decode_exec(Decode *s) {
   INSTPAT("??????? ????? ????? 010 ????? 00100 11", slti   , I, R(rd) = (sword_t)src1 < (sword_t)imm); // Set Less Than Imm
   INSTPAT("??????? ????? ????? 011 ????? 00100 11", sltiu  , I, R(rd) = src1 < imm); // Set Less Than Imm Unsigned
   INSTPAT("??????? ????? ????? 100 ????? 00100 11", xori   , I, R(rd) = src1 ^ imm); // XOR Imm
-  INSTPAT("??????? ????? ????? 110 ????? 00100 11", xori   , I, R(rd) = src1 | imm); // OR Imm
+  INSTPAT("??????? ????? ????? 110 ????? 00100 11", ori    , I, R(rd) = src1 | imm); // OR Imm
   INSTPAT("??????? ????? ????? 111 ????? 00100 11", andi   , I, R(rd) = src1 & imm); // AND Imm
 
   INSTPAT("0000000 ????? ????? 001 ????? 00100 11", slli   , I, R(rd) = src1 << (imm & 0x1f)); // Shift Left Logical Imm 
@@ -147,21 +217,205 @@ static int decode_exec(Decode *s) {
   INSTPAT("0000001 ????? ????? 111 ????? 01100 11", remu   , R, R(rd) = src1 % src2); // REMainder Unsigned
 
   /* For Operation System */
-  INSTPAT("??????? ????? ????? 001 ????? 11100 11", csrrw  , I, R(rd) = CSR(imm); CSR(imm) = src1); // CSR Read Write
-  INSTPAT("??????? ????? ????? 010 ????? 11100 11", csrrs  , I, R(rd) = CSR(imm); CSR(imm) |= src1); // CSR Read Set
+  INSTPAT("??????? ????? ????? 001 ????? 11100 11", csrrw  , I, R(rd) = CSR(imm); CSRW(imm, src1)); // CSR Read Write
+  INSTPAT("??????? ????? ????? 010 ????? 11100 11", csrrs  , I, R(rd) = CSR(imm); CSRW(imm, CSR(imm) | src1)); // CSR Read Set
   INSTPAT("0000000 00000 00000 000 00000 11100 11", ecall  , N, ECALL(s->dnpc)); // Exception CALL
   INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak , N, NEMUTRAP(s->pc, R(10))); // R(10) is $a0
   INSTPAT("0011000 00010 00000 000 00000 11100 11", mret   , R, MRET(s->dnpc);); // Machine RETurn
+  INSTPAT("0001001 ????? ????? 000 00000 11100 11", sfence_vma, R, SFENCE_VMA(s, src1, src2)); // Supervisor FENCE Virtual Memory
 
   INSTPAT("??????? ????? ????? ??? ????? ????? ??", inv    , N, INV(s->pc)); // If None of previous rules Valid
-  INSTPAT_END();
+
+#ifdef CONFIG_DECODE_CACHE
+__op_start:
+  last = op + nr - 1;
+  __instpat_end = (nr > 1 ? &&__op_next : done);
+  goto __op_dispatch;
+__op_next:
+  R(0) = 0;
+  op ++;
+  if (unlikely(op->pc == DCACHE_INVALID)) { op --; goto *(done); }
+  if (op == last) __instpat_end = done;
+__op_dispatch:
+  s->pc = op->pc;
+  s->snpc = s->dnpc = op->pc + 4;
+  s->isa.inst.val = op->inst; // for the tracers and the bodies reading the raw bits
+  rd = op->rd; src1 = R(op->rs1); src2 = R(op->rs2); imm = op->imm;
+  goto *(op->handler);
+#endif
+  INSTPAT_END(rv);
 
   R(0) = 0; // reset $zero to 0
+  s->isa.rd = rd;
 
-  return 0;
+#ifdef CONFIG_DECODE_CACHE
+  if (nr > 0) return op - first + 1;
+#endif
+  return 1;
 }
 
 int isa_exec_once(Decode *s) {
+#ifdef CONFIG_DECODE_CACHE
+  DecodeCache *c = dcache_line(s->pc);
+  if (likely(c->pc == s->pc)) {
+    return decode_exec(s, c, 1);
+  }
+  s->isa.inst.val = inst_fetch(&s->snpc, 4);
+  return decode_exec(s, c, 0);
+#else
   s->isa.inst.val = inst_fetch(&s->snpc, 4);
-  return decode_exec(s);
+  return decode_exec(s, NULL, 0);
+#endif
+}
+
+#ifdef CONFIG_ENGINE_THREADED
+/* Basic blocks are translated on their first run: each instruction is executed
+*  by the pattern matcher and its decoded result is appended to the block, until
+*  a control transfer or a system instruction. Later runs thread through the ops
+*  in decode_exec(). Each block remembers its taken/fall-through successors, a
+*  link is only followed when the tag of the linked block still matches.
+*/
+#define TBLOCK_MAX_INST 32
+#define TBLOCK_INVALID DCACHE_INVALID
+// granularity of the map recording which pmem holds translated code
+#define CODE_LINE_SHIFT 8
+
+typedef struct TBlock {
+  vaddr_t pc;
+  int nr;
+  struct TBlock *succ[2]; // 0: jump target, 1: fall through
+  DecodeCache op[TBLOCK_MAX_INST];
+} TBlock;
+
+#define tblock_line(addr) (&tblock[((addr) >> 2) & (CONFIG_TBLOCK_NR - 1)])
+
+static TBlock tblock[CONFIG_TBLOCK_NR];
+static uint8_t code_map[(CONFIG_MSIZE >> CODE_LINE_SHIFT) / 8 + 1];
+
+static inline bool code_map_test(paddr_t addr) {
+  paddr_t line = (addr - CONFIG_MBASE) >> CODE_LINE_SHIFT;
+  return code_map[line / 8] & (1 << (line % 8));
+}
+
+static inline void code_map_set(paddr_t addr) {
+  paddr_t line = (addr - CONFIG_MBASE) >> CODE_LINE_SHIFT;
+  code_map[line / 8] |= 1 << (line % 8);
+}
+
+static void tblock_kill(TBlock *tb) {
+  for (int i = 0; i < tb->nr; i ++) {
+    tb->op[i].pc = DCACHE_INVALID;
+  }
+  tb->pc = TBLOCK_INVALID;
+  tb->nr = 0;
+}
+
+static void tblock_invalidate(paddr_t addr, int len) {
+  paddr_t lo = addr & ~(paddr_t)0x3, hi = (addr + len - 1) & ~(paddr_t)0x3;
+  if (!code_map_test(lo) && !code_map_test(hi)) return;
+  // only blocks starting in [lo - (TBLOCK_MAX_INST - 1) * 4, hi] can cover the write
+  int nr_start = (hi - lo) / 4 + TBLOCK_MAX_INST;
+  for (int k = 0; k < nr_start; k ++) {
+    vaddr_t start = hi - k * 4;
+    TBlock *tb = tblock_line(start);
+    if (tb->pc == start && lo < start + tb->nr * 4) tblock_kill(tb);
+  }
+}
+
+static bool is_block_end(uint32_t inst) {
+  switch (BITS(inst, 6, 0)) {
+    case 0x63: case 0x67: case 0x6f: // branch, jalr, jal
+    case 0x73: return true;          // ecall, ebreak, mret, csr*
+    default: return false;
+  }
+}
+
+// translate the block at cpu.pc while running it, at most n instructions
+static TBlock *tblock_translate(Decode *s, uint64_t n, uint64_t *nr_exec) {
+  vaddr_t pc = cpu.pc;
+  TBlock *tb = tblock_line(pc);
+  tblock_kill(tb);
+  tb->pc = pc;
+  tb->succ[0] = tb->succ[1] = NULL;
+  while (true) {
+    s->pc = s->snpc = cpu.pc;
+    s->isa.inst.val = inst_fetch(&s->snpc, 4);
+    if (in_pmem(s->pc)) code_map_set(s->pc);
+    tb->nr ++; // cover the op before running it, in case it overwrites itself
+    decode_exec(s, &tb->op[tb->nr - 1], 0);
+    cpu.pc = s->dnpc;
+    (*nr_exec) ++;
+    if (tb->pc != pc) break; // killed by a store in itself
+    if (is_block_end(s->isa.inst.val) || s->dnpc != s->snpc || nemu_state.state != NEMU_RUNNING ||
+        tb->nr == TBLOCK_MAX_INST || *nr_exec == n) break;
+    if (unlikely(nr_bp > 0) && has_bp(cpu.pc)) break; // a breakpoint starts a new block
+  }
+  return tb;
+}
+
+uint64_t isa_exec_block(Decode *s, uint64_t n) {
+  uint64_t nr_exec = 0;
+  TBlock *tb = tblock_line(cpu.pc);
+  if (tb->pc != cpu.pc) tb = NULL;
+  while (nr_exec < n) {
+    if (tb == NULL) {
+      tb = tblock_translate(s, n, &nr_exec);
+    } else {
+      uint64_t left = n - nr_exec;
+      nr_exec += decode_exec(s, tb->op, (left < tb->nr ? left : tb->nr));
+      cpu.pc = s->dnpc;
+    }
+    if (unlikely(nr_bp > 0)) check_bp(cpu.pc);
+    if (nemu_state.state != NEMU_RUNNING) break;
+    // follow the link to the successor, and refresh it if it is stale
+    TBlock **link = &tb->succ[cpu.pc == s->snpc];
+    if (*link == NULL || (*link)->pc != cpu.pc) {
+      TBlock *next = tblock_line(cpu.pc);
+      *link = (next->pc == cpu.pc ? next : NULL);
+    }
+    tb = *link;
+  }
+  return nr_exec;
+}
+#endif
+
+#ifdef CONFIG_DECODE_CACHE
+#ifdef CONFIG_RV_SV32
+/* Lines are indexed by vaddr, which shares only the page offset with paddr,
+*  so probe every line that an instruction at `addr' may sit in.
+*/
+static void dcache_invalidate_ppc(paddr_t addr) {
+  addr &= ~(paddr_t)0x3;
+  for (vaddr_t hi = 0; hi < CONFIG_DECODE_CACHE_SIZE * 4; hi += PAGE_SIZE) {
+    DecodeCache *c = dcache_line(hi | (addr & PAGE_MASK));
+    if (c->pc != DCACHE_INVALID && c->ppc == addr) c->pc = DCACHE_INVALID;
+  }
+}
+#endif
+
+void isa_decode_cache_invalidate(paddr_t addr, int len) {
+#ifdef CONFIG_RV_SV32
+  dcache_invalidate_ppc(addr);
+  dcache_invalidate_ppc(addr + len - 1);
+#else
+  // a write may straddle two instruction words
+  DecodeCache *c = dcache_line(addr);
+  if (c->pc == (addr & ~(paddr_t)0x3)) c->pc = DCACHE_INVALID;
+  c = dcache_line(addr + len - 1);
+  if (c->pc == ((addr + len - 1) & ~(paddr_t)0x3)) c->pc = DCACHE_INVALID;
+#endif
+  IFDEF(CONFIG_ENGINE_THREADED, tblock_invalidate(addr, len));
+}
+
+void isa_decode_cache_flush() {
+  for (int i = 0; i < CONFIG_DECODE_CACHE_SIZE; i ++) {
+    dcache[i].pc = DCACHE_INVALID;
+  }
+#ifdef CONFIG_ENGINE_THREADED
+  for (int i = 0; i < CONFIG_TBLOCK_NR; i ++) {
+    tblock_kill(&tblock[i]);
+  }
+  memset(code_map, 0, sizeof(code_map));
+#endif
 }
+#endif
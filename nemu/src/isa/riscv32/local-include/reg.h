@@ -36,7 +36,9 @@ static inline int check_csr_idx(int idx) {
   return idx;
 }
 
-#define csr(addr) (cpu.csr[check_csr_idx(csr_addr2idx(addr))])
+#define CSR_SATP 0x180
+
+#define csr(addr) (*csr_addr2ptr(addr))
 
 static inline int csr_addr2idx(word_t addr) {
   switch (addr) {
@@ -48,4 +50,9 @@ static inline int csr_addr2idx(word_t addr) {
   }
 }
 
+static inline word_t* csr_addr2ptr(word_t addr) {
+  if (addr == CSR_SATP) return &cpu.satp;
+  return &cpu.csr[check_csr_idx(csr_addr2idx(addr))];
+}
+
 #endif
@@ -58,24 +58,26 @@ void isa_reg_display() {
   );
 }
 
-word_t isa_reg_str2val(const char *s, bool *success) {
-  *success = false;
-
+word_t *isa_reg_str2ptr(const char *s) {
   if (s[0] == '$') {
     s++;
   }
 
   for (int i = 0; i < ARRLEN(cpu.gpr); i++) {
     if (strcmp(s, regs[i]) == 0) {
-      *success = true;
-      return cpu.gpr[i];
+      return &cpu.gpr[i];
     }
   }
 
   if (strcmp(s, "pc") == 0) {
-    *success = true;
-    return cpu.pc;
+    return &cpu.pc;
   }
 
-  return 0;
+  return NULL;
+}
+
+word_t isa_reg_str2val(const char *s, bool *success) {
+  word_t *reg = isa_reg_str2ptr(s);
+  *success = (reg != NULL);
+  return (reg != NULL ? *reg : 0);
 }
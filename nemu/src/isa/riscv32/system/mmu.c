@@ -17,6 +17,137 @@
 #include <memory/vaddr.h>
 #include <memory/paddr.h>
 
+#ifdef CONFIG_RV_SV32
+#define SATP_ASID(satp) BITS(satp, 30, 22)
+#define SATP_PPN(satp)  BITS(satp, 21, 0)
+
+void wp_translation_changed();
+
+enum { PTE_V = 0x01, PTE_R = 0x02, PTE_W = 0x04, PTE_X = 0x08, PTE_U = 0x10, PTE_G = 0x20, PTE_A = 0x40, PTE_D = 0x80 };
+
+/* A set-associative TLB holding leaf PTEs, indexed by the low bits of vpn
+*  and tagged with vpn and ASID. Megapages are held as 4 KiB pages.
+*  Global mappings match every ASID.
+*/
+#define TLB_SETS CONFIG_RV_TLB_SETS
+#define TLB_WAYS CONFIG_RV_TLB_WAYS
+
+typedef struct {
+  uint32_t vpn;
+  uint32_t ppn;
+  uint16_t asid;
+  uint8_t flag; // PTE flags, an entry without PTE_V is empty
+} TLBEntry;
+
+static TLBEntry tlb[TLB_SETS][TLB_WAYS] = {};
+static uint8_t tlb_victim[TLB_SETS] = {};
+static uint64_t tlb_hit = 0, tlb_miss = 0;
+
+static TLBEntry* tlb_lookup(uint32_t vpn, uint16_t asid) {
+  TLBEntry *set = tlb[vpn & (TLB_SETS - 1)];
+  for (int i = 0; i < TLB_WAYS; i ++) {
+    TLBEntry *e = &set[i];
+    if ((e->flag & PTE_V) && e->vpn == vpn && (e->asid == asid || (e->flag & PTE_G))) return e;
+  }
+  return NULL;
+}
+
+// walk the page table, and refill `e' (or a victim if it is NULL) with the leaf PTE
+static TLBEntry* tlb_refill(TLBEntry *e, vaddr_t vaddr, int type, uint16_t asid) {
+  paddr_t base = (paddr_t)SATP_PPN(cpu.satp) << PAGE_SHIFT;
+  paddr_t pte_addr = 0;
+  word_t pte = 0;
+  int level;
+  for (level = 1; level >= 0; level --) {
+    pte_addr = base + (level == 1 ? BITS(vaddr, 31, 22) : BITS(vaddr, 21, 12)) * 4;
+    pte = paddr_read(pte_addr, 4);
+    if (!(pte & PTE_V) || ((pte & PTE_W) && !(pte & PTE_R))) return NULL;
+    if (pte & (PTE_R | PTE_X)) break;
+    base = (paddr_t)(pte >> 10) << PAGE_SHIFT;
+  }
+  if (level < 0) return NULL;
+
+  uint32_t ppn = pte >> 10;
+  if (level == 1) {
+    if (BITS(ppn, 9, 0) != 0) return NULL; // misaligned megapage
+    ppn |= BITS(vaddr, 21, 12);
+  }
+  word_t new_pte = pte | PTE_A | (type == MEM_TYPE_WRITE && (pte & PTE_W) ? PTE_D : 0);
+  if (new_pte != pte) paddr_write(pte_addr, 4, new_pte);
+
+  uint32_t vpn = vaddr >> PAGE_SHIFT;
+  if (e == NULL) {
+    int idx = vpn & (TLB_SETS - 1);
+    e = &tlb[idx][tlb_victim[idx]];
+    tlb_victim[idx] = (tlb_victim[idx] + 1) % TLB_WAYS;
+  }
+  *e = (TLBEntry){ .vpn = vpn, .ppn = ppn, .asid = asid, .flag = new_pte & 0xff };
+  return e;
+}
+
+static bool tlb_permit(TLBEntry *e, int type) {
+  switch (type) {
+    case MEM_TYPE_IFETCH: return e->flag & PTE_X;
+    case MEM_TYPE_READ:   return e->flag & PTE_R;
+    default:              return e->flag & PTE_W;
+  }
+}
+
+// the soft TLB and the decode cache are indexed by vaddr, and know nothing about ASIDs
+static void mmu_flush_vaddr_cache() {
+  IFDEF(CONFIG_SOFT_TLB, stlb_flush());
+  IFDEF(CONFIG_DECODE_CACHE, isa_decode_cache_flush());
+}
+
+void isa_mmu_sfence(vaddr_t vaddr, bool all_vaddr, word_t asid, bool all_asid) {
+  uint32_t vpn = vaddr >> PAGE_SHIFT;
+  for (int i = 0; i < TLB_SETS; i ++) {
+    for (int j = 0; j < TLB_WAYS; j ++) {
+      TLBEntry *e = &tlb[i][j];
+      if ((all_vaddr || e->vpn == vpn) && (all_asid || (e->asid == asid && !(e->flag & PTE_G)))) {
+        e->flag = 0;
+      }
+    }
+  }
+  mmu_flush_vaddr_cache();
+}
+
+/* A new root under the same ASID should be followed by sfence.vma, but
+*  guests switching address spaces with a bare csrw satp are common, so
+*  drop the stale entries of this ASID here.
+*/
+void isa_mmu_satp_write(word_t old) {
+  if (SATP_ASID(old) == SATP_ASID(cpu.satp) && SATP_PPN(old) != SATP_PPN(cpu.satp)) {
+    isa_mmu_sfence(0, true, SATP_ASID(cpu.satp), false);
+  } else {
+    mmu_flush_vaddr_cache();
+  }
+  // watchpoints hook memory by its physical address only without paging
+  IFDEF(CONFIG_WATCHPOINT, if ((old ^ cpu.satp) >> 31) wp_translation_changed());
+}
+
+void isa_mmu_statistic() {
+  if (tlb_hit + tlb_miss == 0) return;
+  Log("tlb hit = %" PRIu64 ", miss = %" PRIu64 ", hit rate = %.2f%%",
+      tlb_hit, tlb_miss, 100.0 * tlb_hit / (tlb_hit + tlb_miss));
+}
+#endif
+
 paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type) {
+#ifdef CONFIG_RV_SV32
+  if ((vaddr & PAGE_MASK) + len > PAGE_SIZE) return MEM_RET_CROSS_PAGE;
+  uint32_t vpn = vaddr >> PAGE_SHIFT;
+  uint16_t asid = SATP_ASID(cpu.satp);
+  TLBEntry *e = tlb_lookup(vpn, asid);
+  // a write to a clean page walks again to set the dirty bit
+  if (likely(e != NULL && (type != MEM_TYPE_WRITE || (e->flag & PTE_D)))) tlb_hit ++;
+  else {
+    tlb_miss ++;
+    e = tlb_refill(e, vaddr, type, asid);
+  }
+  if (e == NULL || !tlb_permit(e, type)) return MEM_RET_FAIL;
+  return ((paddr_t)e->ppn << PAGE_SHIFT) | MEM_RET_OK;
+#else
   return MEM_RET_FAIL;
+#endif
 }
@@ -15,11 +15,15 @@
 
 #include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <device/mmio.h>
+#include <cpu/difftest.h>
 #include <isa.h>
 
 void mem_read_trace(paddr_t addr, int len);
 void mem_write_trace(paddr_t addr, int len, word_t data);
+void jit_invalidate(paddr_t addr, int len);
+void wp_mem_write(paddr_t addr, int len);
 
 #if   defined(CONFIG_PMEM_MALLOC)
 static uint8_t *pmem = NULL;
@@ -30,6 +34,99 @@ static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
 uint8_t* guest_to_host(paddr_t paddr) { return pmem + paddr - CONFIG_MBASE; }
 paddr_t host_to_guest(uint8_t *haddr) { return haddr - pmem + CONFIG_MBASE; }
 
+#ifdef CONFIG_WATCHPOINT
+// number of watched words in each page, the last entry catches accesses crossing the end of pmem
+static uint8_t watched_page[(CONFIG_MSIZE >> PAGE_SHIFT) + 1] = {};
+#define watched(addr) watched_page[((addr) - CONFIG_MBASE) >> PAGE_SHIFT]
+
+static void watch_page(paddr_t addr, bool watch) {
+  watched(addr) += (watch ? 1 : -1);
+  // stores hitting in the soft TLB would never come to paddr_write()
+  IFDEF(CONFIG_SOFT_TLB, stlb_set_slow(addr, watched(addr) != 0));
+}
+
+/* Watchpoints on memory are re-evaluated only when their pages are written */
+void paddr_watch(paddr_t addr, int len, bool watch) {
+  watch_page(addr, watch);
+  if ((addr >> PAGE_SHIFT) != ((addr + len - 1) >> PAGE_SHIFT)) watch_page(addr + len - 1, watch);
+}
+#endif
+
+#ifdef CONFIG_TARGET_SHARE
+/* Old contents of pmem written since the last snapshot of the REF, so that
+*  difftest can rewind it to find the first diverging instruction of a batch.
+*  The soft TLB is not filled for writes while logging, so that every store
+*  comes to paddr_write().
+*/
+#define UNDO_LOG_SIZE 4096
+typedef struct { paddr_t addr; int len; word_t data; } UndoEntry;
+static UndoEntry undo_log[UNDO_LOG_SIZE];
+static int nr_undo = 0;
+static bool undo_overflow = false;
+bool pmem_logging = false;
+
+void pmem_log_start() {
+  if (!pmem_logging) IFDEF(CONFIG_SOFT_TLB, stlb_flush());
+  pmem_logging = true;
+  nr_undo = 0;
+  undo_overflow = false;
+}
+
+static void pmem_log(paddr_t addr, int len) {
+  if (nr_undo == UNDO_LOG_SIZE) { undo_overflow = true; return; }
+  undo_log[nr_undo ++] = (UndoEntry) { addr, len, host_read(guest_to_host(addr), len) };
+}
+
+/* restore pmem to the last pmem_log_start(), false if too much has been written since then */
+bool pmem_log_undo() {
+  if (undo_overflow) return false;
+  while (nr_undo > 0) {
+    nr_undo --;
+    paddr_t addr = undo_log[nr_undo].addr;
+    int len = undo_log[nr_undo].len;
+    host_write(guest_to_host(addr), len, undo_log[nr_undo].data);
+    IFDEF(CONFIG_DECODE_CACHE, isa_decode_cache_invalidate(addr, len));
+  }
+  return true;
+}
+#endif
+
+#ifdef CONFIG_PMEM_DIRTY
+/* Pages of pmem written since the last pmem_dirty_clear(), so that difftest
+*  only compares those. Stores hitting in the soft TLB never come here, so its
+*  write entries are dropped on a clear, and the first store to each page
+*  after that comes to paddr_write() again.
+*/
+static bool dirty_page[CONFIG_MSIZE >> PAGE_SHIFT] = {};
+static paddr_t dirty_list[CONFIG_MSIZE >> PAGE_SHIFT];
+static int nr_dirty = 0;
+#define dirty(addr) dirty_page[((addr) - CONFIG_MBASE) >> PAGE_SHIFT]
+
+static inline void mark_dirty(paddr_t addr) {
+  if (likely(dirty(addr))) return;
+  dirty(addr) = true;
+  dirty_list[nr_dirty ++] = addr & ~(paddr_t)PAGE_MASK;
+}
+
+static inline void pmem_mark_dirty(paddr_t addr, int len) {
+  mark_dirty(addr);
+  if (unlikely((addr >> PAGE_SHIFT) != ((addr + len - 1) >> PAGE_SHIFT)) && in_pmem(addr + len - 1)) {
+    mark_dirty(addr + len - 1);
+  }
+}
+
+int pmem_dirty_pages(paddr_t **pages) {
+  *pages = dirty_list;
+  return nr_dirty;
+}
+
+void pmem_dirty_clear() {
+  for (int i = 0; i < nr_dirty; i ++) dirty(dirty_list[i]) = false;
+  nr_dirty = 0;
+  IFDEF(CONFIG_SOFT_TLB, stlb_flush_write());
+}
+#endif
+
 static word_t pmem_read(paddr_t addr, int len) {
   word_t ret = host_read(guest_to_host(addr), len);
   return ret;
@@ -50,12 +147,14 @@ void init_mem() {
   assert(pmem);
 #endif
   IFDEF(CONFIG_MEM_RANDOM, memset(pmem, rand(), CONFIG_MSIZE));
+  IFDEF(CONFIG_SOFT_TLB, stlb_flush());
   Log("nemu physical memory area [" FMT_PADDR ", " FMT_PADDR "]", PMEM_LEFT, PMEM_RIGHT);
 }
 
 word_t paddr_read(paddr_t addr, int len) {
   IFDEF(CONFIG_MTRACE, mem_read_trace(addr, len));
   if (likely(in_pmem(addr))) return pmem_read(addr, len);
+  IFDEF(CONFIG_TARGET_SHARE, return difftest_ref_mmio_load(addr, len));
   IFDEF(CONFIG_DEVICE, return mmio_read(addr, len));
   out_of_bound(addr);
   return 0;
@@ -63,7 +162,17 @@ word_t paddr_read(paddr_t addr, int len) {
 
 void paddr_write(paddr_t addr, int len, word_t data) {
   IFDEF(CONFIG_MTRACE, mem_write_trace(addr, len, data));
-  if (likely(in_pmem(addr))) { pmem_write(addr, len, data); return; }
+  if (likely(in_pmem(addr))) {
+    IFDEF(CONFIG_TARGET_SHARE, if (pmem_logging) pmem_log(addr, len));
+    IFDEF(CONFIG_PMEM_DIRTY, pmem_mark_dirty(addr, len));
+    pmem_write(addr, len, data);
+    IFDEF(CONFIG_DECODE_CACHE, isa_decode_cache_invalidate(addr, len));
+    IFDEF(CONFIG_ENGINE_JIT, jit_invalidate(addr, len));
+    IFDEF(CONFIG_WATCHPOINT, if (unlikely(watched(addr) || watched(addr + len - 1))) wp_mem_write(addr, len));
+    return;
+  }
   IFDEF(CONFIG_DEVICE, mmio_write(addr, len, data); return);
+  // the devices are those of the DUT, which only lets the REF run the stores to them to drop them
+  IFDEF(CONFIG_TARGET_SHARE, return);
   out_of_bound(addr);
 }
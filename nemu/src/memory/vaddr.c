@@ -14,16 +14,118 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+#ifdef CONFIG_SOFT_TLB
+SoftTLBEntry stlb[CONFIG_SOFT_TLB_SIZE];
+uint64_t stlb_hit = 0, stlb_miss = 0;
+static bool slow_page[CONFIG_MSIZE >> PAGE_SHIFT] = {};
+
+void stlb_flush() {
+  for (int i = 0; i < CONFIG_SOFT_TLB_SIZE; i ++) {
+    stlb[i].rtag = stlb[i].wtag = STLB_INVALID;
+  }
+}
+
+// stores miss until the pages are written through the slow path again, loads still hit
+void stlb_flush_write() {
+  for (int i = 0; i < CONFIG_SOFT_TLB_SIZE; i ++) {
+    stlb[i].wtag = STLB_INVALID;
+  }
+}
+
+// pages with hooks on their accesses (e.g. watched memory) must take the slow path
+void stlb_set_slow(paddr_t addr, bool slow) {
+  assert(in_pmem(addr));
+  slow_page[(addr - CONFIG_MBASE) >> PAGE_SHIFT] = slow;
+  stlb_flush();
+}
+
+static void stlb_fill(vaddr_t addr, paddr_t paddr, bool is_write) {
+  stlb_miss ++;
+  if (!in_pmem(paddr) || slow_page[(paddr - CONFIG_MBASE) >> PAGE_SHIFT]) return;
+  IFDEF(CONFIG_TARGET_SHARE, if (is_write && pmem_logging) return);
+  vaddr_t vpage = addr & ~(vaddr_t)PAGE_MASK;
+  SoftTLBEntry *e = stlb_entry(addr);
+  if (e->rtag != vpage && e->wtag != vpage) {
+    e->rtag = e->wtag = STLB_INVALID;
+    e->hoffset = (uintptr_t)guest_to_host(paddr & ~(paddr_t)PAGE_MASK) - vpage;
+    e->poffset = (paddr & ~(paddr_t)PAGE_MASK) - vpage;
+  }
+  if (is_write) e->wtag = vpage;
+  else e->rtag = vpage;
+}
+#endif
+
+static paddr_t vaddr_translate(vaddr_t addr, int len, int type) {
+  if (isa_mmu_check(addr, len, type) == MMU_DIRECT) return addr;
+  static const char *type_name[] = { "fetch", "read", "write" };
+  paddr_t pg = isa_mmu_translate(addr, len, type);
+  Assert((pg & PAGE_MASK) == MEM_RET_OK, "page fault on %s at vaddr = " FMT_WORD ", pc = " FMT_WORD,
+      type_name[type], addr, cpu.pc);
+  return (pg & ~(paddr_t)PAGE_MASK) | (addr & PAGE_MASK);
+}
+
+// a translated access crossing a page boundary is split into bytes
+static inline bool vaddr_cross_page(vaddr_t addr, int len, int type) {
+  return isa_mmu_check(addr, len, type) == MMU_TRANSLATE && (addr & PAGE_MASK) + len > PAGE_SIZE;
+}
 
 word_t vaddr_ifetch(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+  return paddr_read(vaddr_translate(addr, len, MEM_TYPE_IFETCH), len);
 }
 
 word_t vaddr_read(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+  if (unlikely(vaddr_cross_page(addr, len, MEM_TYPE_READ))) {
+    word_t data = 0;
+    for (int i = 0; i < len; i ++) data |= vaddr_read(addr + i, 1) << (i * 8);
+    return data;
+  }
+  paddr_t paddr = vaddr_translate(addr, len, MEM_TYPE_READ);
+  IFDEF(CONFIG_SOFT_TLB, stlb_fill(addr, paddr, false));
+  return paddr_read(paddr, len);
+}
+
+/* Translate an access of the debugger (sdb, watchpoints and the GDB stub),
+*  returning false on a page fault, as an unmapped address is a valid input
+*  there rather than a bug of the guest.
+*/
+bool vaddr_debug_translate(vaddr_t addr, int type, paddr_t *paddr) {
+  *paddr = addr;
+  if (isa_mmu_check(addr, 1, type) == MMU_DIRECT) return true;
+  paddr_t pg = isa_mmu_translate(addr, 1, type);
+  if ((pg & PAGE_MASK) != MEM_RET_OK) return false;
+  *paddr = (pg & ~(paddr_t)PAGE_MASK) | (addr & PAGE_MASK);
+  return true;
+}
+
+/* read for the debugger, returning false if a byte of it is not mapped or
+*  not in pmem, as reads of devices may have side effects
+*/
+bool vaddr_debug_read(vaddr_t addr, int len, word_t *data) {
+  if (unlikely(vaddr_cross_page(addr, len, MEM_TYPE_READ))) {
+    *data = 0;
+    for (int i = 0; i < len; i ++) {
+      word_t byte;
+      if (!vaddr_debug_read(addr + i, 1, &byte)) return false;
+      *data |= byte << (i * 8);
+    }
+    return true;
+  }
+  paddr_t paddr;
+  if (!vaddr_debug_translate(addr, MEM_TYPE_READ, &paddr) || !in_pmem(paddr) || !in_pmem(paddr + len - 1)) return false;
+  *data = host_read(guest_to_host(paddr), len);
+  return true;
 }
 
 void vaddr_write(vaddr_t addr, int len, word_t data) {
-  paddr_write(addr, len, data);
+  if (unlikely(vaddr_cross_page(addr, len, MEM_TYPE_WRITE))) {
+    for (int i = 0; i < len; i ++) vaddr_write(addr + i, 1, data >> (i * 8));
+    return;
+  }
+  paddr_t paddr = vaddr_translate(addr, len, MEM_TYPE_WRITE);
+  IFDEF(CONFIG_SOFT_TLB, stlb_fill(addr, paddr, true));
+  paddr_write(paddr, len, data);
 }
@@ -0,0 +1,400 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <cpu/cpu.h>
+#include <cpu/difftest.h>
+#include <utils.h>
+#include <device/event.h>
+
+#ifdef CONFIG_CHECKPOINT
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* A checkpoint file is laid out as
+*    CkptHeader | CPU_state | CkptRegion[nr_region] | CkptRun[nr_run] | data
+*  Region 0 is pmem, the others are states registered by devices. Only the
+*  non-zero pages of each region are stored, as runs of whole pages placed
+*  at page-aligned file offsets, so pmem can be mapped straight from the
+*  file and restoring costs almost nothing until pages are touched.
+*  A checkpoint taken for sampled simulation also records how many
+*  instructions the sample runs and its weight in the whole workload.
+*/
+#define CKPT_MAGIC "NEMUCKPT"
+#define CKPT_VERSION 2
+#define CKPT_PAGE 4096
+#define CKPT_NAME_LEN 32
+#define MAX_STATE 16
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t cpu_size; // sizeof(CPU_state), to reject checkpoints of another config
+  uint64_t nr_guest_inst;
+  uint64_t mbase, msize;
+  uint32_t nr_region, nr_run;
+  uint32_t nr_gpr, reserved;
+  uint64_t sample_len; // 0 if this is not a sample
+  double weight;
+} CkptHeader;
+
+typedef struct {
+  char name[CKPT_NAME_LEN];
+  uint64_t size;
+  uint32_t first_run, nr_run;
+} CkptRegion;
+
+typedef struct {
+  uint64_t offset; // in the region
+  uint64_t len;
+  uint64_t file_offset;
+} CkptRun;
+
+typedef struct {
+  const char *name;
+  void *addr;
+  size_t size;
+  checkpoint_hook_t hook;
+} State;
+
+typedef struct {
+  uint64_t inst;
+  char *path;
+  uint64_t sample_len;
+  double weight;
+} SavePoint;
+
+static State state[MAX_STATE] = {};
+static int nr_state = 0;
+static SavePoint *save_point = NULL;
+static int nr_save_point = 0;
+static bool quit_after_save = false;
+static uint64_t sample_len = 0;
+
+extern uint64_t g_nr_guest_inst;
+
+void checkpoint_add_state(const char *name, void *addr, size_t size, checkpoint_hook_t hook) {
+  assert(nr_state < MAX_STATE);
+  assert(strlen(name) < CKPT_NAME_LEN);
+  state[nr_state ++] = (State){ .name = name, .addr = addr, .size = size, .hook = hook };
+}
+
+static bool is_zero_page(uint8_t *p, size_t len) {
+  for (size_t i = 0; i < len; i ++) {
+    if (p[i] != 0) return false;
+  }
+  return true;
+}
+
+// split [p, p + size) into runs of non-zero pages
+static int collect_runs(uint8_t *p, size_t size, CkptRun *run, int max) {
+  int nr = 0;
+  for (size_t off = 0; off < size; off += CKPT_PAGE) {
+    size_t len = (size - off < CKPT_PAGE ? size - off : CKPT_PAGE);
+    if (is_zero_page(p + off, len)) continue;
+    if (nr > 0 && run[nr - 1].offset + run[nr - 1].len == off) run[nr - 1].len += len;
+    else {
+      if (nr == max) return -1;
+      run[nr ++] = (CkptRun){ .offset = off, .len = len };
+    }
+  }
+  return nr;
+}
+
+static bool checkpoint_write(const char *path, uint64_t sample_len, double weight) {
+  int nr_region = nr_state + 1;
+  CkptRegion region[MAX_STATE + 1] = {};
+  uint8_t *base[MAX_STATE + 1];
+  int max_run = CONFIG_MSIZE / CKPT_PAGE / 2 + MAX_STATE * 16;
+  CkptRun *run = malloc(sizeof(CkptRun) * max_run);
+  assert(run);
+
+  for (int i = 0; i < nr_state; i ++) {
+    if (state[i].hook) state[i].hook(false);
+  }
+
+  int nr_run = 0;
+  for (int i = 0; i < nr_region; i ++) {
+    const char *name = (i == 0 ? "pmem" : state[i - 1].name);
+    base[i] = (i == 0 ? guest_to_host(PMEM_LEFT) : state[i - 1].addr);
+    region[i].size = (i == 0 ? CONFIG_MSIZE : state[i - 1].size);
+    strncpy(region[i].name, name, CKPT_NAME_LEN - 1);
+    int nr = collect_runs(base[i], region[i].size, run + nr_run, max_run - nr_run);
+    assert(nr >= 0);
+    region[i].first_run = nr_run;
+    region[i].nr_run = nr;
+    nr_run += nr;
+  }
+
+  CkptHeader hdr = { .version = CKPT_VERSION, .cpu_size = sizeof(CPU_state),
+    .nr_guest_inst = g_nr_guest_inst, .mbase = CONFIG_MBASE, .msize = CONFIG_MSIZE,
+    .nr_region = nr_region, .nr_run = nr_run, .nr_gpr = ARRLEN(cpu.gpr),
+    .sample_len = sample_len, .weight = weight };
+  memcpy(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic));
+
+  uint64_t off = sizeof(hdr) + sizeof(CPU_state) + sizeof(CkptRegion) * nr_region + sizeof(CkptRun) * nr_run;
+  for (int i = 0; i < nr_run; i ++) {
+    off = (off + CKPT_PAGE - 1) & ~(uint64_t)(CKPT_PAGE - 1);
+    run[i].file_offset = off;
+    off += run[i].len;
+  }
+
+  // pmem may be mapped from the file to be replaced, so it is written to another one first
+  char *tmp = malloc(strlen(path) + 8);
+  assert(tmp);
+  sprintf(tmp, "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  mode_t mask = umask(0);
+  umask(mask);
+  if (fd >= 0) fchmod(fd, 0666 & ~mask); // as fopen() would create it
+  FILE *fp = (fd < 0 ? NULL : fdopen(fd, "wb"));
+  if (fp == NULL) {
+    if (fd >= 0) { close(fd); unlink(tmp); }
+    free(tmp);
+    free(run);
+    return false;
+  }
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+    fwrite(&cpu, sizeof(CPU_state), 1, fp) == 1 &&
+    fwrite(region, sizeof(CkptRegion), nr_region, fp) == nr_region &&
+    fwrite(run, sizeof(CkptRun), nr_run, fp) == nr_run;
+  for (int i = 0; ok && i < nr_region; i ++) {
+    for (int j = region[i].first_run; ok && j < region[i].first_run + region[i].nr_run; j ++) {
+      ok = fseek(fp, run[j].file_offset, SEEK_SET) == 0 &&
+        fwrite(base[i] + run[j].offset, run[j].len, 1, fp) == 1;
+    }
+  }
+  ok = (fclose(fp) == 0) && ok;
+  ok = ok && rename(tmp, path) == 0;
+  if (!ok) unlink(tmp);
+  free(tmp);
+  free(run);
+  if (ok) Log("Checkpoint saved to %s at " "%" PRIu64 " instructions, %d pages", path, g_nr_guest_inst,
+      (int)((off - sizeof(hdr)) / CKPT_PAGE));
+  return ok;
+}
+
+bool checkpoint_save(const char *path) {
+  return checkpoint_write(path, 0, 1.0);
+}
+
+// whether the runs of a region are in the run table, the region and the file
+static bool check_region(CkptRegion *r, CkptRun *run, uint32_t nr_run, uint64_t file_size) {
+  if ((uint64_t)r->first_run + r->nr_run > nr_run) return false;
+  for (uint32_t i = r->first_run; i < r->first_run + r->nr_run; i ++) {
+    if (run[i].len > r->size || run[i].offset > r->size - run[i].len) return false;
+    // a mapped page past the end of the file would raise SIGBUS when it is touched
+    if (run[i].len > file_size || run[i].file_offset > file_size - run[i].len) return false;
+  }
+  return true;
+}
+
+// only called on a region which has passed check_region()
+static bool load_region(int fd, uint8_t *base, CkptRegion *r, CkptRun *run, bool is_pmem) {
+  bool can_map = is_pmem && ((uintptr_t)base & (CKPT_PAGE - 1)) == 0 && (r->size & (CKPT_PAGE - 1)) == 0;
+  if (can_map) {
+    // anonymous zero pages first, then the stored pages on top of them
+    if (mmap(base, r->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) return false;
+  } else {
+    memset(base, 0, r->size);
+  }
+  for (int i = r->first_run; i < r->first_run + r->nr_run; i ++) {
+    if (can_map && ((run[i].len | run[i].file_offset) & (CKPT_PAGE - 1)) == 0) {
+      void *p = mmap(base + run[i].offset, run[i].len, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_FIXED, fd, run[i].file_offset);
+      if (p == MAP_FAILED) return false;
+    } else if (pread(fd, base + run[i].offset, run[i].len, run[i].file_offset) != run[i].len) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#ifdef CONFIG_ENGINE_JIT
+void jit_flush();
+#endif
+void profile_rebase(uint64_t old);
+void wp_translation_changed();
+
+// everything derived from guest memory or registers is stale now
+static void checkpoint_flush_cache() {
+  IFDEF(CONFIG_DECODE_CACHE, isa_decode_cache_flush());
+  IFDEF(CONFIG_ENGINE_JIT, jit_flush());
+  IFDEF(CONFIG_SOFT_TLB, stlb_flush());
+  IFDEF(CONFIG_RV_SV32, isa_mmu_sfence(0, true, 0, true));
+}
+
+bool checkpoint_load(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  CkptHeader hdr;
+  bool ok = false;
+  CkptRegion *region = NULL;
+  CkptRun *run = NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0) goto out;
+  if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic)) != 0) goto out;
+  if (hdr.version != CKPT_VERSION || hdr.cpu_size != sizeof(CPU_state) ||
+      hdr.nr_gpr != ARRLEN(cpu.gpr) || hdr.mbase != CONFIG_MBASE || hdr.msize != CONFIG_MSIZE) {
+    Log("Checkpoint %s does not match this build of NEMU", path);
+    goto out;
+  }
+  uint64_t file_size = st.st_size;
+  if (hdr.nr_region == 0 || sizeof(hdr) + sizeof(CPU_state) + sizeof(CkptRegion) * (uint64_t)hdr.nr_region +
+      sizeof(CkptRun) * (uint64_t)hdr.nr_run > file_size) {
+    Log("Checkpoint %s is truncated or corrupt", path);
+    goto out;
+  }
+
+  off_t off = sizeof(hdr);
+  CPU_state c;
+  region = malloc(sizeof(CkptRegion) * hdr.nr_region);
+  run = malloc(sizeof(CkptRun) * hdr.nr_run);
+  assert(region && run);
+  if (pread(fd, &c, sizeof(c), off) != sizeof(c)) goto out;
+  off += sizeof(c);
+  if (pread(fd, region, sizeof(CkptRegion) * hdr.nr_region, off) != sizeof(CkptRegion) * hdr.nr_region) goto out;
+  off += sizeof(CkptRegion) * hdr.nr_region;
+  if (pread(fd, run, sizeof(CkptRun) * hdr.nr_run, off) != sizeof(CkptRun) * hdr.nr_run) goto out;
+
+  // the whole checkpoint is checked before the machine is changed, so a bad one leaves it as it is
+  for (int i = 0; i < hdr.nr_region; i ++) {
+    CkptRegion *r = &region[i];
+    r->name[CKPT_NAME_LEN - 1] = '\0';
+    if (!check_region(r, run, hdr.nr_run, file_size) ||
+        (i == 0 && (strcmp(r->name, "pmem") != 0 || r->size != CONFIG_MSIZE))) {
+      Log("Checkpoint %s is truncated or corrupt", path);
+      goto out;
+    }
+  }
+
+  for (int i = 0; i < hdr.nr_region; i ++) {
+    CkptRegion *r = &region[i];
+    if (i == 0) {
+      if (!load_region(fd, guest_to_host(PMEM_LEFT), r, run, true)) panic("Can not read checkpoint %s, pmem is partly restored", path);
+      continue;
+    }
+    int j;
+    for (j = 0; j < nr_state; j ++) {
+      if (strcmp(state[j].name, r->name) == 0) break;
+    }
+    if (j == nr_state || state[j].size != r->size) {
+      Log("Checkpoint state '%s' does not match any device, skipped", r->name);
+      continue;
+    }
+    if (!load_region(fd, state[j].addr, r, run, false)) panic("Can not read checkpoint %s, '%s' is partly restored", path, r->name);
+    if (state[j].hook) state[j].hook(true);
+  }
+
+  cpu = c;
+  __attribute__((unused)) uint64_t old = g_nr_guest_inst;
+  g_nr_guest_inst = hdr.nr_guest_inst;
+  // deadlines are absolute instruction counts
+  IFDEF(CONFIG_DEVICE, event_rebase(old));
+  IFDEF(CONFIG_PROFILE, profile_rebase(old));
+  checkpoint_flush_cache();
+  // satp is restored too
+  IFDEF(CONFIG_WATCHPOINT, wp_translation_changed());
+  if (ref_difftest_memcpy != NULL) {
+    ref_difftest_memcpy(PMEM_LEFT, guest_to_host(PMEM_LEFT), CONFIG_MSIZE, DIFFTEST_TO_REF);
+    ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+  }
+  if (nemu_state.state == NEMU_END || nemu_state.state == NEMU_ABORT) nemu_state.state = NEMU_STOP;
+  Log("Checkpoint restored from %s at " "%" PRIu64 " instructions", path, g_nr_guest_inst);
+  sample_len = hdr.sample_len;
+  if (sample_len != 0) Log("Sample of " "%" PRIu64 " instructions, weight = %f", sample_len, hdr.weight);
+  ok = true;
+
+out:
+  free(region);
+  free(run);
+  close(fd);
+  return ok;
+}
+// instructions to run in batch mode, which is the length of a restored sample
+uint64_t checkpoint_sample_len() {
+  return (sample_len != 0 ? sample_len : -1);
+}
+
+static void add_save_point(uint64_t inst, char *path, uint64_t sample_len, double weight) {
+  save_point = realloc(save_point, sizeof(SavePoint) * (nr_save_point + 1));
+  assert(save_point);
+  save_point[nr_save_point ++] = (SavePoint){ .inst = inst, .path = path,
+    .sample_len = sample_len, .weight = weight };
+}
+
+void checkpoint_save_at(uint64_t inst, char *path) {
+  add_save_point(inst, path, 0, 1.0);
+}
+
+static int cmp_save_point(const void *a, const void *b) {
+  uint64_t x = ((SavePoint *)a)->inst, y = ((SavePoint *)b)->inst;
+  return (x > y) - (x < y);
+}
+
+/* Read PREFIX.simpoints and PREFIX.weights in the format of SimPoint,
+*  and schedule a checkpoint PREFIX.<cluster>.ckpt at the start of every
+*  chosen interval. The simulation stops after the last one.
+*/
+void checkpoint_save_simpoints(uint64_t interval, const char *prefix) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s.simpoints", prefix);
+  FILE *sp = fopen(path, "r");
+  Assert(sp, "Can not open '%s'", path);
+  snprintf(path, sizeof(path), "%s.weights", prefix);
+  FILE *wp = fopen(path, "r");
+  Assert(wp, "Can not open '%s'", path);
+
+  uint64_t idx;
+  int cluster, wcluster;
+  double weight;
+  while (fscanf(sp, "%" SCNu64 " %d", &idx, &cluster) == 2) {
+    Assert(fscanf(wp, "%lf %d", &weight, &wcluster) == 2 && wcluster == cluster,
+        "%s.weights does not match %s.simpoints", prefix, prefix);
+    char *ckpt = malloc(strlen(prefix) + 32);
+    assert(ckpt);
+    sprintf(ckpt, "%s.%d.ckpt", prefix, cluster);
+    add_save_point(idx * interval, ckpt, interval, weight);
+  }
+  fclose(sp);
+  fclose(wp);
+  quit_after_save = true;
+  Log("%d simulation points are read from %s.simpoints", nr_save_point, prefix);
+}
+
+// return true if the simulation should stop after taking the checkpoints
+bool checkpoint_take_scheduled() {
+  qsort(save_point, nr_save_point, sizeof(SavePoint), cmp_save_point);
+  for (int i = 0; i < nr_save_point; i ++) {
+    SavePoint *p = &save_point[i];
+    if (p->inst < g_nr_guest_inst) {
+      Log("Checkpoint %s at " "%" PRIu64 " instructions is skipped", p->path, p->inst);
+      continue;
+    }
+    if (p->inst > g_nr_guest_inst) cpu_exec(p->inst - g_nr_guest_inst);
+    if (nemu_state.state != NEMU_STOP && nemu_state.state != NEMU_RUNNING) break;
+    if (!checkpoint_write(p->path, p->sample_len, p->weight)) {
+      printf("Can not save checkpoint to '%s'\n", p->path);
+    }
+  }
+  nr_save_point = 0;
+  if (quit_after_save && nemu_state.state == NEMU_STOP) nemu_state.state = NEMU_QUIT;
+  return quit_after_save;
+}
+#endif
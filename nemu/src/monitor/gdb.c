@@ -0,0 +1,406 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <cpu/difftest.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#ifdef CONFIG_GDBSTUB
+/* A stub of the GDB remote serial protocol. With --gdb=PORT, NEMU waits for
+*  GDB on PORT, and serves it instead of running sdb. Breakpoints and
+*  watchpoints are the ones of sdb, which are only checked at block boundaries
+*  and on writes to watched pages, so the guest runs at engine speed between
+*  stops.
+*/
+
+#define GDB_PKT_SIZE 4096
+#define GDB_RUN_CHUNK (1 << 20) // instructions between two polls for an interrupt from GDB
+#define GDB_NR_GPR ARRLEN(cpu.gpr)
+#define GDB_PC GDB_NR_GPR       // register number of pc
+
+int insert_bp(vaddr_t pc, bool temporary);
+bool remove_bp(vaddr_t pc);
+int add_wp_write(vaddr_t addr);
+bool remove_wp(int no);
+bool wp_triggered(vaddr_t *addr);
+
+static int gdb_fd = -1;
+static bool no_ack = false;
+static char in_buf[GDB_PKT_SIZE];
+static int in_pos = 0, in_len = 0;
+static char pkt[GDB_PKT_SIZE];
+static char reply[GDB_PKT_SIZE * 2];
+static char stop_reason[64] = "S05";
+
+// breakpoints and watchpoints set by GDB, to find the one to remove by its address
+static struct { vaddr_t addr; int no; } gdb_bp[32], gdb_wp[32];
+
+// --- packets ---
+static int gdb_getc() {
+  if (in_pos == in_len) {
+    ssize_t n = recv(gdb_fd, in_buf, sizeof(in_buf), 0);
+    if (n <= 0) return -1;
+    in_pos = 0;
+    in_len = n;
+  }
+  return (uint8_t)in_buf[in_pos ++];
+}
+
+// whether GDB asks to stop the running guest with ^C, or is gone
+static bool gdb_interrupted() {
+  if (in_pos == in_len) {
+    ssize_t n = recv(gdb_fd, in_buf, sizeof(in_buf), MSG_DONTWAIT);
+    if (n <= 0) return n == 0;
+    in_pos = 0;
+    in_len = n;
+  }
+  if (in_buf[in_pos] != 0x03) return false;
+  in_pos ++;
+  return true;
+}
+
+// receive a packet into pkt, returning false if GDB is gone
+static bool recv_packet() {
+  while (true) {
+    int c, len = 0;
+    uint8_t sum = 0;
+    // skip acks, and ^C which comes too late
+    while ((c = gdb_getc()) != '$') {
+      if (c < 0) return false;
+    }
+    while ((c = gdb_getc()) != '#') {
+      if (c < 0) return false;
+      if (len < GDB_PKT_SIZE - 1) pkt[len ++] = c;
+      sum += c;
+    }
+    pkt[len] = '\0';
+    char hex[3] = {};
+    hex[0] = gdb_getc();
+    hex[1] = gdb_getc();
+    if (no_ack) return true;
+    bool ok = (strtoul(hex, NULL, 16) == sum);
+    send(gdb_fd, (ok ? "+" : "-"), 1, 0);
+    if (ok) return true;
+  }
+}
+
+static void send_packet(const char *data) {
+  static char out[sizeof(reply) + 8];
+  int len = strlen(data);
+  uint8_t sum = 0;
+  for (int i = 0; i < len; i ++) sum += data[i];
+  out[0] = '$';
+  memcpy(out + 1, data, len);
+  snprintf(out + 1 + len, 4, "#%02x", sum);
+  do {
+    send(gdb_fd, out, len + 4, 0);
+  } while (!no_ack && gdb_getc() == '-');
+}
+
+// --- registers and memory ---
+static char *put_hex_word(char *p, word_t v) {
+  for (int i = 0; i < sizeof(word_t); i ++) p += sprintf(p, "%02x", (v >> (i * 8)) & 0xff);
+  return p;
+}
+
+static word_t get_hex_word(const char *p) {
+  word_t v = 0;
+  for (int i = 0; i < sizeof(word_t); i ++) {
+    char byte[3] = { p[i * 2], p[i * 2 + 1], '\0' };
+    v |= (word_t)strtoul(byte, NULL, 16) << (i * 8);
+  }
+  return v;
+}
+
+static word_t *gdb_reg(int no) {
+  if (no < GDB_NR_GPR) return &cpu.gpr[no];
+  return (no == GDB_PC ? &cpu.pc : NULL);
+}
+
+// translate a guest address for the debugger, false if it is not in pmem
+static bool gdb_paddr(vaddr_t addr, int type, paddr_t *paddr) {
+  return vaddr_debug_translate(addr, type, paddr) && in_pmem(*paddr);
+}
+
+// the REF of difftest runs on from the state changed by GDB
+static void gdb_sync_regs() {
+  if (ref_difftest_regcpy != NULL) ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+}
+
+static void gdb_read_mem(vaddr_t addr, int len) {
+  char *p = reply;
+  len = (len < GDB_PKT_SIZE / 2 ? len : GDB_PKT_SIZE / 2);
+  for (int i = 0; i < len; i ++) {
+    paddr_t paddr;
+    // mmio is not read by the debugger, as reads may have side effects
+    if (!gdb_paddr(addr + i, MEM_TYPE_READ, &paddr)) break;
+    p += sprintf(p, "%02x", *guest_to_host(paddr));
+  }
+  if (p == reply) strcpy(reply, "E14");
+}
+
+static void gdb_write_mem(vaddr_t addr, int len, const char *data) {
+  for (int i = 0; i < len; i ++) {
+    paddr_t paddr;
+    if (!gdb_paddr(addr + i, MEM_TYPE_WRITE, &paddr)) {
+      strcpy(reply, "E14");
+      return;
+    }
+    char byte[3] = { data[i * 2], data[i * 2 + 1], '\0' };
+    // through paddr_write(), so that decoded or translated code of it is dropped
+    paddr_write(paddr, 1, strtoul(byte, NULL, 16));
+    if (ref_difftest_memcpy != NULL) ref_difftest_memcpy(paddr, guest_to_host(paddr), 1, DIFFTEST_TO_REF);
+  }
+  strcpy(reply, "OK");
+}
+
+static const char *target_xml() {
+  static char xml[GDB_PKT_SIZE];
+  if (xml[0] != '\0') return xml;
+  char *p = xml;
+  p += sprintf(p, "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+      "<target version=\"1.0\"><architecture>riscv:rv32</architecture>"
+      "<feature name=\"org.gnu.gdb.riscv.cpu\">");
+  for (int i = 0; i < GDB_NR_GPR; i ++) {
+    p += sprintf(p, "<reg name=\"x%d\" bitsize=\"32\" type=\"int\" regnum=\"%d\"/>", i, i);
+  }
+  sprintf(p, "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\" regnum=\"%d\"/></feature></target>", GDB_PC);
+  return xml;
+}
+
+// qXfer:features:read:target.xml:OFFSET,LENGTH
+static void gdb_read_xml(const char *args) {
+  const char *xml = target_xml();
+  int off = 0, len = 0, size = strlen(xml);
+  sscanf(args, "%x,%x", &off, &len);
+  if (off >= size) { strcpy(reply, "l"); return; }
+  if (len > GDB_PKT_SIZE - 2) len = GDB_PKT_SIZE - 2;
+  bool last = (off + len >= size);
+  snprintf(reply, sizeof(reply), "%c%.*s", (last ? 'l' : 'm'), (last ? size - off : len), xml + off);
+}
+
+// --- breakpoints and watchpoints ---
+// a breakpoint of sdb at the same pc is left to sdb, GDB does not remove it
+static void gdb_break(bool insert, vaddr_t addr) {
+  int k = 0;
+  if (insert) {
+    if (has_bp(addr)) return;
+    while (k < ARRLEN(gdb_bp) && gdb_bp[k].no >= 0) k ++;
+    int no = (k < ARRLEN(gdb_bp) ? insert_bp(addr, false) : -1);
+    if (no < 0) strcpy(reply, "E01");
+    else gdb_bp[k].addr = addr, gdb_bp[k].no = no;
+  } else {
+    while (k < ARRLEN(gdb_bp) && (gdb_bp[k].no < 0 || gdb_bp[k].addr != addr)) k ++;
+    if (k < ARRLEN(gdb_bp)) remove_bp(addr), gdb_bp[k].no = -1;
+    else if (!has_bp(addr)) strcpy(reply, "E01");
+  }
+}
+
+// Z/z TYPE,ADDR,KIND
+static void gdb_point(bool insert, const char *args) {
+  int type = 0;
+  vaddr_t addr = 0;
+  int len = 0;
+  sscanf(args, "%d,%x,%x", &type, &addr, &len);
+  strcpy(reply, "OK");
+  if (type == 0 || type == 1) {
+    // software and hardware breakpoints are the same pc breakpoints
+    gdb_break(insert, addr);
+  } else if (type == 2 && ISDEF(CONFIG_WATCHPOINT)) {
+    // GDB splits a write watchpoint into words, and checks for a change itself
+    int k = 0;
+    if (insert) {
+      while (k < ARRLEN(gdb_wp) && gdb_wp[k].no >= 0) k ++;
+      int no = (k < ARRLEN(gdb_wp) ? add_wp_write(addr) : -1);
+      if (no < 0) strcpy(reply, "E01");
+      else gdb_wp[k].addr = addr, gdb_wp[k].no = no;
+    } else {
+      while (k < ARRLEN(gdb_wp) && (gdb_wp[k].no < 0 || gdb_wp[k].addr != addr)) k ++;
+      if (k == ARRLEN(gdb_wp)) strcpy(reply, "E01");
+      else remove_wp(gdb_wp[k].no), gdb_wp[k].no = -1;
+    }
+  } else {
+    // read and access watchpoints are not supported, GDB falls back to single steps
+    reply[0] = '\0';
+  }
+}
+
+// --- execution ---
+static void gdb_resume(bool step) {
+  bool watch = false, interrupted = false;
+  vaddr_t watch_addr = 0;
+  if (step) {
+    cpu_exec(1);
+    watch = wp_triggered(&watch_addr);
+  } else {
+    // breakpoints and watchpoints stop the guest in the middle of a chunk
+    do {
+      cpu_exec(GDB_RUN_CHUNK);
+      watch = wp_triggered(&watch_addr);
+    } while (nemu_state.state == NEMU_STOP && !watch && !has_bp(cpu.pc) &&
+        !(interrupted = gdb_interrupted()));
+  }
+
+  switch (nemu_state.state) {
+    case NEMU_END: snprintf(stop_reason, sizeof(stop_reason), "W%02x", nemu_state.halt_ret & 0xff); break;
+    case NEMU_ABORT: strcpy(stop_reason, "X06"); break;
+    default:
+      if (watch && watch_addr != 0) snprintf(stop_reason, sizeof(stop_reason), "T05watch:%x;", watch_addr);
+      else strcpy(stop_reason, (interrupted ? "S02" : "S05"));
+  }
+  send_packet(stop_reason);
+}
+
+// resume at ADDR if it is given
+static void gdb_resume_at(const char *addr, bool step) {
+  if (*addr != '\0') cpu.pc = strtoul(addr, NULL, 16);
+  gdb_resume(step);
+}
+
+// --- commands ---
+static void gdb_query(const char *q) {
+  if (strncmp(q, "qSupported", 10) == 0) {
+    snprintf(reply, sizeof(reply), "PacketSize=%x;qXfer:features:read+;swbreak+;"
+        "vContSupported+;QStartNoAckMode+", GDB_PKT_SIZE - 1);
+  } else if (strncmp(q, "qXfer:features:read:target.xml:", 31) == 0) gdb_read_xml(q + 31);
+  else if (strcmp(q, "qAttached") == 0) strcpy(reply, "1");
+  else if (strcmp(q, "qC") == 0) strcpy(reply, "QC1");
+  else if (strcmp(q, "qfThreadInfo") == 0) strcpy(reply, "m1");
+  else if (strcmp(q, "qsThreadInfo") == 0) strcpy(reply, "l");
+  else if (strcmp(q, "QStartNoAckMode") == 0) {
+    send_packet("OK");
+    no_ack = true;
+    reply[0] = '\0';
+    return;
+  }
+  else reply[0] = '\0';
+  send_packet(reply);
+}
+
+// vCont;ACTION[:THREAD]..., with the only thread taking the first action
+static bool gdb_vcont(const char *v) {
+  if (strcmp(v, "vCont?") == 0) { send_packet("vCont;c;C;s;S"); return true; }
+  if (strncmp(v, "vCont;", 6) != 0) return false;
+  char action = v[6];
+  if (action == 'c' || action == 'C') gdb_resume(false);
+  else if (action == 's' || action == 'S') gdb_resume(true);
+  else send_packet("");
+  return true;
+}
+
+// serve one packet, returning false when the session is over
+static bool gdb_serve() {
+  if (!recv_packet()) return false;
+  vaddr_t addr = 0;
+  int len = 0, no = 0;
+  char *p;
+  reply[0] = '\0';
+  switch (pkt[0]) {
+    case '?': send_packet(stop_reason); return true;
+    case 'g':
+      p = reply;
+      for (int i = 0; i <= GDB_PC; i ++) p = put_hex_word(p, *gdb_reg(i));
+      break;
+    case 'G':
+      for (int i = 1; i <= GDB_PC && strlen(pkt + 1) >= (i + 1) * sizeof(word_t) * 2; i ++) {
+        *gdb_reg(i) = get_hex_word(pkt + 1 + i * sizeof(word_t) * 2);
+      }
+      gdb_sync_regs();
+      strcpy(reply, "OK");
+      break;
+    case 'p':
+      no = strtoul(pkt + 1, NULL, 16);
+      if (gdb_reg(no) == NULL) strcpy(reply, "E01");
+      else put_hex_word(reply, *gdb_reg(no));
+      break;
+    case 'P':
+      no = strtoul(pkt + 1, &p, 16);
+      if (gdb_reg(no) == NULL || *p != '=') strcpy(reply, "E01");
+      else {
+        // x0 is hardwired
+        if (no != 0) *gdb_reg(no) = get_hex_word(p + 1);
+        gdb_sync_regs();
+        strcpy(reply, "OK");
+      }
+      break;
+    case 'm':
+      sscanf(pkt + 1, "%x,%x", &addr, &len);
+      gdb_read_mem(addr, len);
+      break;
+    case 'M':
+      sscanf(pkt + 1, "%x,%x", &addr, &len);
+      p = strchr(pkt, ':');
+      if (p == NULL || strlen(p + 1) < len * 2) strcpy(reply, "E01");
+      else gdb_write_mem(addr, len, p + 1);
+      break;
+    case 'c': gdb_resume_at(pkt + 1, false); return true;
+    case 's': gdb_resume_at(pkt + 1, true); return true;
+    case 'v':
+      if (gdb_vcont(pkt)) return true;
+      break;
+    case 'Z': case 'z': gdb_point(pkt[0] == 'Z', pkt + 1); break;
+    case 'q': case 'Q': gdb_query(pkt); return true;
+    case 'H': case 'T': strcpy(reply, "OK"); break;
+    case 'k':
+      nemu_state.state = NEMU_QUIT;
+      return false;
+    case 'D':
+      send_packet("OK");
+      return false;
+  }
+  send_packet(reply);
+  return true;
+}
+
+void gdb_init(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  Assert(fd >= 0, "cannot create a socket for GDB");
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(port),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+  Assert(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0, "cannot bind to port %d for GDB", port);
+  listen(fd, 1);
+  Log("Waiting for GDB on port %d, connect with 'target remote :%d'", port, port);
+  gdb_fd = accept(fd, NULL, NULL);
+  close(fd);
+  Assert(gdb_fd >= 0, "cannot accept the connection from GDB");
+  // packets are small and answered one by one
+  setsockopt(gdb_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  for (int i = 0; i < ARRLEN(gdb_wp); i ++) gdb_bp[i].no = gdb_wp[i].no = -1;
+  Log("GDB connected");
+}
+
+/* serve GDB until it kills or detaches from the guest, returning false if
+*  GDB is not used. The guest runs freely after GDB detaches.
+*/
+bool gdb_mainloop() {
+  if (gdb_fd < 0) return false;
+  while (gdb_serve());
+  close(gdb_fd);
+  gdb_fd = -1;
+  if (nemu_state.state != NEMU_QUIT && nemu_state.state != NEMU_END && nemu_state.state != NEMU_ABORT) {
+    Log("GDB detached");
+    cpu_exec(-1);
+  }
+  return true;
+}
+#endif
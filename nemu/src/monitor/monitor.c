@@ -42,11 +42,33 @@ static void welcome() {
 #include <getopt.h>
 
 void sdb_set_batch_mode();
+void simpoint_init(uint64_t interval, const char *file);
+void init_itrace(const char *file);
+void init_trace_event(const char *file);
+void profile_init(uint64_t interval, const char *file);
+void gdb_init(int port);
 
 static char *log_file = NULL;
 static char *diff_so_file = NULL;
 static char *img_file = NULL;
 static int difftest_port = 1234;
+static int gdb_port = 0;
+static char *restore_file = NULL;
+static char *itrace_file = NULL;
+static char *ftrace_json_file = NULL;
+static char *save_at_file = NULL, *bbv_file = NULL, *simpoint_prefix = NULL, *profile_file = NULL;
+static uint64_t save_at_n = 0, bbv_n = 0, simpoint_n = 0, profile_n = 0;
+
+// split an argument of N,FILE
+static char *parse_n_file(char *arg, uint64_t *n, bool enabled) {
+  char *file = strchr(arg, ',');
+  if (!enabled || file == NULL) {
+    printf(enabled ? "'%s' should be N,FILE\n" : "'%s' is not supported by this build\n", arg);
+    exit(1);
+  }
+  *n = strtoull(arg, NULL, 0);
+  return file + 1;
+}
 
 static long load_img() {
   if (img_file == NULL) {
@@ -77,17 +99,36 @@ static int parse_args(int argc, char *argv[]) {
     {"elf"      , required_argument, NULL, 'e'},
     {"diff"     , required_argument, NULL, 'd'},
     {"port"     , required_argument, NULL, 'p'},
+    {"restore"  , required_argument, NULL, 'r'},
+    {"save-at"  , required_argument, NULL, 's'},
+    {"bbv"      , required_argument, NULL, 'B'},
+    {"simpoint" , required_argument, NULL, 'S'},
+    {"itrace"   , required_argument, NULL, 't'},
+    {"ftrace-json", required_argument, NULL, 'j'},
+    {"profile"  , required_argument, NULL, 'P'},
+    {"gdb"      , required_argument, NULL, 'g'},
     {"help"     , no_argument      , NULL, 'h'},
     {0          , 0                , NULL,  0 },
   };
   int o;
-  while ( (o = getopt_long(argc, argv, "-bhl:e:d:p:", table, NULL)) != -1) {
+  while ( (o = getopt_long(argc, argv, "-bhl:e:d:p:r:s:B:S:t:j:P:g:", table, NULL)) != -1) {
     switch (o) {
       case 'b': sdb_set_batch_mode(); break;
       case 'p': sscanf(optarg, "%d", &difftest_port); break;
       case 'l': log_file = optarg; break;
       case 'e': elf_file = optarg; break;
       case 'd': diff_so_file = optarg; break;
+      case 'r': restore_file = optarg; break;
+      case 't': itrace_file = optarg; break;
+      case 'j': ftrace_json_file = optarg; break;
+      case 's': save_at_file = parse_n_file(optarg, &save_at_n, ISDEF(CONFIG_CHECKPOINT)); break;
+      case 'S': simpoint_prefix = parse_n_file(optarg, &simpoint_n, ISDEF(CONFIG_CHECKPOINT)); break;
+      case 'B': bbv_file = parse_n_file(optarg, &bbv_n, ISDEF(CONFIG_SIMPOINT)); break;
+      case 'P': profile_file = parse_n_file(optarg, &profile_n, ISDEF(CONFIG_PROFILE)); break;
+      case 'g':
+        if (!ISDEF(CONFIG_GDBSTUB)) { printf("'--gdb' is not supported by this build\n"); exit(1); }
+        sscanf(optarg, "%d", &gdb_port);
+        break;
       case 1: img_file = optarg; return 0;
       default:
         printf("Usage: %s [OPTION...] IMAGE [args]\n\n", argv[0]);
@@ -96,6 +137,14 @@ static int parse_args(int argc, char *argv[]) {
         printf("\t-e,--elf=FILE           parse given ELF FILE\n"); // parse elf  
         printf("\t-d,--diff=REF_SO        run DiffTest with reference REF_SO\n");
         printf("\t-p,--port=PORT          run DiffTest with port PORT\n");
+        printf("\t-r,--restore=FILE       restore the checkpoint FILE before running\n");
+        printf("\t-s,--save-at=N,FILE     save a checkpoint to FILE after N instructions\n");
+        printf("\t-B,--bbv=N,FILE         profile basic block vectors of every N instructions into FILE\n");
+        printf("\t-S,--simpoint=N,PREFIX  save weighted checkpoints of the simulation points in PREFIX.simpoints\n");
+        printf("\t-t,--itrace=FILE        write the binary instruction trace to FILE\n");
+        printf("\t-j,--ftrace-json=FILE   write function calls as Chrome trace events to FILE\n");
+        printf("\t-P,--profile=N,FILE     sample the guest function every N instructions, write collapsed stacks to FILE\n");
+        printf("\t-g,--gdb=PORT           wait for GDB on PORT, and serve it instead of sdb\n");
         printf("\n");
         exit(0);
     }
@@ -133,22 +182,39 @@ void init_monitor(int argc, char *argv[]) {
   /* Initialize differential testing. */
   init_difftest(diff_so_file, img_size, difftest_port);
 
+  /* Restore the checkpoint. This will overwrite the image and the registers. */
+  if (restore_file != NULL) {
+    Assert(MUXDEF(CONFIG_CHECKPOINT, checkpoint_load(restore_file), false),
+        "Can not restore checkpoint '%s'", restore_file);
+  }
+
+  /* Schedule checkpoints, profiling and tracing. */
+  IFDEF(CONFIG_CHECKPOINT, if (save_at_file != NULL) checkpoint_save_at(save_at_n, save_at_file));
+  IFDEF(CONFIG_CHECKPOINT, if (simpoint_prefix != NULL) checkpoint_save_simpoints(simpoint_n, simpoint_prefix));
+  IFDEF(CONFIG_SIMPOINT, if (bbv_file != NULL) simpoint_init(bbv_n, bbv_file));
+  IFDEF(CONFIG_ITRACE_BINARY, init_itrace(itrace_file ? itrace_file : "nemu-itrace.bin"));
+  IFDEF(CONFIG_FTRACE, if (ftrace_json_file != NULL) init_trace_event(ftrace_json_file));
+  IFDEF(CONFIG_PROFILE, if (profile_file != NULL) profile_init(profile_n, profile_file));
+
   /* Initialize the simple debugger. */
   init_sdb();
 
-#ifndef CONFIG_ISA_loongarch32r
-  IFDEF(CONFIG_ITRACE, init_disasm(
+#if !defined(CONFIG_ISA_loongarch32r) && (defined(CONFIG_ITRACE) || defined(CONFIG_IQUEUE))
+  init_disasm(
     MUXDEF(CONFIG_ISA_x86,     "i686",
     MUXDEF(CONFIG_ISA_mips32,  "mipsel",
     MUXDEF(CONFIG_ISA_riscv,
       MUXDEF(CONFIG_RV64,      "riscv64",
                                "riscv32"),
                                "bad"))) "-pc-linux-gnu"
-  ));
+  );
 #endif
 
   /* Display welcome message. */
   welcome();
+
+  /* Wait for GDB. */
+  IFDEF(CONFIG_GDBSTUB, if (gdb_port != 0) gdb_init(gdb_port));
 }
 #else // CONFIG_TARGET_AM
 static long load_img() {
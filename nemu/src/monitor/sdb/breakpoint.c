@@ -0,0 +1,146 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include "sdb.h"
+
+#define NR_BP 32 // max num of breakpoint
+#define BP_HASH_SIZE 64 // must be a power of 2 and larger than NR_BP
+
+typedef struct {
+  int NO;
+  bool used;
+  bool temporary; // set by tbreak, deleted once hit
+  vaddr_t pc;
+} BP;
+
+static BP bp_pool[NR_BP] = {};
+// open addressing on the pc, rebuilt whenever a breakpoint is added or deleted
+static BP *bp_hash[BP_HASH_SIZE] = {};
+int nr_bp = 0;
+
+void jit_flush();
+
+#define bp_index(k) ((k) & (BP_HASH_SIZE - 1))
+
+static BP *find_bp(vaddr_t pc) {
+  for (uint32_t k = pc >> 2; bp_hash[bp_index(k)] != NULL; k ++) {
+    if (bp_hash[bp_index(k)]->pc == pc) return bp_hash[bp_index(k)];
+  }
+  return NULL;
+}
+
+static void rehash_bp() {
+  memset(bp_hash, 0, sizeof(bp_hash));
+  nr_bp = 0;
+  for (int i = 0; i < NR_BP; i ++) {
+    if (!bp_pool[i].used) continue;
+    uint32_t k = bp_pool[i].pc >> 2;
+    while (bp_hash[bp_index(k)] != NULL) k ++;
+    bp_hash[bp_index(k)] = &bp_pool[i];
+    nr_bp ++;
+  }
+  // translated blocks may run over a new breakpoint, they end before one when translated again
+  IFDEF(CONFIG_ENGINE_JIT, jit_flush());
+  IFDEF(CONFIG_ENGINE_THREADED, isa_decode_cache_flush());
+}
+
+bool has_bp(vaddr_t pc) {
+  return find_bp(pc) != NULL;
+}
+
+/* stop before running the instruction at pc if there is a breakpoint,
+*  only called when nr_bp > 0
+*/
+void check_bp(vaddr_t pc) {
+  BP *bp = find_bp(pc);
+  if (bp == NULL) return;
+
+  printf("%s %d at " FMT_WORD "\n", (bp->temporary ? "Temporary breakpoint" : "Breakpoint"), bp->NO, pc);
+  nemu_state.state = NEMU_STOP;
+  if (bp->temporary) {
+    bp->used = false;
+    rehash_bp();
+  }
+}
+
+/* add a breakpoint at pc, returning its NO, or -1 if the pool is full */
+int insert_bp(vaddr_t pc, bool temporary) {
+  BP *bp = find_bp(pc);
+  if (bp != NULL) return bp->NO;
+
+  int i = 0;
+  while (i < NR_BP && bp_pool[i].used) i ++;
+  if (i == NR_BP) return -1;
+
+  bp_pool[i] = (BP) { .NO = i, .used = true, .temporary = temporary, .pc = pc };
+  rehash_bp();
+  return i;
+}
+
+/* remove the breakpoint at pc, returning false if there is none */
+bool remove_bp(vaddr_t pc) {
+  BP *bp = find_bp(pc);
+  if (bp == NULL) return false;
+  bp->used = false;
+  rehash_bp();
+  return true;
+}
+
+void add_bp(vaddr_t pc, bool temporary) {
+  BP *bp = find_bp(pc);
+  if (bp != NULL) {
+    printf("Breakpoint %d is already at " FMT_WORD "\n", bp->NO, pc);
+    return;
+  }
+
+  int no = insert_bp(pc, temporary);
+  if (no < 0) {
+    printf("No idle breakpoints in pool\n");
+    return;
+  }
+  printf("%s %d at " FMT_WORD "\n", (temporary ? "Temporary breakpoint" : "Breakpoint"), no, pc);
+}
+
+/* delete the breakpoint with the given NO, or all of them if no < 0 */
+void delete_bp(int no) {
+  if (no >= NR_BP || (no >= 0 && !bp_pool[no].used)) {
+    printf("Breakpoint %d not found\n", no);
+    return;
+  }
+
+  for (int i = 0; i < NR_BP; i ++) {
+    if (no < 0 || i == no) bp_pool[i].used = false;
+  }
+  rehash_bp();
+  if (no >= 0) printf("Breakpoint %d deleted\n", no);
+  else printf("All breakpoints deleted\n");
+}
+
+/* Print info of each breakpoint */
+void info_bp() {
+  if (nr_bp == 0) {
+    printf("No breakpoint\n");
+    return;
+  }
+
+  printf("Num    Type     Address\n");
+  for (int i = 0; i < NR_BP; i ++) {
+    if (bp_pool[i].used) {
+      printf("%-6d %-8s " FMT_WORD "\n", i, (bp_pool[i].temporary ? "tbreak" : "break"), bp_pool[i].pc);
+    }
+  }
+}
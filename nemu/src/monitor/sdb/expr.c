@@ -14,6 +14,7 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include "sdb.h"
 
 /* We use the POSIX regex functions to process regular expressions.
  * Type 'man regex' for more information about POSIX regex functions.
@@ -96,7 +97,14 @@ typedef enum {
   PAREN_NOT_MATCHED   // not enclosed and unmatched, throw it away
 } Paren_Status;
 
-/* parse the input string into an array of tokens, handling negative signs, pointer symbols, and divide-by-zero detection */
+/* a '-' or '*' is binary only if it follows an operand */
+static bool follows_operand() {
+  if (nr_token == 0) return false;
+  int type = tokens[nr_token - 1].type;
+  return type == TK_NUMS || type == TK_HEX || type == TK_REG || type == TK_RB;
+}
+
+/* parse the input string into an array of tokens, handling negative signs and pointer symbols */
 static bool make_token(char *e) {
   int position = 0;
   int i;
@@ -125,6 +133,10 @@ static bool make_token(char *e) {
 
         /* record tokens*/
         if (rules[i].token_type != TK_NOTYPE) {
+          if (nr_token == ARRLEN(tokens)) {
+            printf("too many tokens in the expression\n");
+            return false;
+          }
 
           tokens[nr_token].type = rules[i].token_type;
 
@@ -134,27 +146,13 @@ static bool make_token(char *e) {
             substr_len = sizeof(tokens[nr_token].str) - 1;
           }
 
-          Assert(nr_token < 65536, "storage cant hold that much tokens");
           Assert(substr_len < sizeof(tokens[nr_token].str), "single token overflow");
           strncpy(tokens[nr_token].str, substr_start, substr_len);   // record str into tokens
           tokens[nr_token].str[substr_len] = '\0';   // add stop sign
-          
-          // devide zero detection 2
-          if (nr_token > 0 && tokens[nr_token - 1].type == '/' && 
-              tokens[nr_token].type == TK_NUMS && 
-              atoi(tokens[nr_token].str) == 0) {
-            panic("Attempted division by zero");
-          }
 
           // check if - is negative sign or minus sign
           if (tokens[nr_token].type == '-') {
-            if (nr_token == 0 ||
-                tokens[nr_token - 1].type == TK_LB || 
-                tokens[nr_token - 1].type == TK_NEGATIVE ||
-                tokens[nr_token - 1].type == '-' ||
-                tokens[nr_token - 1].type == '+' ||
-                tokens[nr_token - 1].type == '*' ||
-                tokens[nr_token - 1].type == '/') {
+            if (!follows_operand()) {
                   tokens[nr_token].type = TK_NEGATIVE;
                   Log("A negative sign detected");
 
@@ -180,13 +178,7 @@ static bool make_token(char *e) {
 
           // check if * is multiply sign or pointer sign
           if (tokens[nr_token].type == '*') {
-            if (nr_token == 0 || 
-                tokens[nr_token - 1].type == TK_LB || 
-                tokens[nr_token - 1].type == TK_NEGATIVE ||
-                tokens[nr_token - 1].type == '-' ||
-                tokens[nr_token - 1].type == '+' ||
-                tokens[nr_token - 1].type == '*' ||
-                tokens[nr_token - 1].type == '/') {
+            if (!follows_operand()) {
                   tokens[nr_token].type = TK_POINTER;
                   Log("A pointer sign decected");
                 }
@@ -268,7 +260,15 @@ int get_operator_priority(int token_type) {
   }
 }
 
-/* return the location of main operator, it cannot inside the brackets */
+static bool is_unary(int token_type) {
+  return token_type == TK_NEGATIVE || token_type == TK_POSITIVE ||
+         token_type == TK_POINTER || token_type == TK_NOT;
+}
+
+/* return the location of main operator, it cannot inside the brackets.
+*  It is the last binary operator with the lowest priority, or the unary
+*  operator at p if there is no binary one.
+*/
 int find_main_operator(int p, int q) {
   int op = -1;
   int min_priority = INT_MAX;
@@ -280,142 +280,225 @@ int find_main_operator(int p, int q) {
     } else if (tokens[i].type == TK_RB) {
       parentheses_layer--;
     } else if (parentheses_layer == 0) {
-      // make sure filter and ignore minus sign while judging main op
-      if (tokens[i].type == TK_NEGATIVE) {
+      // unary operators and operands can not be the main operator here
+      if (is_unary(tokens[i].type)) {
         continue;
       }
 
       int priority = get_operator_priority(tokens[i].type);
 
-      if (priority <= min_priority) {
+      if (priority != INT_MAX && priority <= min_priority) {
         min_priority = priority;
         op = i;
       }
     }
   }
 
+  if (op == -1 && is_unary(tokens[p].type)) {
+    op = p;
+  }
   return op;
 }
 
-#define STACK_SIZE 1000
-word_t vaddr_read(vaddr_t addr, int len);
+/* An expression is compiled once into postfix bytecode over constants,
+*  registers and memory, and then evaluated with a small stack. This is what
+*  watchpoints run after every instruction.
+*/
+enum {
+  OP_IMM, OP_REG, OP_DEREF, OP_NEG, OP_NOT,
+  OP_ADD, OP_SUB, OP_MUL, OP_DIV,
+  OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE, OP_AND, OP_OR,
+};
 
 typedef struct {
-  int p, q;
-} StackFrame;
+  int op;
+  word_t imm;   // OP_IMM
+  word_t *reg;  // OP_REG
+} ExprOp;
+
+struct ExprCode {
+  int nr_op;
+  ExprOp op[ARRLEN(tokens)];
+};
 
-/* evaluate expression value recursively, dealing divide-by-zero detection */
-word_t eval(int p, int q) {
-  StackFrame stack[STACK_SIZE];
-  int sp = 0; //stack pointer
-  
-  stack[sp++] = (StackFrame) {
-    p, q
-  };
-
-  while (sp > 0) {
-    StackFrame frame = stack[--sp];
-    p = frame.p;
-    q = frame.q;
-
-    if (p > q) {
-      /* Bad expression */
-      panic("Bad expression");
-      return 0;
-    } else if (p == q) {
-      /* Single token.
-      * For now this token should be a number.
-      * Return the value of the number.
-      */
-      if (tokens[p].type == TK_NUMS) {
-        return (word_t)atoi(tokens[p].str);
-      } else if (tokens[p].type == TK_HEX) {
-        return strtol(tokens[p].str, NULL, 16);
-      } else if (tokens[p].type == TK_REG) {
-        bool suc = false;
-        word_t val = isa_reg_str2val(tokens[p].str, &suc);
-        if (suc == true) {
-          return val;
-        } else {
-          panic("Invalid register");
-        }
-      }
-    } else {
-      Paren_Status status = check_parentheses(p, q);
-      if (status == PAREN_ENCLOSED) {
-        /* The expression is surrounded by a matched pair of parentheses.
-        *  If that is the case, just throw away the parentheses.
-        */
-        return eval(p + 1, q - 1); 
-      } else if (status == PAREN_NOT_MATCHED) {
-        panic("Parentheses not matched");
-      }
-      
-      /* for not enclosed type, keep going */
-      int op = find_main_operator(p, q);
-      if (op == p) {
-        // unary operator
-        word_t val = eval(op + 1, q);
-        switch (tokens[op].type) {
-          case TK_NEGATIVE: return -val;
-          case TK_POSITIVE: return val;
-          case TK_POINTER:  return vaddr_read(val, 4);
-          default: panic("Unknown unary operator type: %d", tokens[op].type);
-        }
-      } else {
-        if (tokens[p].type == TK_NEGATIVE && p + 1 <= q && tokens[p + 1].type == TK_NUMS) {
-          return (word_t)-atoi(tokens[p + 1].str); 
-        } else if (tokens[p].type == TK_POSITIVE && p + 1 <= q && tokens[p + 1].type == TK_NUMS) {
-          return (word_t)atoi(tokens[p + 1].str); 
-        }
+bool vaddr_debug_read(vaddr_t addr, int len, word_t *data);
 
-        word_t val1, val2;
+static bool emit(ExprCode *c, int op, word_t imm, word_t *reg) {
+  if (c->nr_op == ARRLEN(c->op)) return false;
+  c->op[c->nr_op ++] = (ExprOp) { .op = op, .imm = imm, .reg = reg };
+  return true;
+}
 
-        stack[sp++] = (StackFrame){op + 1, q};
-        stack[sp++] = (StackFrame){p, op - 1};
-            
-        sp--;
-        val1 = eval(p, op - 1);
-        val2 = eval(op + 1, q);
+static word_t expr_calc(int op, word_t v1, word_t v2) {
+  switch (op) {
+    case OP_NEG: return -v1;
+    case OP_NOT: return !v1;
+    case OP_ADD: return v1 + v2;
+    case OP_SUB: return v1 - v2;
+    case OP_MUL: return v1 * v2;
+    case OP_DIV:
+      // the callers reject a zero divisor, and the most negative value / -1 would trap on the host
+      if ((sword_t)v2 == -1) return -v1;
+      return (sword_t)v1 / (sword_t)v2; // test samples also runs signed arithmetic and converts to uint32_t
+    case OP_EQ:  return v1 == v2;
+    case OP_NE:  return v1 != v2;
+    case OP_LT:  return v1 < v2;
+    case OP_LE:  return v1 <= v2;
+    case OP_GT:  return v1 > v2;
+    case OP_GE:  return v1 >= v2;
+    case OP_AND: return v1 && v2;
+    case OP_OR:  return v1 || v2;
+    default: panic("Unknown operator type: %d", op);
+  }
+}
 
-        if (tokens[op].type == '/' && val2 == 0) {
-        // devide zero detection 1
-        panic("Division by zero detected");
-        }
+/* emit an operator, folding it into a constant if its operands are constants,
+*  so that e.g. *(0x80000000 + 4) loads from a known address
+*/
+static bool emit_op(ExprCode *c, int op) {
+  int nr_src = (op >= OP_ADD ? 2 : 1);
+  ExprOp *src = &c->op[c->nr_op - nr_src];
+  bool is_const = (op != OP_DEREF && src[0].op == OP_IMM && (nr_src == 1 || src[1].op == OP_IMM));
+  if (is_const && op == OP_DIV && src[1].imm == 0) {
+    printf("Division by zero\n");
+    return false;
+  }
+  if (is_const) {
+    src[0].imm = expr_calc(op, src[0].imm, (nr_src == 2 ? src[1].imm : 0));
+    c->nr_op -= nr_src - 1;
+    return true;
+  }
+  return emit(c, op, 0, NULL);
+}
 
-        switch (tokens[op].type) {
-          case '+': return val1 + val2;
-          case '-': return val1 - val2;
-          case '*': return val1 * val2;
-          case '/': return (sword_t)val1 / (sword_t)val2; // test samples also runs signed arithmetic and converts to uint32_t
-          case TK_EQ: return val1 == val2;
-          case TK_NOTEQ: return val1 != val2;
-          case TK_LT: return val1 < val2;
-          case TK_LE: return val1 <= val2;
-          case TK_GT: return val1 > val2;
-          case TK_GE: return val1 >= val2;
-          case TK_AND: return val1 && val2;
-          case TK_OR: return val1 || val2;
-          default: panic("Unknown operator type: %d", tokens[op].type);
-        }
+/* compile tokens[p..q] recursively, returning false for a bad expression */
+static bool compile(int p, int q, ExprCode *c) {
+  if (p > q) {
+    /* Bad expression */
+    return false;
+  } else if (p == q) {
+    /* Single token: a number or a register. */
+    switch (tokens[p].type) {
+      case TK_NUMS: return emit(c, OP_IMM, (word_t)atoi(tokens[p].str), NULL);
+      case TK_HEX:  return emit(c, OP_IMM, strtol(tokens[p].str, NULL, 16), NULL);
+      case TK_REG: {
+        word_t *reg = isa_reg_str2ptr(tokens[p].str);
+        if (reg == NULL) printf("Invalid register %s\n", tokens[p].str);
+        return reg != NULL && emit(c, OP_REG, 0, reg);
       }
+      default: return false;
     }
   }
-  return 0;
-}
 
-/* parse and evaluate the value of an expression */
-word_t expr(char *e, bool *success) {
-  if (!make_token(e)) {
-    *success = false;
-    return 0;
+  Paren_Status status = check_parentheses(p, q);
+  if (status == PAREN_ENCLOSED) {
+    /* The expression is surrounded by a matched pair of parentheses.
+    *  If that is the case, just throw away the parentheses.
+    */
+    return compile(p + 1, q - 1, c);
+  } else if (status == PAREN_NOT_MATCHED) {
+    printf("Parentheses not matched\n");
+    return false;
+  }
+
+  /* for not enclosed type, keep going */
+  int op = find_main_operator(p, q);
+  if (op == -1) return false;
+  if (op == p) {
+    // unary operator
+    if (!compile(op + 1, q, c)) return false;
+    switch (tokens[op].type) {
+      case TK_NEGATIVE: return emit_op(c, OP_NEG);
+      case TK_POSITIVE: return true;
+      case TK_POINTER:  return emit_op(c, OP_DEREF);
+      case TK_NOT:      return emit_op(c, OP_NOT);
+      default: return false;
+    }
+  }
+
+  if (!compile(p, op - 1, c) || !compile(op + 1, q, c)) return false;
+  switch (tokens[op].type) {
+    case '+':      return emit_op(c, OP_ADD);
+    case '-':      return emit_op(c, OP_SUB);
+    case '*':      return emit_op(c, OP_MUL);
+    case '/':      return emit_op(c, OP_DIV);
+    case TK_EQ:    return emit_op(c, OP_EQ);
+    case TK_NOTEQ: return emit_op(c, OP_NE);
+    case TK_LT:    return emit_op(c, OP_LT);
+    case TK_LE:    return emit_op(c, OP_LE);
+    case TK_GT:    return emit_op(c, OP_GT);
+    case TK_GE:    return emit_op(c, OP_GE);
+    case TK_AND:   return emit_op(c, OP_AND);
+    case TK_OR:    return emit_op(c, OP_OR);
+    default: return false;
   }
+}
+
+/* parse and compile an expression, which is freed by the caller */
+ExprCode *expr_compile(char *e, bool *success) {
+  *success = false;
+  if (!make_token(e) || nr_token == 0) return NULL;
 
-  /* Insert codes to evaluate the expression. */
-  // backup option to detect devision by zero here
+  ExprCode *c = malloc(sizeof(ExprCode));
+  c->nr_op = 0;
+  if (!compile(0, nr_token - 1, c)) {
+    free(c);
+    return NULL;
+  }
+  *success = true;
+  return c;
+}
 
+/* evaluate a compiled expression, failing on a division by zero or an unmapped address */
+word_t expr_eval(ExprCode *c, bool *success) {
+  word_t stack[ARRLEN(c->op)], data;
+  int sp = 0;
+  *success = false;
+  for (ExprOp *o = c->op; o < c->op + c->nr_op; o ++) {
+    switch (o->op) {
+      case OP_IMM:   stack[sp ++] = o->imm; break;
+      case OP_REG:   stack[sp ++] = *o->reg; break;
+      case OP_DEREF:
+        if (!vaddr_debug_read(stack[sp - 1], 4, &data)) { printf("Cannot access memory at " FMT_WORD "\n", stack[sp - 1]); return 0; }
+        stack[sp - 1] = data; break;
+      case OP_NEG: case OP_NOT: stack[sp - 1] = expr_calc(o->op, stack[sp - 1], 0); break;
+      case OP_DIV:
+        if (stack[sp - 1] == 0) { printf("Division by zero\n"); return 0; }
+        sp --; stack[sp - 1] = expr_calc(o->op, stack[sp - 1], stack[sp]); break;
+      default: sp --; stack[sp - 1] = expr_calc(o->op, stack[sp - 1], stack[sp]); break;
+    }
+  }
   *success = true;
-  return eval(0, nr_token - 1);
+  return stack[0];
+}
 
-  return 0;
+/* Tell which registers and which memory words a compiled expression reads.
+*  Only loads from constant addresses can be listed, deps->polled is set if
+*  there is any other load, or too many dependencies.
+*/
+void expr_deps(ExprCode *c, ExprDeps *deps) {
+  deps->nr_reg = deps->nr_mem = 0;
+  deps->polled = false;
+  for (int i = 0; i < c->nr_op; i ++) {
+    ExprOp *o = &c->op[i];
+    if (o->op == OP_REG) {
+      int k = 0;
+      while (k < deps->nr_reg && deps->reg[k] != o->reg) k ++;
+      if (k < deps->nr_reg) continue;
+      if (deps->nr_reg == ARRLEN(deps->reg)) deps->polled = true;
+      else deps->reg[deps->nr_reg ++] = o->reg;
+    } else if (o->op == OP_DEREF) {
+      if (i == 0 || c->op[i - 1].op != OP_IMM || deps->nr_mem == ARRLEN(deps->mem)) deps->polled = true;
+      else deps->mem[deps->nr_mem ++] = c->op[i - 1].imm;
+    }
+  }
+}
+
+/* parse and evaluate the value of an expression */
+word_t expr(char *e, bool *success) {
+  ExprCode *c = expr_compile(e, success);
+  if (c == NULL) return 0;
+  word_t val = expr_eval(c, success);
+  free(c);
+  return val;
 }
@@ -23,7 +23,8 @@ static int is_batch_mode = false;
 
 void init_regex();
 void init_wp_pool();
-word_t vaddr_read(vaddr_t addr, int len);
+bool gdb_mainloop();
+bool vaddr_debug_read(vaddr_t addr, int len, word_t *data);
 
 /* We use the `readline' library to provide more flexibility to read from stdin. */
 static char* rl_gets() {
@@ -75,12 +76,15 @@ static int cmd_d(char *args);
 void info_wp();
 void add_wp(char *expr, word_t val);
 void delete_wp(int no);
+void info_bp();
+void add_bp(vaddr_t pc, bool temporary);
+void delete_bp(int no);
 
 /* info [SUBCMD: r/w]*/
 static int cmd_info(char *args) {
   char *arg = strtok(NULL, " ");
   if (arg == NULL) {
-    printf("Usage: info [r | w]\n");
+    printf("Usage: info [r | w | b]\n");
     return 0;
   }
 
@@ -91,6 +95,9 @@ static int cmd_info(char *args) {
     case 'w':
       info_wp();
       break;
+    case 'b':
+      info_bp();
+      break;
     default:
       printf("Unknown option: %s\n", arg);
   }
@@ -124,7 +131,11 @@ static int cmd_x(char *args) {
 
   for (int i = 0; i < N; i++) {
     vaddr_t address = start_address + i * 4;
-    word_t data = vaddr_read(address, 4);
+    word_t data;
+    if (!vaddr_debug_read(address, 4, &data)) {
+      printf("Cannot access memory at 0x%x\n", address);
+      break;
+    }
     printf("0x%x: 0x%x (%u)\n", address, data, data);
   }
   return 0;
@@ -180,6 +191,58 @@ static int cmd_d(char *args) {
   return 0;
 }
 
+/* b [EXPR], tbreak [EXPR] */
+static int set_bp(char *args, bool temporary) {
+  if (args == NULL) {
+    printf("No address provided\n");
+    return 0;
+  }
+
+  bool success;
+  word_t pc = expr(args, &success);
+  if (!success) {
+    printf("Invaild expression: %s\n", args);
+    return 0;
+  }
+
+  add_bp(pc, temporary);
+  return 0;
+}
+
+static int cmd_b(char *args) { return set_bp(args, false); }
+static int cmd_tbreak(char *args) { return set_bp(args, true); }
+
+/* delete [N] */
+static int cmd_delete(char *args) {
+  char *arg = strtok(args, " ");
+  delete_bp(arg == NULL ? -1 : strtol(arg, NULL, 10));
+  return 0;
+}
+
+#ifdef CONFIG_CHECKPOINT
+/* save [FILE] */
+static int cmd_save(char *args) {
+  char *arg = strtok(args, " ");
+  if (arg == NULL) {
+    printf("No file provided\n");
+    return 0;
+  }
+  if (!checkpoint_save(arg)) printf("Can not save checkpoint to '%s'\n", arg);
+  return 0;
+}
+
+/* load [FILE] */
+static int cmd_load(char *args) {
+  char *arg = strtok(args, " ");
+  if (arg == NULL) {
+    printf("No file provided\n");
+    return 0;
+  }
+  if (!checkpoint_load(arg)) printf("Can not load checkpoint from '%s'\n", arg);
+  return 0;
+}
+#endif
+
 static int cmd_help(char *args);
 
 static struct {
@@ -194,13 +257,21 @@ static struct {
   { "info", "Print program status\n"
     "Usage:\n"
     "-r: Print register status\n"
-    "-w: Print watchpoint status\n", cmd_info },
+    "-w: Print watchpoint status\n"
+    "-b: Print breakpoint status\n", cmd_info },
   { "x", "Find the value of given expression, and output [N] consecutive 4-byte outputs in hexadecimal\n"
     "Usage:\n"
     "x [N] [EXPR]", cmd_x },
   { "p", "Evaluate the given [EXPR] and return its result in decimal and hexadecimal formats" , cmd_p },
   { "w", "Set a watchpoint at [EXPR], and pause the program when it changes", cmd_w },
-  { "d", "Delete watchpoint with serial number [N]", cmd_d }
+  { "d", "Delete watchpoint with serial number [N]", cmd_d },
+  { "b", "Set a breakpoint at the address [EXPR], and pause the program before running it", cmd_b },
+  { "tbreak", "Set a breakpoint at the address [EXPR], which is deleted once it is hit", cmd_tbreak },
+  { "delete", "Delete breakpoint with serial number [N], or all breakpoints without [N]", cmd_delete },
+#ifdef CONFIG_CHECKPOINT
+  { "save", "Save a checkpoint of the machine to [FILE]", cmd_save },
+  { "load", "Restore the machine from the checkpoint [FILE]", cmd_load },
+#endif
   /* Add more commands */
 };
 
@@ -234,8 +305,21 @@ void sdb_set_batch_mode() {
 }
 
 void sdb_mainloop() {
+  IFDEF(CONFIG_CHECKPOINT, if (checkpoint_take_scheduled()) return);
+  IFDEF(CONFIG_GDBSTUB, if (gdb_mainloop()) return);
+
   if (is_batch_mode) {
+#ifdef CONFIG_CHECKPOINT
+    // a restored sample only runs its own interval
+    uint64_t n = checkpoint_sample_len();
+    cpu_exec(n);
+    if (n != -1 && nemu_state.state == NEMU_STOP) {
+      Log("The sample ends after " "%" PRIu64 " instructions", n);
+      nemu_state.state = NEMU_QUIT;
+    }
+#else
     cmd_c(NULL);
+#endif
     return;
   }
 
@@ -20,4 +20,17 @@
 
 word_t expr(char *e, bool *success);
 
+typedef struct ExprCode ExprCode;
+ExprCode *expr_compile(char *e, bool *success);
+word_t expr_eval(ExprCode *code, bool *success);
+
+#define EXPR_NR_DEP 4
+typedef struct {
+  int nr_reg, nr_mem;
+  word_t *reg[EXPR_NR_DEP];
+  vaddr_t mem[EXPR_NR_DEP]; // address of each 4-byte load
+  bool polled;              // must be evaluated after every instruction
+} ExprDeps;
+void expr_deps(ExprCode *code, ExprDeps *deps);
+
 #endif
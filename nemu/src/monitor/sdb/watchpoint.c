@@ -13,6 +13,9 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#include <isa.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include "sdb.h"
 
 #define NR_WP 32 // max num of watchpoint
@@ -25,6 +28,12 @@ typedef struct watchpoint {
 
   word_t value;
   char *expression;
+  ExprCode *code; // compiled once, and evaluated only when what it reads may have changed
+  ExprDeps deps;
+  word_t reg_value[EXPR_NR_DEP]; // registers in deps when last checked
+  bool dirty;      // a watched memory word has been written
+  bool hooked;     // the memory words in deps are hooked by their physical address, or polled
+  bool on_write;   // triggered by any write to the watched word, set by the GDB stub
 
 } WP;
 
@@ -34,6 +43,8 @@ typedef struct watchpoint {
 */
 static WP wp_pool[NR_WP] = {};
 static WP *head = NULL, *free_ = NULL;
+static bool triggered = false;  // since the last wp_triggered()
+static vaddr_t triggered_addr = 0;
 
 void init_wp_pool() {
   int i;
@@ -61,6 +72,29 @@ WP* new_wp() {
   return wp;
 }
 
+// whether the word at addr is in pmem and mapped directly, so that it can be hooked by its physical address
+static bool wp_hookable(vaddr_t addr) {
+  return in_pmem(addr) && in_pmem(addr + 3) && isa_mmu_check(addr, 4, MEM_TYPE_READ) == MMU_DIRECT;
+}
+
+// hook the memory words read by a watchpoint, if all of them can be hooked
+static void wp_hook(WP *wp) {
+  wp->hooked = !wp->deps.polled;
+  for (int i = 0; i < wp->deps.nr_mem; i ++) {
+    if (!wp_hookable(wp->deps.mem[i])) wp->hooked = false;
+  }
+  if (wp->hooked) {
+    for (int i = 0; i < wp->deps.nr_mem; i ++) IFDEF(CONFIG_WATCHPOINT, paddr_watch(wp->deps.mem[i], 4, true));
+  }
+}
+
+static void wp_unhook(WP *wp) {
+  if (wp->hooked) {
+    for (int i = 0; i < wp->deps.nr_mem; i ++) IFDEF(CONFIG_WATCHPOINT, paddr_watch(wp->deps.mem[i], 4, false));
+  }
+  wp->hooked = false;
+}
+
 /* Find the watchpoint need to be free, and also free its expression member */
 void free_wp(WP* wp) {
   Assert(wp != NULL, "The watchpoint to be released cannot be NULL");
@@ -78,8 +112,11 @@ void free_wp(WP* wp) {
     }
   }
 
-  // Free the expression string
+  wp_unhook(wp);
+
+  // Free the expression string and its code
   free(wp->expression);
+  free(wp->code);
 
   wp->next = free_;
   free_ = wp;
@@ -100,53 +137,130 @@ void info_wp() {
   }
 }
 
+static void init_wp(WP *wp, char *expr, word_t val) {
+  bool success;
+  wp->expression = strdup(expr);
+  wp->code = expr_compile(expr, &success);
+  Assert(success, "Fail to compile the expression of watchpoint");
+  wp->value = val;
+  wp->dirty = false;
+  wp->on_write = false;
+
+  // memory is hooked by its physical address, other loads are polled
+  expr_deps(wp->code, &wp->deps);
+  wp_hook(wp);
+  for (int i = 0; i < wp->deps.nr_reg; i ++) wp->reg_value[i] = *wp->deps.reg[i];
+}
+
 /* generate a watchpoint and set its expr and val as given value */
 void add_wp(char *expr, word_t val){
   WP* wp = new_wp();
   Assert(wp != NULL, "Fail to add watchpoint, no idle watchpoint");
 
-  wp->expression = strdup(expr);
-  wp->value = val;
-
+  init_wp(wp, expr, val);
   printf("Watchpoint %d: %s\n", wp->NO, expr);
 }
 
+/* watch every write to the word at addr in pmem, returning the NO or -1 */
+int add_wp_write(vaddr_t addr) {
+  if (free_ == NULL || !wp_hookable(addr)) return -1;
+
+  char e[32];
+  snprintf(e, sizeof(e), "*" FMT_WORD, addr);
+  WP *wp = new_wp();
+  init_wp(wp, e, vaddr_read(addr, 4));
+  wp->on_write = true;
+  return wp->NO;
+}
+
+/* remove a watchpoint from list based on the given NO, returning false if not found */
+bool remove_wp(int no) {
+  for (WP *wp = head; wp != NULL; wp = wp->next) {
+    if (wp->NO == no) {
+      free_wp(wp);
+      return true;
+    }
+  }
+  return false;
+}
+
 /* delete a watchpoint from list based on the given NO */
 void delete_wp(int no) {
   Assert(no < NR_WP, "Invalid watchpoint No");
 
-  WP* wp = head;
-  WP* prev = NULL;
+  if (remove_wp(no)) printf("Watchpoint %d deleted\n", no);
+  else printf("Watchpoint %d not found\n", no);
+}
 
-  while (wp != NULL) {
-    if (wp->NO == no) {
-      if (prev == NULL) {
-        head = wp->next;
-      } else {
-        prev->next = wp->next;
-      }
+/* whether a watchpoint has been triggered since the last call, and the word
+*  it watches if it is triggered by writes
+*/
+bool wp_triggered(vaddr_t *addr) {
+  bool ret = triggered;
+  *addr = triggered_addr;
+  triggered = false;
+  return ret;
+}
 
-      free_wp(wp);
-      printf("Watchpoint %d deleted\n", no);
-      return;
+/* called by paddr_write() for stores into watched pages */
+void wp_mem_write(paddr_t addr, int len) {
+  for (WP *wp = head; wp != NULL; wp = wp->next) {
+    for (int i = 0; i < wp->deps.nr_mem; i ++) {
+      if (addr < wp->deps.mem[i] + 4 && wp->deps.mem[i] < addr + len) wp->dirty = true;
     }
-    prev = wp;
-    wp = wp->next;
   }
+}
 
-  printf("Watchpoint %d not found\n", no);
+/* The words hooked are the physical ones of their addresses when the
+*  watchpoints are added, which are wrong once paging is turned on or off.
+*  Called when satp changes.
+*/
+void wp_translation_changed() {
+  for (WP *wp = head; wp != NULL; wp = wp->next) {
+    wp_unhook(wp);
+    wp_hook(wp);
+    // the words read may be others now, but they are not written
+    if (!wp->on_write) wp->dirty = true;
+  }
+}
+
+/* whether a register read by the watchpoint has been written since the last check */
+static bool reg_changed(WP *wp) {
+  bool changed = false;
+  for (int i = 0; i < wp->deps.nr_reg; i ++) {
+    if (*wp->deps.reg[i] != wp->reg_value[i]) {
+      wp->reg_value[i] = *wp->deps.reg[i];
+      changed = true;
+    }
+  }
+  return changed;
 }
 
 /* iterate through the watchpoint list, check and report changes in expression values */
 void check_wp() {
   WP* wp = head;
   while (wp != NULL) {
+    bool polled = wp->deps.polled || (wp->deps.nr_mem > 0 && !wp->hooked);
+    if (!reg_changed(wp) && !wp->dirty && !polled) {
+      wp = wp->next;
+      continue;
+    }
+    bool written = wp->on_write && wp->dirty;
+    wp->dirty = false;
     bool success;
-    word_t new_value = expr(wp->expression, &success);
-    assert(success);
-    // printf("%u\n", new_value);
+    word_t new_value = expr_eval(wp->code, &success);
+    if (!success) {
+      printf("Watchpoint %d is deleted, as it can not be evaluated: %s\n", wp->NO, wp->expression);
+      WP *next = wp->next;
+      free_wp(wp);
+      nemu_state.state = NEMU_STOP;
+      wp = next;
+      continue;
+    }
 
-    if (new_value != wp->value) {
+    if (new_value != wp->value || written) {
+      triggered = true;
+      triggered_addr = (wp->on_write ? wp->deps.mem[0] : 0);
       printf("Watchpoint %d triggered: %s\n", wp->NO, wp->expression);
       printf("Old value = %u\n", wp->value);
       printf("New value = %u\n", new_value);
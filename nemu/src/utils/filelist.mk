@@ -18,3 +18,7 @@ CXXSRC = src/utils/disasm.cc
 CXXFLAGS += $(shell llvm-config --cxxflags) -fPIE
 LIBS += $(shell llvm-config --libs)
 endif
+
+ifdef CONFIG_FTRACE
+LIBS += -lpthread
+endif
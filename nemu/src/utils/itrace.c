@@ -0,0 +1,119 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/decode.h>
+#include <cpu/itrace.h>
+
+#ifdef CONFIG_ITRACE_BINARY
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Records are written into a shared mapping of the trace file, which slides
+*  forward in windows of ITRACE_WINDOW bytes. The header stays mapped on its
+*  own, and its end is updated after every record, so the trace can be read
+*  even if NEMU aborts. The file is cut to the end at exit.
+*/
+#define ITRACE_WINDOW (16 << 20)
+#define ITRACE_PAGE 4096
+
+extern uint64_t g_nr_guest_inst;
+
+static int fd = -1;
+static ItraceHeader *hdr = NULL;
+static uint8_t *win = NULL, *wp = NULL;
+static off_t win_off = 0;
+static vaddr_t last_pc = 0;
+static uint64_t next_inst = 0;
+static word_t shadow[ARRLEN(cpu.gpr)] = {};
+
+static void itrace_map(off_t off) {
+  if (win != NULL) munmap(win, ITRACE_WINDOW);
+  Assert(ftruncate(fd, off + ITRACE_WINDOW) == 0, "Can not extend the instruction trace");
+  win = mmap(NULL, ITRACE_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, fd, off);
+  Assert(win != MAP_FAILED, "Can not map the instruction trace");
+  win_off = off;
+}
+
+static void itrace_slide() {
+  off_t pos = win_off + (wp - win);
+  itrace_map(pos & ~(off_t)(ITRACE_PAGE - 1));
+  wp = win + (pos - win_off);
+}
+
+static void itrace_close() {
+  off_t size = hdr->end;
+  munmap(win, ITRACE_WINDOW);
+  munmap(hdr, ITRACE_PAGE);
+  if (ftruncate(fd, size) != 0) perror("itrace");
+  close(fd);
+}
+
+void itrace_write(Decode *s) {
+  if (unlikely(wp + ITRACE_MAX_RECORD > win + ITRACE_WINDOW)) itrace_slide();
+  uint8_t *tag = wp ++;
+  *tag = 0;
+  if (g_nr_guest_inst != next_inst) {
+    *tag |= ITRACE_TAG_SKIP;
+    wp = itrace_put_varint(wp, g_nr_guest_inst - next_inst);
+  }
+  if (s->pc != last_pc + 4) {
+    *tag |= ITRACE_TAG_JUMP;
+    wp = itrace_put_varint(wp, itrace_zigzag((sword_t)(s->pc - (last_pc + 4))));
+  }
+  memcpy(wp, &s->isa.inst.val, 4);
+  wp += 4;
+#ifdef CONFIG_ITRACE_BINARY_REG
+  int nr_reg = 0;
+  for (int i = 1; i < ARRLEN(cpu.gpr); i ++) {
+    if (cpu.gpr[i] == shadow[i]) continue;
+    *wp ++ = i;
+    wp = itrace_put_varint(wp, itrace_zigzag((sword_t)(cpu.gpr[i] - shadow[i])));
+    shadow[i] = cpu.gpr[i];
+    nr_reg ++;
+  }
+  *tag |= nr_reg << 2;
+#endif
+  last_pc = s->pc;
+  next_inst = g_nr_guest_inst + 1;
+  hdr->end = win_off + (wp - win);
+}
+
+void init_itrace(const char *file) {
+  fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  Assert(fd >= 0, "Can not open '%s'", file);
+  itrace_map(0);
+  hdr = mmap(NULL, ITRACE_PAGE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  Assert(hdr != MAP_FAILED, "Can not map the instruction trace");
+  memcpy(hdr->magic, ITRACE_MAGIC, sizeof(hdr->magic));
+  hdr->version = ITRACE_VERSION;
+  hdr->flags = MUXDEF(CONFIG_ITRACE_BINARY_REG, ITRACE_FLAG_REG, 0);
+  hdr->ilen = 4;
+  hdr->nr_gpr = ARRLEN(cpu.gpr);
+  hdr->start_inst = next_inst = g_nr_guest_inst;
+  hdr->start_pc = cpu.pc;
+  wp = win + sizeof(ItraceHeader);
+  for (int i = 0; i < ARRLEN(cpu.gpr); i ++) {
+    uint64_t v = shadow[i] = cpu.gpr[i]; // not zero after restoring a checkpoint
+    memcpy(wp, &v, sizeof(v));
+    wp += sizeof(v);
+  }
+  hdr->end = wp - win;
+  last_pc = cpu.pc - 4;
+  atexit(itrace_close);
+  Log("Binary instruction trace is written to %s", file);
+}
+#endif
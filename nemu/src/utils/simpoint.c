@@ -0,0 +1,116 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+
+#ifdef CONFIG_SIMPOINT
+/* Basic block vectors for SimPoint. A basic block is identified by the pc
+*  of its first instruction, i.e. the target of the last control transfer.
+*  Every N instructions a line of
+*    T:id:count :id:count ...
+*  is written, where count is the number of instructions executed in that
+*  block during the interval. Block ids start from 1, as SimPoint expects.
+*/
+typedef struct {
+  vaddr_t pc;
+  uint32_t id; // 0 for an empty slot
+} BBEntry;
+
+static FILE *bbv_fp = NULL;
+static uint64_t interval = 0, nr_inst = 0;
+static BBEntry *bb_table = NULL;
+static uint32_t bb_table_size = 0, nr_bb = 0;
+static uint64_t *bb_count = NULL; // indexed by id
+static uint32_t *bb_touched = NULL, nr_touched = 0;
+static vaddr_t bb_start = 0;
+static uint64_t bb_len = 0;
+
+static inline uint32_t bb_hash(vaddr_t pc) {
+  return (uint32_t)((pc >> 1) * 0x9e3779b1u);
+}
+
+static void bb_table_resize(uint32_t size) {
+  BBEntry *old = bb_table;
+  uint32_t old_size = bb_table_size;
+  bb_table = calloc(size, sizeof(BBEntry));
+  bb_count = realloc(bb_count, sizeof(uint64_t) * size);
+  bb_touched = realloc(bb_touched, sizeof(uint32_t) * size);
+  assert(bb_table && bb_count && bb_touched);
+  memset(bb_count + old_size, 0, sizeof(uint64_t) * (size - old_size));
+  bb_table_size = size;
+  for (uint32_t i = 0; i < old_size; i ++) {
+    if (old[i].id == 0) continue;
+    uint32_t h = bb_hash(old[i].pc) & (size - 1);
+    while (bb_table[h].id != 0) h = (h + 1) & (size - 1);
+    bb_table[h] = old[i];
+  }
+  free(old);
+}
+
+static uint32_t bb_id(vaddr_t pc) {
+  uint32_t h = bb_hash(pc) & (bb_table_size - 1);
+  for (; bb_table[h].id != 0; h = (h + 1) & (bb_table_size - 1)) {
+    if (bb_table[h].pc == pc) return bb_table[h].id;
+  }
+  bb_table[h] = (BBEntry){ .pc = pc, .id = ++ nr_bb };
+  if (nr_bb * 2 >= bb_table_size) bb_table_resize(bb_table_size * 2);
+  return nr_bb;
+}
+
+static void bb_commit() {
+  if (bb_len == 0) return;
+  uint32_t id = bb_id(bb_start);
+  if (bb_count[id] == 0) bb_touched[nr_touched ++] = id;
+  bb_count[id] += bb_len;
+  bb_len = 0;
+}
+
+static void bbv_dump() {
+  fputc('T', bbv_fp);
+  for (uint32_t i = 0; i < nr_touched; i ++) {
+    uint32_t id = bb_touched[i];
+    fprintf(bbv_fp, ":%u:%" PRIu64 " ", id, bb_count[id]);
+    bb_count[id] = 0;
+  }
+  fputc('\n', bbv_fp);
+  fflush(bbv_fp);
+  nr_touched = 0;
+}
+
+void simpoint_profile(vaddr_t pc, vaddr_t snpc, vaddr_t dnpc) {
+  if (bbv_fp == NULL) return;
+  bb_len ++;
+  if (dnpc != snpc) {
+    bb_commit();
+    bb_start = dnpc;
+  }
+  if (++ nr_inst == interval) {
+    // a block running across the boundary is split into both intervals
+    bb_commit();
+    bbv_dump();
+    nr_inst = 0;
+  }
+}
+
+void simpoint_init(uint64_t n, const char *file) {
+  assert(n > 0);
+  bbv_fp = fopen(file, "w");
+  Assert(bbv_fp, "Can not open '%s'", file);
+  interval = n;
+  bb_table_resize(4096);
+  bb_start = cpu.pc;
+  Log("Basic block vectors of every %" PRIu64 " instructions are written to %s", n, file);
+}
+#endif
@@ -0,0 +1,107 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#include <common.h>
+
+#ifdef CONFIG_FTRACE
+#include <pthread.h>
+
+/* Function calls are written as Chrome trace events, which can be loaded
+*  into chrome://tracing or ui.perfetto.dev. The timestamp is the number of
+*  guest instructions, shown as 1 us per instruction.
+*  Events are formatted into one of two buffers, and a full buffer is written
+*  to the file by another thread while the other one is being filled.
+*/
+#define TE_BUF_SIZE (1 << 20)
+#define TE_MAX_EVENT 512
+
+extern uint64_t g_nr_guest_inst;
+
+static FILE *te_fp = NULL;
+static char te_buf[2][TE_BUF_SIZE];
+static int te_cur = 0;
+static size_t te_len = 0;
+static bool te_first = true;
+
+static pthread_t te_writer;
+static pthread_mutex_t te_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t te_cond = PTHREAD_COND_INITIALIZER;
+static char *te_pending = NULL;
+static size_t te_pending_len = 0;
+static bool te_done = false;
+
+static void *te_write_loop(void *arg) {
+  pthread_mutex_lock(&te_lock);
+  while (true) {
+    while (te_pending == NULL && !te_done) pthread_cond_wait(&te_cond, &te_lock);
+    if (te_pending == NULL) break;
+    char *buf = te_pending;
+    size_t len = te_pending_len;
+    pthread_mutex_unlock(&te_lock);
+    fwrite(buf, 1, len, te_fp);
+    pthread_mutex_lock(&te_lock);
+    te_pending = NULL;
+    pthread_cond_broadcast(&te_cond);
+  }
+  pthread_mutex_unlock(&te_lock);
+  return NULL;
+}
+
+// hand the current buffer to the writer, waiting for the previous one to be written
+static void te_submit() {
+  pthread_mutex_lock(&te_lock);
+  while (te_pending != NULL) pthread_cond_wait(&te_cond, &te_lock);
+  te_pending = te_buf[te_cur];
+  te_pending_len = te_len;
+  pthread_cond_broadcast(&te_cond);
+  pthread_mutex_unlock(&te_lock);
+  te_cur ^= 1;
+  te_len = 0;
+}
+
+bool trace_event_enabled() {
+  return te_fp != NULL;
+}
+
+// ph is 'B' for the beginning of a function, or 'E' for its end
+void trace_event(const char *name, char ph) {
+  if (te_len + TE_MAX_EVENT > TE_BUF_SIZE) te_submit();
+  te_len += snprintf(te_buf[te_cur] + te_len, TE_MAX_EVENT,
+      "%s{\"name\":\"%.400s\",\"ph\":\"%c\",\"ts\":%" PRIu64 ",\"pid\":1,\"tid\":1}",
+      (te_first ? "\n" : ",\n"), name, ph, g_nr_guest_inst);
+  te_first = false;
+}
+
+static void trace_event_close() {
+  te_len += snprintf(te_buf[te_cur] + te_len, TE_MAX_EVENT, "\n]}\n");
+  te_submit();
+  pthread_mutex_lock(&te_lock);
+  te_done = true;
+  pthread_cond_broadcast(&te_cond);
+  pthread_mutex_unlock(&te_lock);
+  pthread_join(te_writer, NULL);
+  fclose(te_fp);
+}
+
+void init_trace_event(const char *file) {
+  te_fp = fopen(file, "w");
+  Assert(te_fp, "Can not open '%s'", file);
+  te_len = snprintf(te_buf[te_cur], TE_BUF_SIZE, "{\"otherData\":{\"timestamp\":\"guest instructions\"},\"traceEvents\":[");
+  pthread_create(&te_writer, NULL, te_write_loop, NULL);
+  atexit(trace_event_close);
+  Log("Function trace events are written to %s", file);
+}
+#endif
@@ -5,47 +5,28 @@
 #include <device/map.h>
 #include <elf.h>
 
-#define MAX_SIZE_RING_BUFFER 16
-
+#ifdef CONFIG_IQUEUE
+/* The recently executed instructions are kept raw, and are formatted and
+*  disassembled only when an error is reported.
+*/
 typedef struct {
-  char buffer[MAX_SIZE_RING_BUFFER][128]; // store the log
-  int head;  // point to the newest writting 
-  int size;  // the num of log inside
-} RingBuffer;
-
-RingBuffer ring_buffer = {{{0}}, 0, 0};
-
-void print_ring_buffer() {
-  printf("Error occurred, recent instructions:\n");
-  int index = ring_buffer.head;
-  for (int i = 0; i < ring_buffer.size; i++) {
-    index = (index - 1 + MAX_SIZE_RING_BUFFER) % MAX_SIZE_RING_BUFFER; // move backward
-    if (index == 0) {
-      printf("--> %s\n", ring_buffer.buffer[index]); // the error instruction
-    } else {
-      printf("    %s\n", ring_buffer.buffer[index]);
-    }
-  }
-}
-
-void write_ring_buffer(const char *logbuf) {
-  // ring_buffer.buffer => array, ring_buffer.head => current index 
-  // combine them => specific element at current index in array
-  snprintf(ring_buffer.buffer[ring_buffer.head], sizeof(ring_buffer.buffer[ring_buffer.head]), "%s", logbuf);
-  ring_buffer.head = (ring_buffer.head + 1) % MAX_SIZE_RING_BUFFER; // ring loop
-  if (ring_buffer.size < MAX_SIZE_RING_BUFFER) {
-    ring_buffer.size++;
-  }
-}
-
-void inst_trace(Decode *s) {
-  #ifdef CONFIG_ITRACE
+  vaddr_t pc, dnpc;
+  uint32_t inst;
+  uint32_t ilen;
+} IQueueEntry;
+
+static_assert((CONFIG_IQUEUE_SIZE & (CONFIG_IQUEUE_SIZE - 1)) == 0, "CONFIG_IQUEUE_SIZE must be a power of 2");
+static IQueueEntry iqueue[CONFIG_IQUEUE_SIZE];
+static uint64_t iqueue_nr = 0; // number of instructions ever recorded
+#endif
+
+#if defined(CONFIG_ITRACE) || defined(CONFIG_IQUEUE)
+static void format_inst(char *buf, int size, vaddr_t pc, vaddr_t snpc, uint8_t *inst) {
   // format instructions to hex 
-  char *p = s->logbuf;
-  p += snprintf(p, sizeof(s->logbuf), FMT_WORD ":", s->pc); // write current pc into logbuf and move to next
-  int ilen = s->snpc - s->pc; // get length of the instruction by sub static next pc and current pc
+  char *p = buf;
+  p += snprintf(p, size, FMT_WORD ":", pc); // write current pc into logbuf and move to next
+  int ilen = snpc - pc; // get length of the instruction by sub static next pc and current pc
   int i;
-  uint8_t *inst = (uint8_t *)&s->isa.inst.val;
   for (i = ilen - 1; i >= 0; i --) {
     p += snprintf(p, 4, " %02x", inst[i]); // turn to hex 
   }
@@ -62,13 +43,47 @@ void inst_trace(Decode *s) {
   #ifndef CONFIG_ISA_loongarch32r
     // if current ISA is NOT loongarch, use disassemble() get the instruction's assembly language, write the result into logbuf
     void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
-    disassemble(p, s->logbuf + sizeof(s->logbuf) - p,
-        MUXDEF(CONFIG_ISA_x86, s->snpc, s->pc), (uint8_t *)&s->isa.inst.val, ilen);
+    disassemble(p, buf + size - p, MUXDEF(CONFIG_ISA_x86, snpc, pc), inst, ilen);
   #else
     p[0] = '\0'; // the upstream llvm does not support loongarch32r
   #endif
-  write_ring_buffer(s->logbuf);
-  #endif
+}
+#endif
+
+void print_ring_buffer() {
+#ifdef CONFIG_IQUEUE
+  printf("Error occurred, recent instructions:\n");
+  uint64_t nr = (iqueue_nr < CONFIG_IQUEUE_SIZE ? iqueue_nr : CONFIG_IQUEUE_SIZE);
+  for (uint64_t i = iqueue_nr - nr; i < iqueue_nr; i ++) {
+    IQueueEntry *e = &iqueue[i & (CONFIG_IQUEUE_SIZE - 1)];
+    char buf[128];
+    format_inst(buf, sizeof(buf), e->pc, e->pc + e->ilen, (uint8_t *)&e->inst);
+    // the last one is the error instruction, and jumps are followed by their targets
+    printf("%s %s", (i == iqueue_nr - 1 ? "-->" : "   "), buf);
+    if (e->dnpc != e->pc + e->ilen) printf("  => " FMT_WORD, e->dnpc);
+    putchar('\n');
+  }
+  fflush(stdout);
+#endif
+}
+
+// format an instruction into its logbuf, only when the text is needed
+void inst_format(Decode *s) {
+  IFDEF(CONFIG_ITRACE, format_inst(s->logbuf, sizeof(s->logbuf), s->pc, s->snpc, (uint8_t *)&s->isa.inst.val));
+}
+
+void inst_trace(Decode *s) {
+#ifdef CONFIG_IQUEUE
+  IQueueEntry *e = &iqueue[iqueue_nr ++ & (CONFIG_IQUEUE_SIZE - 1)];
+  e->pc = s->pc;
+  e->dnpc = s->dnpc;
+  e->inst = s->isa.inst.val;
+  e->ilen = s->snpc - s->pc;
+#endif
+#ifdef CONFIG_ITRACE_BINARY
+  void itrace_write(Decode *s);
+  if (ITRACE_COND) itrace_write(s);
+#endif
 }
 
 void mem_read_trace(paddr_t addr, int len) {
@@ -88,14 +103,33 @@ void device_write_trace(paddr_t addr, int len, word_t data, IOMap *map) {
 }
 
 typedef struct {
-    char name[32];  // symbol name
+    char *name;   // symbol name
     paddr_t addr; // address of the function head 
     Elf32_Xword size;
 } Symbol;
 
-Symbol *symbol = NULL;  // dynamic allocation of symbol array
+Symbol *symbol = NULL;  // dynamic allocation of symbol array, sorted by address
 int func_num = 0;       // function counter
-int depth = 1;          // function stack depth
+static Elf32_Xword func_size_max = 0; // no function starting farther before a pc contains it
+
+#ifdef CONFIG_FTRACE
+bool trace_event_enabled();
+void trace_event(const char *name, char ph);
+#else
+static inline bool trace_event_enabled() { return false; }
+static inline void trace_event(const char *name, char ph) {}
+#endif
+
+/* shadow call stack, so that a return is matched with its call without a lookup */
+typedef struct {
+    int func_index; // -1 if the callee is not a known function
+    vaddr_t ret_addr;
+} CallFrame;
+
+#define MAX_UNWIND_DEPTH 64
+
+static CallFrame *call_stack = NULL;
+static int depth = 0, call_stack_size = 0; // function stack depth
 
 /* assist function to handle file reading errors */
 void check_read(int n, size_t size, FILE *fp, const char *msg) {
@@ -107,6 +141,13 @@ void check_read(int n, size_t size, FILE *fp, const char *msg) {
   }
 }
 
+/* order by address, and the largest one of the functions at the same address comes last */
+static int symbol_cmp(const void *a, const void *b) {
+  const Symbol *x = a, *y = b;
+  if (x->addr != y->addr) return (x->addr < y->addr ? -1 : 1);
+  return (x->size < y->size ? -1 : (x->size > y->size));
+}
+
 /* parse ELF file and extract function symbols */
 void parse_elf(const char *elf_file) {
   if (elf_file == NULL) {
@@ -136,31 +177,25 @@ void parse_elf(const char *elf_file) {
         return;
   }
 
+  char *string_table = NULL;
+  Elf32_Sym *symbol_table = NULL;
+
   // read section headers
   fseek(fp, elf_header.e_shoff, SEEK_SET); // move offset pointer to the beginning
   Elf32_Shdr *section_headers = malloc(sizeof(Elf32_Shdr) * elf_header.e_shnum); // section struct * num of section
   check_read(fread(section_headers, sizeof(Elf32_Shdr), elf_header.e_shnum, fp), 
               elf_header.e_shnum, fp, "Fail to read section headers");
 
-  // get the string table 
-  char *string_table = NULL;
-  for (int i = 0; i < elf_header.e_shnum; i++) {
-    if (section_headers[i].sh_type == SHT_STRTAB) {
-      // find string table
-      string_table = malloc(section_headers[i].sh_size);
-      fseek(fp, section_headers[i].sh_offset, SEEK_SET); // move offset pointer to the begin of string table
-      check_read(fread(string_table, section_headers[i].sh_size, 1, fp), // fread it to string_table
-                  1, fp, "Fail to read string table");
-      break;
-    }
-  }
-
-  // get the symbol table
-  fseek(fp, elf_header.e_shoff, SEEK_SET);
-  Elf32_Sym *symbol_table = NULL;
+  // get the symbol table, and the string table linked to it
   for (int i = 0; i < elf_header.e_shnum; i++) {
     if (section_headers[i].sh_type == SHT_SYMTAB) {
       // find symbol table
+      Elf32_Shdr *strtab = &section_headers[section_headers[i].sh_link];
+      string_table = malloc(strtab->sh_size);
+      fseek(fp, strtab->sh_offset, SEEK_SET); // move offset pointer to the begin of string table
+      check_read(fread(string_table, strtab->sh_size, 1, fp), // fread it to string_table
+                  1, fp, "Fail to read string table");
+
       fseek(fp, section_headers[i].sh_offset, SEEK_SET); // move offset pointer to the begin of symbol table
       size_t symbol_count = section_headers[i].sh_size / section_headers[i].sh_entsize; // size of symbol table / size of single symbol
       symbol_table = malloc(sizeof(Elf32_Sym) * symbol_count);  // allocate for symbol table
@@ -172,10 +207,10 @@ void parse_elf(const char *elf_file) {
       for (size_t j = 0; j < symbol_count; j++) {
         if (ELF32_ST_TYPE(symbol_table[j].st_info) == STT_FUNC) {
           // symbol type is FUNC
-          const char *name = string_table + symbol_table[j].st_name; // func name = string_table + st_name(offset/index) 
-          strncpy(symbol[func_num].name, name, sizeof(symbol[func_num].name) - 1); // copy func name to symbol.name
+          symbol[func_num].name = strdup(string_table + symbol_table[j].st_name); // func name = string_table + st_name(offset/index) 
           symbol[func_num].addr = symbol_table[j].st_value; // get func initial addr
           symbol[func_num].size = symbol_table[j].st_size;  // get func size
+          if (symbol[func_num].size > func_size_max) func_size_max = symbol[func_num].size;
           func_num++;
         }
       }
@@ -183,6 +218,9 @@ void parse_elf(const char *elf_file) {
     }
   }
 
+  // sort the functions for binary search in find_func()
+  qsort(symbol, func_num, sizeof(Symbol), symbol_cmp);
+
   // close the file and clean up
   fclose(fp);
   free(section_headers);
@@ -192,38 +230,65 @@ void parse_elf(const char *elf_file) {
 
 
 int find_func(vaddr_t addr) {
-  for(int i = 0; i < func_num; i++) {
-      if(addr >= symbol[i].addr && addr < (symbol[i].addr + symbol[i].size)) {
-          return i;
-      }
+  // find the last function starting at or before addr
+  int lo = 0, hi = func_num;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (symbol[mid].addr <= addr) lo = mid + 1;
+    else hi = mid;
+  }
+  // it may be past the end of a smaller symbol nested in the enclosing function
+  for (int i = lo - 1; i >= 0 && addr - symbol[i].addr < func_size_max; i --) {
+    if (addr < symbol[i].addr + symbol[i].size) return i;
   }
   return -1; // unfind
 }
 
 void print_trace(vaddr_t addr_curr, int func_index, const char* type) {
   printf("0x%08x:", addr_curr);
-  for(int k = 0; k < depth; k++) printf("  ");
+  for(int k = 0; k <= depth; k++) printf("  ");
   printf("%s  [%s@0x%08x]\n", type, symbol[func_index].name, symbol[func_index].addr);
 }
 
 void func_call_trace(vaddr_t addr_curr, vaddr_t addr_func) {
-  int func_index = find_func(addr_func);
-  if (func_index == -1) {
-    return;
-  } 
+  if (depth == call_stack_size) {
+    call_stack_size = (call_stack_size == 0 ? 1024 : call_stack_size * 2);
+    call_stack = realloc(call_stack, sizeof(CallFrame) * call_stack_size);
+  }
 
-  print_trace(addr_curr, func_index, "call");
+  // every call is pushed, so that the return of an unknown function does not pop its caller
+  int func_index = find_func(addr_func);
+  if (func_index != -1) {
+    if (trace_event_enabled()) trace_event(symbol[func_index].name, 'B');
+    else print_trace(addr_curr, func_index, "call");
+  }
+  call_stack[depth].func_index = func_index;
+  call_stack[depth].ret_addr = addr_curr + 4;
   depth++; // add depth after printing, make sure call and ret of sigle function keep in same level
 }
 
-void func_ret_trace(vaddr_t addr_curr) {
-  int func_index = find_func(addr_curr);
-  if (func_index == -1) {
+void func_ret_trace(vaddr_t addr_curr, vaddr_t addr_ret) {
+  // unwind to the call returning to addr_ret, which also drops the frames left by longjmp,
+  // but do not search too deep for a return without a call (e.g. switching the context)
+  int i = depth - 1, bottom = (depth > MAX_UNWIND_DEPTH ? depth - MAX_UNWIND_DEPTH : 0);
+  while (i >= bottom && call_stack[i].ret_addr != addr_ret) i--;
+  if (i < bottom) {
+    return; // not returning from a traced call
+  }
+
+  if (trace_event_enabled()) {
+    // also end the functions whose frames are dropped, to keep the timeline nested
+    for (int k = depth - 1; k >= i; k--) {
+      if (call_stack[k].func_index != -1) trace_event(symbol[call_stack[k].func_index].name, 'E');
+    }
+    depth = i;
     return;
   }
 
-  depth--; // sub depth before ret printing 
-  print_trace(addr_curr, func_index, "ret");
+  depth = i; // sub depth before ret printing 
+  if (call_stack[i].func_index != -1) {
+    print_trace(addr_curr, call_stack[i].func_index, "ret");
+  }
 }
 
 void exception_trace() {
@@ -233,3 +298,136 @@ void exception_trace() {
   printf("csr[mepc] = 0x%x\n", cpu.csr[mepc]);
   printf("csr[mcause] = 0x%x\n", cpu.csr[mcause]);
 }
+
+#ifdef CONFIG_PROFILE
+/* Sampling profiler. The pc is sampled every profile_interval instructions,
+*  and each sample is weighted by the instructions executed since the last
+*  one, since a chain of blocks may run past the sampling point. A sample is
+*  attributed to the function containing the pc, and to the functions on the
+*  shadow call stack, which is only maintained with CONFIG_FTRACE.
+*/
+#define PROFILE_TOP_N 10
+#define PROFILE_MAX_FRAMES 64
+
+extern uint64_t g_nr_guest_inst;
+
+typedef struct {
+  char *stack; // collapsed stack of function names separated by ';'
+  uint64_t hash, count;
+} StackSample;
+
+uint64_t profile_next = UINT64_MAX; // checked by cpu_exec()
+static uint64_t profile_interval = 0, profile_last = 0, profile_total = 0;
+static const char *profile_file = NULL;
+static uint64_t *profile_flat = NULL; // samples of each function, and the unknown ones at [func_num]
+static StackSample *profile_stacks = NULL;
+static int profile_stacks_size = 0, profile_stacks_nr = 0;
+
+static uint64_t hash_str(const char *s) {
+  uint64_t h = 0xcbf29ce484222325ull; // FNV-1a
+  for (; *s; s ++) h = (h ^ (uint8_t)*s) * 0x100000001b3ull;
+  return h;
+}
+
+static StackSample *stack_slot(StackSample *table, int size, const char *stack, uint64_t hash) {
+  int i = hash & (size - 1);
+  while (table[i].stack != NULL && (table[i].hash != hash || strcmp(table[i].stack, stack) != 0)) {
+    i = (i + 1) & (size - 1);
+  }
+  return &table[i];
+}
+
+static void profile_add_stack(const char *stack, uint64_t count) {
+  if (2 * (profile_stacks_nr + 1) > profile_stacks_size) {
+    int size = (profile_stacks_size == 0 ? 1024 : profile_stacks_size * 2);
+    StackSample *table = calloc(size, sizeof(StackSample));
+    for (int i = 0; i < profile_stacks_size; i ++) {
+      StackSample *e = &profile_stacks[i];
+      if (e->stack != NULL) *stack_slot(table, size, e->stack, e->hash) = *e;
+    }
+    free(profile_stacks);
+    profile_stacks = table;
+    profile_stacks_size = size;
+  }
+  uint64_t hash = hash_str(stack);
+  StackSample *e = stack_slot(profile_stacks, profile_stacks_size, stack, hash);
+  if (e->stack == NULL) {
+    e->stack = strdup(stack);
+    e->hash = hash;
+    profile_stacks_nr ++;
+  }
+  e->count += count;
+}
+
+static char *append_frame(char *p, char *end, int func_index, const char *sep) {
+  const char *name = (func_index == -1 ? "[unknown]" : symbol[func_index].name);
+  int n = snprintf(p, end - p, "%s%s", sep, name);
+  return (n < end - p ? p + n : end - 1);
+}
+
+void profile_sample(vaddr_t pc) {
+  uint64_t count = g_nr_guest_inst - profile_last;
+  profile_last = g_nr_guest_inst;
+  profile_next = g_nr_guest_inst + profile_interval;
+  profile_total += count;
+
+  int leaf = find_func(pc);
+  profile_flat[leaf == -1 ? func_num : leaf] += count;
+
+  char stack[4096], *p = stack, *end = stack + sizeof(stack);
+  const char *sep = "";
+  int bottom = (depth > PROFILE_MAX_FRAMES ? depth - PROFILE_MAX_FRAMES : 0);
+  if (bottom > 0) { p += snprintf(p, end - p, "[truncated]"); sep = ";"; }
+  for (int i = bottom; i < depth; i ++, sep = ";") p = append_frame(p, end, call_stack[i].func_index, sep);
+  // the leaf is usually the callee of the top frame
+  if (depth == 0 || call_stack[depth - 1].func_index != leaf) p = append_frame(p, end, leaf, sep);
+  profile_add_stack(stack, count);
+}
+
+static int flat_cmp(const void *a, const void *b) {
+  uint64_t x = profile_flat[*(const int *)a], y = profile_flat[*(const int *)b];
+  return (x < y) - (x > y);
+}
+
+void profile_report() {
+  if (profile_interval == 0 || profile_total == 0) return;
+
+  FILE *fp = fopen(profile_file, "w");
+  if (fp != NULL) {
+    for (int i = 0; i < profile_stacks_size; i ++) {
+      StackSample *e = &profile_stacks[i];
+      if (e->stack != NULL) fprintf(fp, "%s %" PRIu64 "\n", e->stack, e->count);
+    }
+    fclose(fp);
+    Log("Collapsed stacks for flamegraph.pl are written to %s", profile_file);
+  }
+
+  int *order = malloc(sizeof(int) * (func_num + 1));
+  for (int i = 0; i <= func_num; i ++) order[i] = i;
+  qsort(order, func_num + 1, sizeof(int), flat_cmp);
+  Log("top functions by sampled instructions:");
+  for (int i = 0; i < PROFILE_TOP_N && i <= func_num && profile_flat[order[i]] > 0; i ++) {
+    uint64_t n = profile_flat[order[i]];
+    Log("%6.2f%% %12" PRIu64 "  %s", 100.0 * n / profile_total, n,
+        (order[i] == func_num ? "[unknown]" : symbol[order[i]].name));
+  }
+  free(order);
+}
+
+// g_nr_guest_inst has been set from `old`, by restoring a checkpoint
+void profile_rebase(uint64_t old) {
+  if (profile_interval == 0) return;
+  profile_last = g_nr_guest_inst - (old - profile_last);
+  profile_next = g_nr_guest_inst + (profile_next > old ? profile_next - old : 0);
+}
+
+void profile_init(uint64_t interval, const char *file) {
+  profile_interval = (interval > 0 ? interval : 1);
+  profile_file = file;
+  profile_flat = calloc(func_num + 1, sizeof(uint64_t));
+  profile_last = g_nr_guest_inst;
+  profile_next = g_nr_guest_inst + profile_interval;
+  Log("Profiling every %" PRIu64 " instructions%s", interval,
+      (func_num == 0 ? ", but no symbols are loaded with --elf" : ""));
+}
+#endif
@@ -0,0 +1,213 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+/* Turn the INSTPAT list of an ISA into a decision tree.
+ *
+ * usage: gen-decode-tree inst.c decode-tree.h
+ *
+ * The output defines INSTPAT_TREE(inst), a nested switch on the bit fields of
+ * the instruction which jumps straight to the label that INSTPAT() puts at the
+ * body of the first matching pattern. Patterns keep their first-match priority.
+ * Patterns that can never match are reported as errors, and patterns partially
+ * overlapping an earlier one are reported as warnings.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#define MAX_PAT 1024
+#define MAX_FIELD 8 // widest field in one switch
+
+typedef struct {
+  uint32_t key, mask;
+  int line;
+  char name[32];
+} Pattern;
+
+static Pattern pat[MAX_PAT];
+static int nr_pat = 0;
+static bool reached[MAX_PAT] = {};
+static const char *src = NULL;
+static FILE *out = NULL;
+
+static void parse_pattern(const char *str, int line) {
+  Pattern *p = &pat[nr_pat];
+  const char *s = str + 1;
+  int nbit = 0;
+  for (const char *c = s; *c != '"'; c ++) {
+    if (*c == '0' || *c == '1' || *c == '?') nbit ++;
+    else if (*c != ' ') {
+      fprintf(stderr, "%s:%d: error: invalid character '%c' in pattern string\n", src, line, *c);
+      exit(1);
+    }
+  }
+  if (nbit > 32) {
+    fprintf(stderr, "%s:%d: error: pattern longer than 32 bits\n", src, line);
+    exit(1);
+  }
+  p->key = p->mask = 0;
+  for (int bit = nbit - 1; *s != '"'; s ++) {
+    if (*s == ' ') continue;
+    if (*s != '?') {
+      p->mask |= 1u << bit;
+      p->key |= (uint32_t)(*s == '1') << bit;
+    }
+    bit --;
+  }
+
+  // the name is the next argument
+  s = strchr(s, ',') + 1;
+  while (isspace(*s)) s ++;
+  int len = 0;
+  while (s[len] != ',' && !isspace(s[len]) && len < sizeof(p->name) - 1) len ++;
+  memcpy(p->name, s, len);
+  p->name[len] = '\0';
+  p->line = line;
+  nr_pat ++;
+}
+
+static void load(const char *file) {
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) { perror(file); exit(1); }
+  char buf[1024];
+  for (int line = 1; fgets(buf, sizeof(buf), fp) != NULL; line ++) {
+    char *s = buf;
+    while (isspace(*s)) s ++;
+    if (strncmp(s, "INSTPAT(\"", 9) != 0) continue;
+    if (nr_pat == MAX_PAT) { fprintf(stderr, "%s: too many patterns\n", file); exit(1); }
+    parse_pattern(s + 8, line);
+  }
+  fclose(fp);
+}
+
+static void check_overlap() {
+  for (int j = 0; j < nr_pat; j ++) {
+    for (int i = 0; i < j; i ++) {
+      Pattern *a = &pat[i], *b = &pat[j];
+      if ((a->key ^ b->key) & a->mask & b->mask) continue; // disjoint
+      // a more specific pattern placed before a general one is the usual way to write it
+      if ((a->mask & b->mask) == b->mask) continue;
+      fprintf(stderr, "%s:%d: warning: pattern '%s' overlaps '%s' at line %d, which takes priority\n",
+          src, b->line, b->name, a->name, a->line);
+    }
+  }
+}
+
+static void indent(int depth) { fprintf(out, "%*s", depth * 2 + 2, ""); }
+
+static void gen(const int *cand, int n, uint32_t known, int depth) {
+  if (n == 0) {
+    indent(depth); fprintf(out, "goto *(__instpat_end); \\\n");
+    return;
+  }
+  const Pattern *first = &pat[cand[0]];
+  uint32_t need = first->mask & ~known;
+  if (need == 0) {
+    reached[cand[0]] = true;
+    indent(depth); fprintf(out, "goto concat(__instpat_, %d); /* %s */ \\\n", first->line, first->name);
+    return;
+  }
+
+  // switch on the widest run of bits the first candidate still needs
+  int lo = 0, width = 0;
+  for (int b = 0; b < 32; ) {
+    if (!(need >> b & 1)) { b ++; continue; }
+    int e = b;
+    while (e < 32 && (need >> e & 1)) e ++;
+    if (e - b > width) { lo = b; width = e - b; }
+    b = e;
+  }
+  if (width > MAX_FIELD) { lo += width - MAX_FIELD; width = MAX_FIELD; }
+  uint32_t fmask = ((1u << width) - 1) << lo;
+
+  // candidates left for each value of the field
+  int nval = 1 << width;
+  int (*sub)[MAX_PAT] = malloc(sizeof(*sub) * nval);
+  int *nsub = calloc(nval, sizeof(int));
+  int *group = malloc(sizeof(int) * nval);
+  for (int v = 0; v < nval; v ++) {
+    for (int k = 0; k < n; k ++) {
+      const Pattern *p = &pat[cand[k]];
+      if (((p->key ^ ((uint32_t)v << lo)) & p->mask & fmask) == 0) sub[v][nsub[v] ++] = cand[k];
+    }
+    group[v] = v;
+    for (int u = 0; u < v; u ++) {
+      if (group[u] == u && nsub[u] == nsub[v] && memcmp(sub[u], sub[v], sizeof(int) * nsub[v]) == 0) {
+        group[v] = u;
+        break;
+      }
+    }
+  }
+  // the largest group goes to default
+  int dflt = 0, dflt_size = 0;
+  for (int v = 0; v < nval; v ++) {
+    if (group[v] != v) continue;
+    int size = 0;
+    for (int u = v; u < nval; u ++) size += (group[u] == v);
+    if (size > dflt_size) { dflt = v; dflt_size = size; }
+  }
+
+  indent(depth); fprintf(out, "switch ((__inst >> %d) & 0x%x) { \\\n", lo, (1u << width) - 1);
+  for (int v = 0; v < nval; v ++) {
+    if (group[v] != v || v == dflt) continue;
+    indent(depth);
+    for (int u = v; u < nval; u ++) {
+      if (group[u] == v) fprintf(out, "case 0x%x: ", u);
+    }
+    fprintf(out, "\\\n");
+    gen(sub[v], nsub[v], known | fmask, depth + 1);
+  }
+  indent(depth); fprintf(out, "default: \\\n");
+  gen(sub[dflt], nsub[dflt], known | fmask, depth + 1);
+  indent(depth); fprintf(out, "} \\\n");
+  free(sub); free(nsub); free(group);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s inst.c decode-tree.h\n", argv[0]);
+    return 1;
+  }
+  src = argv[1];
+  load(src);
+  check_overlap();
+
+  out = fopen(argv[2], "w");
+  if (out == NULL) { perror(argv[2]); return 1; }
+  fprintf(out, "// Generated by gen-decode-tree from %s, do not edit.\n\n", src);
+  fprintf(out, "#ifndef __DECODE_TREE_H__\n#define __DECODE_TREE_H__\n\n");
+  fprintf(out, "#define INSTPAT_TREE(inst) do { \\\n  uint64_t __inst = (inst); \\\n");
+  int *cand = malloc(sizeof(int) * nr_pat);
+  for (int i = 0; i < nr_pat; i ++) cand[i] = i;
+  gen(cand, nr_pat, 0, 0);
+  fprintf(out, "} while (0)\n\n#endif\n");
+  fclose(out);
+
+  int ret = 0;
+  for (int i = 0; i < nr_pat; i ++) {
+    if (!reached[i]) {
+      fprintf(stderr, "%s:%d: error: pattern '%s' is never matched, earlier patterns cover it\n",
+          src, pat[i].line, pat[i].name);
+      ret = 1;
+    }
+  }
+  if (ret != 0) remove(argv[2]);
+  return ret;
+}
@@ -0,0 +1,156 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+
+/* Decode, filter and disassemble a binary instruction trace of NEMU.
+ *
+ * usage: nemu-trace [-n FROM:TO] [-p LO:HI] [-r] [-x] [-c] [-t TRIPLE] TRACE
+ *
+ *   -n FROM:TO  only show instructions numbered in [FROM, TO)
+ *   -p LO:HI    only show instructions with pc in [LO, HI)
+ *   -r          show register writes (if they are recorded)
+ *   -x          do not disassemble
+ *   -c          only count the instructions shown
+ *   -t TRIPLE   target of the disassembler, riscv32-pc-linux-gnu by default
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cpu/itrace.h>
+
+void init_disasm(const char *triple);
+void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
+
+static uint64_t inst_lo = 0, inst_hi = UINT64_MAX;
+static uint64_t pc_lo = 0, pc_hi = UINT64_MAX;
+static bool show_reg = false, show_disasm = true, count_only = false;
+static const char *triple = "riscv32-pc-linux-gnu";
+
+static const char *reg_name[] = {
+  "$0", "ra", "sp", "gp", "tp", "t0", "t1", "t2",
+  "s0", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+  "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7",
+  "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"
+};
+
+static void parse_range(const char *arg, uint64_t *lo, uint64_t *hi) {
+  char *end;
+  *lo = strtoull(arg, &end, 0);
+  if (*end == ':') *hi = (end[1] == '\0' ? UINT64_MAX : strtoull(end + 1, NULL, 0));
+  else *hi = *lo + 1;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-n FROM:TO] [-p LO:HI] [-r] [-x] [-c] [-t TRIPLE] TRACE\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int o;
+  while ((o = getopt(argc, argv, "n:p:rxct:")) != -1) {
+    switch (o) {
+      case 'n': parse_range(optarg, &inst_lo, &inst_hi); break;
+      case 'p': parse_range(optarg, &pc_lo, &pc_hi); break;
+      case 'r': show_reg = true; break;
+      case 'x': show_disasm = false; break;
+      case 'c': count_only = true; break;
+      case 't': triple = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (argc - optind != 1) usage(argv[0]);
+
+  int fd = open(argv[optind], O_RDONLY);
+  if (fd < 0) { perror(argv[optind]); return 1; }
+  struct stat st;
+  fstat(fd, &st);
+  const uint8_t *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (st.st_size < sizeof(ItraceHeader) || buf == MAP_FAILED) { fprintf(stderr, "bad trace\n"); return 1; }
+  const ItraceHeader *hdr = (const ItraceHeader *)buf;
+  if (memcmp(hdr->magic, ITRACE_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != ITRACE_VERSION ||
+      hdr->ilen > 8 || hdr->nr_gpr > 32) {
+    fprintf(stderr, "%s is not an instruction trace of this version\n", argv[optind]);
+    return 1;
+  }
+  if (show_disasm && !count_only) init_disasm(triple);
+
+  uint64_t gpr[32] = {};
+  // the file is longer than the trace if NEMU has aborted
+  const uint8_t *p = buf + sizeof(ItraceHeader), *end = buf + (hdr->end < st.st_size ? hdr->end : st.st_size);
+  memcpy(gpr, p, sizeof(uint64_t) * hdr->nr_gpr);
+  p += sizeof(uint64_t) * hdr->nr_gpr;
+  uint64_t inst_no = hdr->start_inst, pc = hdr->start_pc - hdr->ilen, nr_shown = 0;
+  int ilen = hdr->ilen;
+
+  while (p < end) {
+    uint8_t tag = *p ++;
+    uint64_t v;
+    if (tag & ITRACE_TAG_SKIP) {
+      if ((p = itrace_get_varint(p, end, &v)) == NULL) break;
+      inst_no += v;
+    }
+    uint64_t next = pc + ilen;
+    if (tag & ITRACE_TAG_JUMP) {
+      if ((p = itrace_get_varint(p, end, &v)) == NULL) break;
+      next += itrace_unzigzag(v);
+    }
+    pc = (hdr->ilen == 4 ? (uint32_t)next : next);
+    if (p + ilen > end) break;
+    uint8_t inst[8];
+    memcpy(inst, p, ilen);
+    p += ilen;
+
+    char regbuf[256] = "";
+    int len = 0;
+    for (int i = 0; i < ITRACE_TAG_NR_REG(tag); i ++) {
+      if (p >= end) goto truncated;
+      int r = *p ++;
+      if ((p = itrace_get_varint(p, end, &v)) == NULL || r >= 32) goto truncated;
+      gpr[r] += itrace_unzigzag(v);
+      if (ilen == 4) gpr[r] = (uint32_t)gpr[r];
+      if (show_reg && len < sizeof(regbuf) - 32) {
+        len += snprintf(regbuf + len, sizeof(regbuf) - len, " %s = 0x%" PRIx64, reg_name[r], gpr[r]);
+      }
+    }
+
+    if (inst_no >= inst_lo && inst_no < inst_hi && pc >= pc_lo && pc < pc_hi) {
+      nr_shown ++;
+      if (!count_only) {
+        char asmbuf[128] = "";
+        if (show_disasm) disassemble(asmbuf, sizeof(asmbuf), pc, inst, ilen);
+        printf("%10" PRIu64 " 0x%08" PRIx64 ":", inst_no, pc);
+        for (int i = ilen - 1; i >= 0; i --) printf(" %02x", inst[i]);
+        printf("%s%s%s%s\n", (show_disasm ? "   " : ""), asmbuf, (len ? "   #" : ""), regbuf);
+      }
+    }
+    inst_no ++;
+    if (inst_no >= inst_hi) break;
+  }
+  if (p < end && inst_no < inst_hi) {
+truncated:
+    fprintf(stderr, "the trace is truncated at instruction %" PRIu64 "\n", inst_no);
+  }
+  if (count_only) printf("%" PRIu64 "\n", nr_shown);
+  return 0;
+}
@@ -0,0 +1,278 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+
+/* Pick simulation points from basic block vectors, in the way of SimPoint.
+ *
+ * usage: simpoint [-k MAXK] [-d DIM] [-s SEED] BBV_FILE PREFIX
+ *
+ * Every interval in BBV_FILE (written by NEMU with --bbv=N,FILE) is normalized
+ * and randomly projected to DIM dimensions. The intervals are clustered by
+ * k-means for k = 1 .. MAXK, and the smallest k whose BIC score reaches 90%
+ * of the best is chosen. The interval closest to the centroid of each cluster
+ * represents it, and the weight of a cluster is its share of the intervals.
+ * The results are written to PREFIX.simpoints and PREFIX.weights in the
+ * format of SimPoint, and NEMU takes their checkpoints with --simpoint=N,PREFIX.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <math.h>
+#include <getopt.h>
+
+#define NR_TRIAL 5
+#define MAX_ITER 100
+#define BIC_THRESHOLD 0.9
+
+static int max_k = 10, dim = 15;
+static uint64_t seed = 1;
+
+static double *vec = NULL; // projected intervals, nr_interval * dim
+static int nr_interval = 0;
+
+static uint64_t splitmix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+// uniform in [0, 1)
+static double random_unit(uint64_t *state) {
+  *state = splitmix64(*state);
+  return (*state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// the projection matrix is generated on demand, since block ids are sparse
+static double proj(uint64_t id, int d) {
+  uint64_t x = splitmix64(seed ^ (id * dim + d));
+  return (x >> 11) * (2.0 / 9007199254740992.0) - 1.0;
+}
+
+static bool parse_line(char *line, double *v) {
+  // two passes: the total count first, then the normalized projection
+  double total = 0;
+  for (int pass = 0; pass < 2; pass ++) {
+    char *p = line + 1;
+    uint64_t id, count;
+    int n;
+    while (sscanf(p, " :%" SCNu64 ":%" SCNu64 "%n", &id, &count, &n) == 2) {
+      p += n;
+      if (pass == 0) total += count;
+      else for (int d = 0; d < dim; d ++) v[d] += count / total * proj(id, d);
+    }
+    if (total == 0) return false;
+  }
+  return true;
+}
+
+static void load_bbv(const char *file) {
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) { perror(file); exit(1); }
+  char *line = NULL;
+  size_t len = 0;
+  int cap = 0;
+  while (getline(&line, &len, fp) != -1) {
+    if (line[0] != 'T') continue;
+    if (nr_interval == cap) {
+      cap = (cap == 0 ? 1024 : cap * 2);
+      vec = realloc(vec, sizeof(double) * cap * dim);
+      assert(vec);
+    }
+    double *v = vec + nr_interval * dim;
+    memset(v, 0, sizeof(double) * dim);
+    if (parse_line(line, v)) nr_interval ++;
+  }
+  free(line);
+  fclose(fp);
+}
+
+static double dist2(const double *a, const double *b) {
+  double s = 0;
+  for (int d = 0; d < dim; d ++) s += (a[d] - b[d]) * (a[d] - b[d]);
+  return s;
+}
+
+static int nearest(const double *v, const double *center, int k) {
+  int best = 0;
+  double best_d = dist2(v, center);
+  for (int c = 1; c < k; c ++) {
+    double dd = dist2(v, center + c * dim);
+    if (dd < best_d) { best_d = dd; best = c; }
+  }
+  return best;
+}
+
+// k-means++ seeding followed by Lloyd iterations, return the distortion
+static double kmeans(int k, uint64_t *rng, double *center, int *label) {
+  double *d2 = malloc(sizeof(double) * nr_interval);
+  int *size = malloc(sizeof(int) * k);
+  assert(d2 && size);
+
+  memcpy(center, vec + (int)(random_unit(rng) * nr_interval) * dim, sizeof(double) * dim);
+  for (int c = 1; c < k; c ++) {
+    double sum = 0;
+    for (int i = 0; i < nr_interval; i ++) {
+      d2[i] = dist2(vec + i * dim, center + nearest(vec + i * dim, center, c) * dim);
+      sum += d2[i];
+    }
+    double r = random_unit(rng) * sum;
+    int i = 0;
+    for (; i < nr_interval - 1 && (r -= d2[i]) > 0; i ++);
+    memcpy(center + c * dim, vec + i * dim, sizeof(double) * dim);
+  }
+
+  for (int i = 0; i < nr_interval; i ++) label[i] = -1;
+  for (int iter = 0; iter < MAX_ITER; iter ++) {
+    bool changed = false;
+    for (int i = 0; i < nr_interval; i ++) {
+      int c = nearest(vec + i * dim, center, k);
+      if (c != label[i]) { label[i] = c; changed = true; }
+    }
+    if (!changed) break;
+    memset(center, 0, sizeof(double) * k * dim);
+    memset(size, 0, sizeof(int) * k);
+    for (int i = 0; i < nr_interval; i ++) {
+      size[label[i]] ++;
+      for (int d = 0; d < dim; d ++) center[label[i] * dim + d] += vec[i * dim + d];
+    }
+    for (int c = 0; c < k; c ++) {
+      // an empty cluster takes over a random interval
+      if (size[c] == 0) memcpy(center + c * dim, vec + (int)(random_unit(rng) * nr_interval) * dim, sizeof(double) * dim);
+      else for (int d = 0; d < dim; d ++) center[c * dim + d] /= size[c];
+    }
+  }
+
+  double distortion = 0;
+  for (int i = 0; i < nr_interval; i ++) distortion += dist2(vec + i * dim, center + label[i] * dim);
+  free(d2);
+  free(size);
+  return distortion;
+}
+
+// Bayesian information criterion of a spherical Gaussian mixture, as in X-means
+static double bic(int k, const int *label, double distortion) {
+  int R = nr_interval;
+  if (R <= k) return -INFINITY;
+  double var = distortion / (R - k);
+  if (var < 1e-12) var = 1e-12;
+  int *size = calloc(k, sizeof(int));
+  assert(size);
+  for (int i = 0; i < R; i ++) size[label[i]] ++;
+  double l = 0;
+  for (int c = 0; c < k; c ++) {
+    double n = size[c];
+    if (n == 0) continue;
+    l += n * log(n) - n * log(R) - n / 2 * log(2 * M_PI) - n * dim / 2 * log(var) - (n - k) / 2;
+  }
+  free(size);
+  double params = (k - 1) + (double)dim * k + 1;
+  return l - params / 2 * log(R);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-k MAXK] [-d DIM] [-s SEED] BBV_FILE PREFIX\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int o;
+  while ((o = getopt(argc, argv, "k:d:s:")) != -1) {
+    switch (o) {
+      case 'k': max_k = atoi(optarg); break;
+      case 'd': dim = atoi(optarg); break;
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2 || max_k < 1 || dim < 1) usage(argv[0]);
+  const char *prefix = argv[optind + 1];
+
+  load_bbv(argv[optind]);
+  if (nr_interval == 0) {
+    fprintf(stderr, "no interval is found in %s\n", argv[optind]);
+    return 1;
+  }
+  if (max_k > nr_interval) max_k = nr_interval;
+
+  double *center = malloc(sizeof(double) * max_k * max_k * dim);
+  double *trial_center = malloc(sizeof(double) * max_k * dim);
+  int *label = malloc(sizeof(int) * max_k * nr_interval);
+  int *trial_label = malloc(sizeof(int) * nr_interval);
+  double *score = malloc(sizeof(double) * max_k);
+  assert(center && trial_center && label && trial_label && score);
+
+  // the best of several seedings for every k
+  uint64_t rng = seed;
+  for (int k = 1; k <= max_k; k ++) {
+    double best = INFINITY;
+    for (int t = 0; t < NR_TRIAL; t ++) {
+      double distortion = kmeans(k, &rng, trial_center, trial_label);
+      if (distortion < best) {
+        best = distortion;
+        memcpy(center + (k - 1) * max_k * dim, trial_center, sizeof(double) * k * dim);
+        memcpy(label + (k - 1) * nr_interval, trial_label, sizeof(int) * nr_interval);
+      }
+    }
+    score[k - 1] = bic(k, label + (k - 1) * nr_interval, best);
+  }
+
+  double lo = INFINITY, hi = -INFINITY;
+  for (int k = 1; k <= max_k; k ++) {
+    if (isinf(score[k - 1])) continue;
+    if (score[k - 1] < lo) lo = score[k - 1];
+    if (score[k - 1] > hi) hi = score[k - 1];
+  }
+  int k = 1;
+  if (!isinf(hi)) {
+    while (k < max_k && !(score[k - 1] >= lo + BIC_THRESHOLD * (hi - lo))) k ++;
+  }
+  double *c = center + (k - 1) * max_k * dim;
+  int *l = label + (k - 1) * nr_interval;
+
+  char path[256];
+  snprintf(path, sizeof(path), "%s.simpoints", prefix);
+  FILE *sp = fopen(path, "w");
+  if (sp == NULL) { perror(path); return 1; }
+  snprintf(path, sizeof(path), "%s.weights", prefix);
+  FILE *wp = fopen(path, "w");
+  if (wp == NULL) { perror(path); return 1; }
+
+  int nr_point = 0;
+  for (int j = 0; j < k; j ++) {
+    int rep = -1, size = 0;
+    double best = INFINITY;
+    for (int i = 0; i < nr_interval; i ++) {
+      if (l[i] != j) continue;
+      size ++;
+      double dd = dist2(vec + i * dim, c + j * dim);
+      if (dd < best) { best = dd; rep = i; }
+    }
+    if (rep < 0) continue;
+    fprintf(sp, "%d %d\n", rep, nr_point);
+    fprintf(wp, "%f %d\n", (double)size / nr_interval, nr_point);
+    printf("simulation point %d: interval %d, weight %f\n", nr_point, rep, (double)size / nr_interval);
+    nr_point ++;
+  }
+  fclose(sp);
+  fclose(wp);
+  printf("%d intervals, %d clusters\n", nr_interval, nr_point);
+  return 0;
+}
@@ -14,16 +14,34 @@
 
 // difftest
 #define CONFIG_DIFFTEST 1
+#define CONFIG_DIFFTEST_BATCH 64 // instructions the REF runs at a time, bisected on a mismatch
+#define CONFIG_DIFFTEST_ASYNC 1  // run the REF on another thread, overlapped with the core
+#define CONFIG_DIFFTEST_SWEEP 4096 // instructions between comparisons of all the registers
+#define CONFIG_DIFFTEST_MEM 1 // compare the hashes of the pages written between sweeps
+
+// checkpoint
+#define CONFIG_CHECKPOINT 1
+
+// watchpoint, memory is only checked when written
+#define CONFIG_WATCHPOINT 1
+
+// gdb remote stub, enabled by --gdb=PORT
+#define CONFIG_GDBSTUB 1
 
 // tracer
 #define CONFIG_ITRACE 0
 #define CONFIG_ITRACE_START 0
 #define CONFIG_ITRACE_LIMIT 10000
 
+#define CONFIG_IQUEUE 1
+#define CONFIG_IQUEUE_SIZE 4096 // must be a power of 2
+
 #define CONFIG_MTRACE 0
 
 #define CONFIG_FTRACE 0
 
+#define CONFIG_PROFILE 1 // enabled by --profile=N,FILE
+
 #define CONFIG_DTRACE 0
 
 #define CONFIG_ETRACE 1
@@ -32,6 +50,7 @@
 #define CONFIG_DEVICE 1 
 #define CONFIG_DEVICE_BASE 0xa0000000
 #define CONFIG_MMIO_BASE   0xa0000000
+#define CONFIG_DEVICE_POLL_INTERVAL 4096
 
 #define CONFIG_HAS_SERIAL 1
 #define CONFIG_SERIAL_ADDR (CONFIG_DEVICE_BASE + 0x00003f8)
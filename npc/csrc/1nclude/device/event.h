@@ -0,0 +1,20 @@
+#ifndef __DEVICE_EVENT_H__
+#define __DEVICE_EVENT_H__
+
+#include "constant.h"
+
+// device events are scheduled in guest instructions rather than host time,
+// a handler returns the number of instructions until its next run, or 0 to stop
+typedef uint64_t (*event_handler_t) ();
+
+extern uint64_t guest_inst;
+extern uint64_t next_event;
+
+void add_event(event_handler_t h, uint64_t delay);
+void event_dispatch();
+
+static inline void event_update() {
+  if (unlikely(guest_inst >= next_event)) event_dispatch();
+}
+
+#endif // __DEVICE_EVENT_H__
@@ -6,5 +6,10 @@
 
 void difftest_init(char *ref_so_file, long img_size, int port);
 void difftest_skip_ref();
+void difftest_mmio_read(paddr_t addr, int len, word_t data);
+void difftest_mmio_write();
+void difftest_sync();
+void difftest_restore();
+void difftest_pmem_write(paddr_t addr, int len);
 
 #endif //__EMULATOR_DIFFTEST_H__
\ No newline at end of file
@@ -7,5 +7,6 @@ void reg_display();
 void reg_update();
 
 word_t reg_str2val(const char *s, bool *success);
+const word_t *reg_str2ptr(const char *s);
 
 #endif //__EMULATOR_REG_H__
@@ -14,5 +14,8 @@ static inline bool in_pmem(paddr_t addr) {
 
 word_t paddr_read(paddr_t addr, int len);
 void paddr_write(paddr_t addr, int len, word_t data);
+void paddr_watch(paddr_t addr, int len, bool watch);
+int pmem_dirty_pages(paddr_t **pages);
+void pmem_dirty_clear();
 
 #endif //__MEMORY_PADDR_H__
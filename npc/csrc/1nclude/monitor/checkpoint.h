@@ -0,0 +1,42 @@
+#ifndef __MONITOR_CHECKPOINT_H__
+#define __MONITOR_CHECKPOINT_H__
+
+#include "constant.h"
+
+// checkpoints are taken by nemu, the layout must match nemu/src/monitor/checkpoint.c
+#define CKPT_MAGIC "NEMUCKPT"
+#define CKPT_VERSION 2
+#define CKPT_NAME_LEN 32
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t cpu_size;
+  uint64_t nr_guest_inst;
+  uint64_t mbase, msize;
+  uint32_t nr_region, nr_run;
+  uint32_t nr_gpr, reserved;
+  uint64_t sample_len;
+  double weight;
+} CkptHeader;
+
+typedef struct {
+  char name[CKPT_NAME_LEN];
+  uint64_t size;
+  uint32_t first_run, nr_run;
+} CkptRegion;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t len;
+  uint64_t file_offset;
+} CkptRun;
+
+bool checkpoint_load(const char *path);
+uint64_t checkpoint_sample_len();
+
+// the registers are restored by a short program fed to the core through inst_fetch()
+extern bool ckpt_restoring;
+bool checkpoint_restorer_fetch(word_t *inst);
+
+#endif // __MONITOR_CHECKPOINT_H__
@@ -10,4 +10,17 @@ void sdb_mainloop();
 
 word_t expr(char *e, bool *success);
 
+typedef struct ExprCode ExprCode;
+ExprCode *expr_compile(char *e, bool *success);
+word_t expr_eval(const ExprCode *code);
+
+#define EXPR_NR_DEP 4
+typedef struct {
+  int nr_reg, nr_mem;
+  const word_t *reg[EXPR_NR_DEP];
+  vaddr_t mem[EXPR_NR_DEP]; // address of each 4-byte load
+  bool polled;              // must be evaluated after every instruction
+} ExprDeps;
+void expr_deps(const ExprCode *code, ExprDeps *deps);
+
 #endif //__MONITOR_SDB_H
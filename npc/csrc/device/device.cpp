@@ -1,6 +1,7 @@
 #include "constant.h"
 #include "utils.h"
 #include "device/alarm.h"
+#include "device/event.h"
 #include <SDL2/SDL.h>
 
 void map_init();
@@ -11,11 +12,12 @@ void vga_init();
 
 void vga_update_screen();
 
-void device_update() {
+// polled every CONFIG_DEVICE_POLL_INTERVAL instructions instead of every cycle
+static uint64_t device_update() {
   static uint64_t last = 0;
   uint64_t now = get_time();
   if (now - last < 1000000 / TIMER_HZ) {
-    return;
+    return CONFIG_DEVICE_POLL_INTERVAL;
   }
   last = now;
 
@@ -40,6 +42,7 @@ void device_update() {
       default: break;
     }
   }
+  return CONFIG_DEVICE_POLL_INTERVAL;
 }
 
 void sdl_clear_event_queue() {
@@ -55,4 +58,5 @@ void device_init() {
   IFONE(CONFIG_HAS_VGA, vga_init());
 
   alarm_init();
+  add_event(device_update, CONFIG_DEVICE_POLL_INTERVAL);
 }
@@ -0,0 +1,40 @@
+#include "device/event.h"
+
+#define MAX_EVENT 8
+
+typedef struct {
+  event_handler_t handler;
+  uint64_t deadline;
+} Event;
+
+static Event event[MAX_EVENT] = {};
+static int nr_event = 0;
+uint64_t next_event = UINT64_MAX;
+
+static void event_rearm() {
+  next_event = UINT64_MAX;
+  for (int i = 0; i < nr_event; i ++) {
+    if (event[i].deadline < next_event) next_event = event[i].deadline;
+  }
+}
+
+void add_event(event_handler_t h, uint64_t delay) {
+  assert(nr_event < MAX_EVENT);
+  event[nr_event ++] = { h, guest_inst + delay };
+  event_rearm();
+}
+
+void event_dispatch() {
+  int i = 0;
+  while (i < nr_event) {
+    if (event[i].deadline > guest_inst) { i ++; continue; }
+    uint64_t delay = event[i].handler();
+    if (delay == 0) {
+      event[i] = event[-- nr_event];
+      continue;
+    }
+    event[i].deadline = guest_inst + delay;
+    i ++;
+  }
+  event_rearm();
+}
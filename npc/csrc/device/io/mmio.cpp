@@ -8,9 +8,58 @@ extern bool in_pmem(paddr_t addr);
 static IOMap maps[NR_MAP] = {};
 static int nr_map = 0;
 
+// the page hash of mmio.c in NEMU. The registers of all the devices share the
+// page at CONFIG_DEVICE_BASE, and the frame buffer owns up to 470 pages
+#define MMIO_PAGE_SHIFT 12
+#define MMIO_PAGE_SIZE (1 << MMIO_PAGE_SHIFT)
+#define MMIO_HASH_SIZE 1024 // must be a power of 2, and twice the pages at least
+
+typedef struct {
+  paddr_t page;
+  uint8_t id;    // map index + 1, 0 for an empty slot
+  uint8_t *sub;  // map index + 1 of each byte, only for shared pages
+} MMIOPage;
+
+static MMIOPage mmio_page[MMIO_HASH_SIZE] = {};
+static int nr_mmio_page = 0;
+
+static inline MMIOPage* mmio_page_probe(paddr_t page) {
+  uint32_t h = (page * 0x9e3779b1u) & (MMIO_HASH_SIZE - 1);
+  while (mmio_page[h].id != 0 && mmio_page[h].page != page) {
+    h = (h + 1) & (MMIO_HASH_SIZE - 1);
+  }
+  return &mmio_page[h];
+}
+
+static void mmio_page_add(paddr_t page, int mapid) {
+  MMIOPage *p = mmio_page_probe(page);
+  if (p->id == 0) {
+    assert(nr_mmio_page < MMIO_HASH_SIZE / 2);
+    nr_mmio_page ++;
+    *p = { page, (uint8_t)(mapid + 1), NULL };
+    return;
+  }
+  paddr_t base = page << MMIO_PAGE_SHIFT;
+  if (p->sub == NULL) {
+    // the page becomes shared, spread the previous owner over its bytes
+    p->sub = (uint8_t *) calloc(MMIO_PAGE_SIZE, 1);
+    assert(p->sub);
+    IOMap *old = &maps[p->id - 1];
+    for (int i = 0; i < MMIO_PAGE_SIZE; i ++) {
+      if (map_inside(old, base + i)) p->sub[i] = p->id;
+    }
+  }
+  for (int i = 0; i < MMIO_PAGE_SIZE; i ++) {
+    if (map_inside(&maps[mapid], base + i)) p->sub[i] = mapid + 1;
+  }
+}
+
 static IOMap* fetch_mmio_map(paddr_t addr) {
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  return (mapid == -1 ? NULL : &maps[mapid]);
+  MMIOPage *p = mmio_page_probe(addr >> MMIO_PAGE_SHIFT);
+  if (p->id == 0) return NULL;
+  int id = (p->sub == NULL ? p->id : p->sub[addr & (MMIO_PAGE_SIZE - 1)]);
+  if (id == 0 || !map_inside(&maps[id - 1], addr)) return NULL;
+  return &maps[id - 1];
 }
 
 static void report_mmio_overlap(const char *name1, paddr_t l1, paddr_t r1,
@@ -37,6 +86,9 @@ void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_
   Log("Add mmio map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
       maps[nr_map].name, maps[nr_map].low, maps[nr_map].high);
 
+  for (paddr_t page = left >> MMIO_PAGE_SHIFT; page <= right >> MMIO_PAGE_SHIFT; page ++) {
+    mmio_page_add(page, nr_map);
+  }
   nr_map ++;
 }
 
@@ -1,21 +1,151 @@
 #include "emulator/difftest.h"
+#include <atomic>
+#include <thread>
+#include <vector>
 
 void (*ref_difftest_memcpy)(paddr_t addr, void *buf, size_t n, bool direction) = NULL;
 void (*ref_difftest_regcpy)(void *dut, bool direction) = NULL;
 void (*ref_difftest_exec)(uint64_t n) = NULL;
 void (*ref_difftest_raise_intr)(uint64_t NO) = NULL;
+bool (*ref_difftest_snapshot)(bool restore) = NULL;
+
+/* An instruction committed by the core, compared by difftest_step_and_compare()
+*  of the REF with the one it runs, see difftest-def.h of NEMU.
+*/
+typedef struct {
+  uint64_t pc;
+  uint64_t wdata; // the value written to gpr[rd]
+  uint32_t rd;    // 0 if no gpr is written
+} DifftestCommit;
+int (*ref_difftest_step_and_compare)(const DifftestCommit *dut, int n, DifftestCommit *ref) = NULL;
+
+/* A page of pmem written by the core since the last sweep, with its hash,
+*  compared by difftest_pmem_compare() of the REF. The hash must be the same
+*  as difftest_page_hash() in difftest-def.h of NEMU.
+*/
+typedef struct {
+  uint64_t addr;
+  uint64_t hash;
+} DifftestPage;
+bool (*ref_difftest_pmem_compare)(const DifftestPage *dut, int n, uint64_t *addr) = NULL;
+void (*ref_difftest_mmio_load)(uint64_t addr, int len, uint64_t data) = NULL;
+
+static uint64_t page_hash(const void *page) {
+  const uint64_t *p = (const uint64_t *)page;
+  uint64_t a0 = 0, a1 = 0, a2 = 0, a3 = 0, b0 = 0, b1 = 0, b2 = 0, b3 = 0;
+  for (int i = 0; i < 4096 / 8; i += 4) {
+    a0 += p[i];     b0 += a0;
+    a1 += p[i + 1]; b1 += a1;
+    a2 += p[i + 2]; b2 += a2;
+    a3 += p[i + 3]; b3 += a3;
+  }
+  uint64_t lane[8] = { a0, b0, a1, b1, a2, b2, a3, b3 }, h = 0;
+  for (int i = 0; i < 8; i++) {
+    h = (h ^ lane[i]) * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 29;
+  }
+  return h;
+}
 
 void assert_fail_msg();
 
 static bool is_skip_ref = false;
+static bool is_mmio_load = false;
+static paddr_t mmio_addr;
+static int mmio_len;
+static word_t mmio_data;
 enum { DIFFTEST_TO_DUT, DIFFTEST_TO_REF };
 CORE_state ref;
 
+/* The REF runs a batch of instructions at a time, and is compared with the
+*  core at the end only. The state of the core after each instruction of the
+*  batch is kept, so that on a mismatch the REF can be rewound to a snapshot
+*  taken at the start of the batch, and bisected to the first diverging one.
+*  If the REF exports difftest_step_and_compare(), only the pc and the gpr
+*  written by each instruction are kept instead, and compared by the REF one
+*  by one, so that the first mismatch is found without rewinding. The state is
+*  then only kept every CONFIG_DIFFTEST_SWEEP instructions, to compare all the
+*  registers. The memory written since the last sweep is compared at a sweep
+*  as well. A value loaded from a device is kept with the instruction, and
+*  passed to the REF before it runs the batch.
+*  Commits are queued in a ring. With CONFIG_DIFFTEST_ASYNC on a multi-core
+*  host, a checker thread runs the REF over them while the core goes on,
+*  otherwise they are checked by the core once a batch is full.
+*/
+typedef struct {
+  vaddr_t pc;
+  bool skip;        // not run by the REF, whose registers are set to state instead
+  bool sweep;       // all the registers are compared with state
+  bool mmio;        // loads mmio_data from a device
+  int mmio_len;
+  paddr_t mmio_addr;
+  word_t mmio_data;
+  CORE_state state; // after the instruction at pc
+} CommitRecord;
+
+#define COMMIT_RING_SIZE 4096 // must be a power of 2 and no less than CONFIG_DIFFTEST_BATCH
+static_assert(COMMIT_RING_SIZE >= CONFIG_DIFFTEST_BATCH, "COMMIT_RING_SIZE must be no less than CONFIG_DIFFTEST_BATCH");
+#define commit_at(i) commit[(i) & (COMMIT_RING_SIZE - 1)]
+#define dirty_at(i) dirty[(i) & (COMMIT_RING_SIZE - 1)]
+static CommitRecord commit[COMMIT_RING_SIZE];
+static DifftestCommit dirty[COMMIT_RING_SIZE];
+static int nr_unswept = 0;
+static vaddr_t last_pc; // of the last commit checked
+// head is only written by the core, and tail by the checker
+static std::atomic<uint32_t> commit_head(0), commit_tail(0);
+static int batch_size = CONFIG_DIFFTEST_BATCH;
+static bool async_check = false; // a single host cpu can not overlap them
+
+#if CONFIG_DIFFTEST_MEM
+/* The pages written by the core before each sweep in the ring, hashed by the
+*  core at the sweep, as its memory goes on while the sweep waits to be checked.
+*/
+#define SWEEP_RING_SIZE (COMMIT_RING_SIZE / CONFIG_DIFFTEST_SWEEP + 2)
+static std::vector<DifftestPage> sweep_pages[SWEEP_RING_SIZE];
+static uint32_t sweep_head = 0, sweep_tail = 0; // only used by the core and the checker respectively
+#endif
+
+// the first mismatch found by the checker, which stops there, reported by the core
+enum {
+  MISMATCH_BATCH,  // of the registers at the end of a batch, bisected
+  MISMATCH_COMMIT, // found by difftest_step_and_compare(), with the commit of the REF
+  MISMATCH_SWEEP,  // of the registers at a sweep
+  MISMATCH_MEM,    // of the memory at a sweep, in the page at mismatch_page
+};
+static std::atomic<bool> mismatch(false);
+static uint32_t mismatch_pos;
+static int mismatch_first, mismatch_batch; // mismatch_first is -1 if the REF can not be rewound
+static int mismatch_kind;
+static DifftestCommit mismatch_ref;
+static uint64_t mismatch_page;
+static bool mismatch_reported = false;
+
 void difftest_skip_ref() {
   is_skip_ref = true;
 }
 
-static void checkregs(CORE_state *ref, vaddr_t pc) {
+/* The REF has no device, and loads the value the core has loaded instead of
+*  having its registers overwritten. Loads done by sdb while the core is
+*  stopped are not run by the REF.
+*/
+void difftest_mmio_read(paddr_t addr, int len, word_t data) {
+  if (sim_state.state != SIM_RUNNING) return;
+  if (ref_difftest_mmio_load == NULL) { difftest_skip_ref(); return; }
+  is_mmio_load = true;
+  mmio_addr = addr;
+  mmio_len = len;
+  mmio_data = data;
+}
+
+// a REF taking the values loaded from devices drops the stores to them
+void difftest_mmio_write() {
+  if (sim_state.state != SIM_RUNNING) return;
+  // mem_write() reads the word it writes a part of, which is not a load
+  is_mmio_load = false;
+  if (ref_difftest_mmio_load == NULL) difftest_skip_ref();
+}
+
+static bool checkregs(CORE_state *ref, vaddr_t pc) {
   
   for (int i = 0; i < ARRLEN(core.gpr); i++) {
     if (core.gpr[i] != ref->gpr[i]) {
@@ -26,7 +156,7 @@ static void checkregs(CORE_state *ref, vaddr_t pc) {
       sim_state.state = SIM_ABORT;
       sim_state.halt_pc = core.pc;
       assert_fail_msg();
-      return;
+      return false;
     }
   }
 
@@ -39,27 +169,276 @@ static void checkregs(CORE_state *ref, vaddr_t pc) {
       sim_state.state = SIM_ABORT;
       sim_state.halt_pc = core.pc;
       assert_fail_msg();
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool regs_equal(const CORE_state *a, const CORE_state *b) {
+  return memcmp(a->gpr, b->gpr, sizeof(a->gpr)) == 0 && memcmp(a->csr, b->csr, sizeof(a->csr)) == 0;
+}
+
+// run the REF from the snapshot to the end of the i-th commit from start
+static bool ref_replay(uint32_t start, int i, CORE_state *ref_r) {
+  if (!ref_difftest_snapshot(true)) return false;
+  ref_difftest_exec(i + 1);
+  ref_difftest_regcpy(ref_r, DIFFTEST_TO_DUT);
+  return true;
+}
+
+/* the first of n commits from start after which the REF differs,
+*  or -1 if the REF can not be rewound
+*/
+static int bisect(uint32_t start, int n) {
+  CORE_state ref_r;
+  int lo = 0, hi = n - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (!ref_replay(start, mid, &ref_r)) return -1;
+    if (regs_equal(&ref_r, &commit_at(start + mid).state)) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+static void set_mismatch(uint32_t pos, int first, int n, int kind) {
+  mismatch_pos = pos;
+  mismatch_first = first;
+  mismatch_batch = n;
+  mismatch_kind = kind;
+  mismatch.store(true, std::memory_order_release);
+}
+
+// compare the memory written since the last sweep, at the sweep at pos
+static bool checkmem(uint32_t pos) {
+#if CONFIG_DIFFTEST_MEM
+  if (ref_difftest_pmem_compare == NULL) return true;
+  std::vector<DifftestPage> &pages = sweep_pages[sweep_tail++ % SWEEP_RING_SIZE];
+  if (ref_difftest_pmem_compare(pages.data(), pages.size(), &mismatch_page)) return true;
+  set_mismatch(pos, 0, 1, MISMATCH_MEM);
+  return false;
+#else
+  return true;
+#endif
+}
+
+// run the REF over n commits from start, returning false on a mismatch
+static bool check_batch(uint32_t start, int n) {
+  for (int i = 0; i < n; i++) {
+    CommitRecord *c = &commit_at(start + i);
+    if (c->mmio) ref_difftest_mmio_load(c->mmio_addr, c->mmio_len, c->mmio_data);
+  }
+  if (ref_difftest_step_and_compare != NULL) {
+    int i = ref_difftest_step_and_compare(&dirty_at(start), n, &mismatch_ref);
+    if (i < n) {
+      set_mismatch(start + i, i, n, MISMATCH_COMMIT);
+      return false;
+    }
+    CommitRecord *c = &commit_at(start + n - 1);
+    if (!c->sweep) return true;
+    ref_difftest_regcpy(&ref, DIFFTEST_TO_DUT);
+    if (regs_equal(&ref, &c->state)) return checkmem(start + n - 1);
+    set_mismatch(start + n - 1, n - 1, n, MISMATCH_SWEEP);
+    return false;
+  }
+
+  if (n > 1) ref_difftest_snapshot(false);
+  ref_difftest_exec(n);
+  ref_difftest_regcpy(&ref, DIFFTEST_TO_DUT);
+  CommitRecord *c = &commit_at(start + n - 1);
+  if (regs_equal(&ref, &c->state)) return !c->sweep || checkmem(start + n - 1);
+
+  int first = (n > 1 ? bisect(start, n) : 0);
+  if (first >= 0 && first < n - 1) ref_replay(start, first, &ref);
+  set_mismatch(start + (first < 0 ? n - 1 : first), first, n, MISMATCH_BATCH);
+  return false;
+}
+
+// check the commits up to head, stopping at the first mismatch
+static void check_commits(uint32_t head) {
+  uint32_t tail = commit_tail.load(std::memory_order_relaxed);
+  while (tail != head) {
+    // a batch ends at a sweep, and is passed to the REF without wrapping around the ring
+    int n = 0;
+    int n_max = COMMIT_RING_SIZE - (tail & (COMMIT_RING_SIZE - 1));
+    if (n_max > batch_size) n_max = batch_size;
+    while (tail + n != head && n < n_max && !commit_at(tail + n).skip) {
+      if (commit_at(tail + n++).sweep) break;
+    }
+    if (n == 0) {
+      // to skip the checking of an instruction, just copy the reg state to reference design
+      ref_difftest_regcpy(&commit_at(tail).state, DIFFTEST_TO_REF);
+      // its sweep is still checked, or sweep_tail falls behind sweep_head
+      if (commit_at(tail).sweep && !checkmem(tail)) return;
+      n = 1;
+    } else if (!check_batch(tail, n)) {
       return;
     }
+    tail += n;
+    last_pc = commit_at(tail - 1).pc;
+    commit_tail.store(tail, std::memory_order_release);
+  }
+}
+
+static void checker() {
+  while (!mismatch.load(std::memory_order_relaxed)) {
+    uint32_t head = commit_head.load(std::memory_order_acquire);
+    if (head != commit_tail.load(std::memory_order_relaxed)) check_commits(head);
+    // let the core queue some more, rather than spinning on an empty ring
+    else std::this_thread::sleep_for(std::chrono::microseconds(10));
+  }
+}
+
+static void report_commit(char *buf, size_t size, const DifftestCommit *c) {
+  if (c->rd == 0) snprintf(buf, size, "no gpr");
+  else snprintf(buf, size, "gpr[%d] = " FMT_WORD, c->rd, (word_t)c->wdata);
+}
+
+// the memory of the core is ahead of the sweep if checked on another thread, only the page is reported then
+static void report_page(paddr_t addr, vaddr_t pc) {
+  Log("The memory in the page at " FMT_PADDR " is different, written in the last %d instructions before pc = " FMT_WORD,
+      addr, CONFIG_DIFFTEST_SWEEP, pc);
+  if (async_check) return;
+  uint8_t ref_page[PAGE_SIZE], *dut_page = guest_to_host(addr);
+  ref_difftest_memcpy(addr, ref_page, PAGE_SIZE, DIFFTEST_TO_DUT);
+  for (int off = 0; off < (int)PAGE_SIZE; off += sizeof(word_t)) {
+    if (memcmp(ref_page + off, dut_page + off, sizeof(word_t)) != 0) {
+      Log("mismatch memory at " FMT_PADDR ": DUT = " ANSI_FMT(FMT_WORD, ANSI_FG_RED) ", REF = " ANSI_FMT(FMT_WORD, ANSI_FG_RED),
+          addr + off, host_read(dut_page + off, sizeof(word_t)), host_read(ref_page + off, sizeof(word_t)));
+      return;
+    }
+  }
+  Log("The page is written by the REF, but not by the DUT");
+}
+
+static void report_mismatch() {
+  if (mismatch_reported) return;
+  mismatch_reported = true;
+  if (mismatch_kind == MISMATCH_MEM) {
+    vaddr_t pc = commit_at(mismatch_pos).pc;
+    report_page(mismatch_page, pc);
+    sim_state.state = SIM_ABORT;
+    sim_state.halt_pc = pc;
+    assert_fail_msg();
+    return;
+  }
+  if (mismatch_kind == MISMATCH_COMMIT) {
+    // the registers of the core are ahead, only the commits are reported
+    DifftestCommit *c = &dirty_at(mismatch_pos);
+    vaddr_t pc = c->pc;
+    if (c->pc != mismatch_ref.pc) {
+      // the instruction before has gone to a wrong pc
+      pc = (mismatch_first > 0 ? dirty_at(mismatch_pos - 1).pc : last_pc);
+      Log("The next pc of the instruction at pc = " FMT_WORD " is different, REF = " FMT_WORD ", DUT = " FMT_WORD,
+          pc, (word_t)mismatch_ref.pc, (word_t)c->pc);
+    } else if (c->rd == mismatch_ref.rd && (c->rd == 0 || c->wdata == mismatch_ref.wdata)) {
+      // the REF has stopped at a load from a device, whose address it reports
+      Log("The instruction at pc = " FMT_WORD " does not load from the device the REF loads from", pc);
+    } else {
+      char right[64], wrong[64];
+      report_commit(right, sizeof(right), &mismatch_ref);
+      report_commit(wrong, sizeof(wrong), c);
+      Log("The instruction at pc = " FMT_WORD " writes %s, but it should write %s", pc, wrong, right);
+    }
+    sim_state.state = SIM_ABORT;
+    sim_state.halt_pc = pc;
+    assert_fail_msg();
+    return;
+  }
+  if (mismatch_kind == MISMATCH_SWEEP) {
+    Log("The mismatch is found by comparing all the registers, which is done every %d instructions", CONFIG_DIFFTEST_SWEEP);
+  } else if (mismatch_first < 0) {
+    Log("Can not rewind the REF, the mismatch is reported at the end of the batch");
+  } else if (mismatch_batch > 1) {
+    Log("The first mismatch is after instruction %d of a batch of %d", mismatch_first, mismatch_batch);
   }
+  // checkregs() compares with core, which is ahead of the commit,
+  // and the registers right after the diverging instruction are reported
+  CommitRecord *c = &commit_at(mismatch_pos);
+  core = c->state;
+  checkregs(&ref, c->pc);
 }
 
-void difftest_step(vaddr_t pc) {
+/* wait for the commits so far to be checked, and report a mismatch */
+void difftest_sync() {
+  uint32_t head = commit_head.load(std::memory_order_relaxed);
+  if (async_check) {
+    while (commit_tail.load(std::memory_order_acquire) != head && !mismatch.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+  } else {
+    check_commits(head);
+  }
+  if (mismatch.load(std::memory_order_acquire)) report_mismatch();
+}
+
+#if CONFIG_DIFFTEST_MEM
+static void hash_dirty_pages() {
+  std::vector<DifftestPage> &v = sweep_pages[sweep_head++ % SWEEP_RING_SIZE];
+  paddr_t *pages;
+  int n = pmem_dirty_pages(&pages);
+  v.resize(n);
+  for (int i = 0; i < n; i++) v[i] = (DifftestPage){ .addr = pages[i], .hash = page_hash(guest_to_host(pages[i])) };
+  pmem_dirty_clear();
+}
+#endif
+
+void difftest_step(vaddr_t pc, uint32_t inst) {
   // printf("pc in difftest_step = " FMT_WORD "\n", pc);
   // printf("core.pc in difftest_step = " FMT_WORD "\n", core.pc);
   // printf("ref.pc in difftes t_step = " FMT_WORD "\n", ref.pc);
 
-  if (is_skip_ref) {
-    // to skip the checking of an instruction, just copy the reg state to reference design
-    ref_difftest_regcpy(&core, DIFFTEST_TO_REF);
-    is_skip_ref = false;
+  uint32_t head = commit_head.load(std::memory_order_relaxed);
+  while (head - commit_tail.load(std::memory_order_acquire) == COMMIT_RING_SIZE &&
+      !mismatch.load(std::memory_order_acquire)) {
+    std::this_thread::yield();
+  }
+  if (unlikely(mismatch.load(std::memory_order_acquire))) {
+    report_mismatch();
     return;
   }
 
-  ref_difftest_exec(1);
-  ref_difftest_regcpy(&ref, DIFFTEST_TO_DUT);
+  CommitRecord *c = &commit_at(head);
+  c->pc = pc;
+  c->skip = is_skip_ref;
+  c->sweep = false;
+  c->mmio = is_mmio_load;
+  if (c->mmio) {
+    c->mmio_addr = mmio_addr;
+    c->mmio_len = mmio_len;
+    c->mmio_data = mmio_data;
+  }
+  is_skip_ref = false;
+  is_mmio_load = false;
+  if (ref_difftest_step_and_compare != NULL) {
+    // stores and branches have no rd, the bits are imm
+    uint32_t opcode = BITS(inst, 6, 0);
+    int rd = (opcode == 0x23 || opcode == 0x63 ? 0 : BITS(inst, 11, 7));
+    dirty_at(head) = (DifftestCommit){ .pc = pc, .wdata = core.gpr[rd], .rd = (uint32_t)rd };
+  }
+  if (++nr_unswept == CONFIG_DIFFTEST_SWEEP) {
+    c->sweep = true;
+    nr_unswept = 0;
+    IFONE(CONFIG_DIFFTEST_MEM, if (ref_difftest_pmem_compare != NULL) hash_dirty_pages());
+  }
+  if (c->skip || c->sweep || ref_difftest_step_and_compare == NULL) c->state = core;
+  commit_head.store(++head, std::memory_order_release);
 
-  checkregs(&ref, pc);
+  if (!async_check && (c->skip || c->sweep || head - commit_tail.load(std::memory_order_relaxed) == (uint32_t)batch_size)) {
+    difftest_sync();
+  }
+}
+
+// pmem has been replaced by a checkpoint, the registers follow with the restorer
+void difftest_restore() {
+  difftest_sync();
+  ref_difftest_memcpy(PMEM_LEFT, guest_to_host(PMEM_LEFT), CONFIG_MSIZE, DIFFTEST_TO_REF);
+}
+
+// pmem has been written by the debugger after difftest_sync(), the REF follows
+void difftest_pmem_write(paddr_t addr, int len) {
+  ref_difftest_memcpy(addr, guest_to_host(addr), len, DIFFTEST_TO_REF);
 }
 
 void difftest_init(char *ref_so_file, long img_size, int port) {
@@ -85,10 +464,20 @@ void difftest_init(char *ref_so_file, long img_size, int port) {
     void (*ref_difftest_init)(int) = (void (*)(int))dlsym(handle, "difftest_init");
     assert(ref_difftest_init);
 
-    Log("The result of every instruction will be compared with %s. ", ref_so_file);
+    // optional, batches can not be bisected without either of them
+    ref_difftest_snapshot = (bool (*)(bool))dlsym(handle, "difftest_snapshot");
+    ref_difftest_step_and_compare = (int (*)(const DifftestCommit *, int, DifftestCommit *))dlsym(handle, "difftest_step_and_compare");
+    if (ref_difftest_snapshot == NULL && ref_difftest_step_and_compare == NULL) batch_size = 1;
+    ref_difftest_pmem_compare = (bool (*)(const DifftestPage *, int, uint64_t *))dlsym(handle, "difftest_pmem_compare");
+    ref_difftest_mmio_load = (void (*)(uint64_t, int, uint64_t))dlsym(handle, "difftest_mmio_load");
+    IFONE(CONFIG_DIFFTEST_ASYNC, async_check = (std::thread::hardware_concurrency() > 1));
+
+    Log("The result of every instruction will be compared with %s, %d instructions at a time%s. ",
+        ref_so_file, batch_size, (async_check ? " on another thread" : ""));
 
     ref_difftest_init(port);
     ref_difftest_memcpy(RESET_VECTOR, guest_to_host(RESET_VECTOR), img_size, DIFFTEST_TO_REF);
     ref_difftest_regcpy(&core, DIFFTEST_TO_REF);
+    if (async_check) std::thread(checker).detach();
   );
 }
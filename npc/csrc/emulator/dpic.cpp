@@ -1,9 +1,10 @@
 #include "emulator/dpic.h"
 #include "memory/paddr.h"
 #include "emulator/difftest.h"
+#include "monitor/checkpoint.h"
 
 void func_call_trace(vaddr_t addr_curr, vaddr_t addr_func);
-void func_ret_trace(vaddr_t addr_curr);
+void func_ret_trace(vaddr_t addr_curr, vaddr_t addr_ret);
 void exception_trace();
 
 extern "C" void ebreak_exit() {
@@ -25,6 +26,13 @@ extern "C" int inst_fetch() {
   static vaddr_t addr_prev = 0;
   static int inst_prev = 0;
 
+  IFONE(CONFIG_CHECKPOINT,
+    word_t inst_restorer;
+    if (unlikely(ckpt_restoring) && checkpoint_restorer_fetch(&inst_restorer)) {
+      return inst_restorer; // registers of a checkpoint are being restored
+    }
+  );
+
   if (core.pc == addr_prev) {
     return inst_prev; // prevent duplicated fetch
   }
@@ -54,7 +62,7 @@ extern "C" void func_check(int rdest, vaddr_t addr_curr, vaddr_t addr_jump, word
     if (rdest == 1) {
       func_call_trace(addr_curr, addr_jump);
     } else if (rdest == 0 && data_rsrc1 == core.gpr[1]) {
-      func_ret_trace(addr_curr);
+      func_ret_trace(addr_curr, addr_jump);
     }
 
     addr_prev = addr_curr;
@@ -67,16 +75,19 @@ extern "C" int mem_read(paddr_t addr) { // load type
   int offset = addr & 0x3u;
 
   if (addr == CONFIG_SERIAL_ADDR) { // serial
-    IFONE(CONFIG_DIFFTEST, difftest_skip_ref());
-    return getchar();
+    int c = getchar();
+    IFONE(CONFIG_DIFFTEST, difftest_mmio_read(addr, 4, c));
+    return c;
   }
 
   if (addr == CONFIG_RTC_ADDR) { // rtc
-    IFONE(CONFIG_DIFFTEST, difftest_skip_ref());
-    return (uint32_t)get_time();
+    uint32_t lo = (uint32_t)get_time();
+    IFONE(CONFIG_DIFFTEST, difftest_mmio_read(addr, 4, lo));
+    return lo;
   } else if (addr == CONFIG_RTC_ADDR + 4) {
-    IFONE(CONFIG_DIFFTEST, difftest_skip_ref());
-    return (uint32_t)(get_time() >> 32);
+    uint32_t hi = (uint32_t)(get_time() >> 32);
+    IFONE(CONFIG_DIFFTEST, difftest_mmio_read(addr, 4, hi));
+    return hi;
   } 
 
   word_t data = vaddr_read(addr_aligned, 4);
@@ -98,7 +109,7 @@ extern "C" void mem_write(paddr_t addr, uint8_t mask, word_t data) { // store ty
   int offset = addr & 0x3u;
 
   if (addr == CONFIG_SERIAL_ADDR) { // serial
-    IFONE(CONFIG_DIFFTEST, difftest_skip_ref());
+    IFONE(CONFIG_DIFFTEST, difftest_mmio_write());
     putchar(data);
     return;
   } 
@@ -45,24 +45,27 @@ void reg_display() {
   }
 }
 
-word_t reg_str2val(const char *s, bool *success) {
-  *success = false;
-
+/* the storage of a register by name, for expressions compiled once and evaluated often */
+const word_t *reg_str2ptr(const char *s) {
   if (s[0] == '$') {
     s++;
   }
 
   for (int i = 0; i < ARRLEN(core.gpr); i++) {
     if (strcmp(s, regs[i]) == 0) {
-      *success = true;
-      return core.gpr[i];
+      return &core.gpr[i];
     }
   }
 
   if (strcmp(s, "pc") == 0) {
-    *success = true;
-    return core.pc;
+    return &core.pc;
   }
 
-  return 0;
-}
\ No newline at end of file
+  return NULL;
+}
+
+word_t reg_str2val(const char *s, bool *success) {
+  const word_t *reg = reg_str2ptr(s);
+  *success = (reg != NULL);
+  return reg != NULL ? *reg : 0;
+}
@@ -1,6 +1,7 @@
 #include "emulator/simulate.h"
 #include "emulator/reg.h"
 #include "emulator/dpic.h"
+#include "device/event.h"
 
 VCore* dut = nullptr;
 VerilatedFstC* tfp = nullptr;
@@ -11,9 +12,17 @@ uint64_t guest_inst = 0;
 static uint64_t sim_time = 0; // unit: us
 
 extern "C" void disasm_init(const char *triple);
-void device_update();
-void difftest_step(vaddr_t pc);
+extern "C" void disasm_statistic(uint64_t *hit, uint64_t *miss);
+void difftest_step(vaddr_t pc, uint32_t inst);
+void difftest_sync();
 void inst_trace(CORE_state core);
+void iqueue_record(vaddr_t pc, uint32_t inst, vaddr_t dnpc);
+extern uint64_t profile_next;
+void profile_sample(vaddr_t pc);
+void wp_check();
+extern int nr_bp;
+void bp_check(vaddr_t pc);
+void profile_report();
 void print_ring_buffer();
 
 static void statistic() {
@@ -25,6 +34,13 @@ static void statistic() {
   } else {
     Log("Finish running in less than 1 us and can not calculate the simulation frequency");
   }
+  uint64_t disasm_hit, disasm_miss;
+  disasm_statistic(&disasm_hit, &disasm_miss);
+  if (disasm_hit + disasm_miss > 0) {
+    Log("disasm cache hit = " NUMBERIC_FMT ", miss = " NUMBERIC_FMT ", hit rate = %.2f%%",
+        disasm_hit, disasm_miss, 100.0 * disasm_hit / (disasm_hit + disasm_miss));
+  }
+  IFONE(CONFIG_PROFILE, profile_report());
 }
 
 void assert_fail_msg() {
@@ -55,10 +71,13 @@ void enable_update() {
 void exec_once() {
   vaddr_t pc_curr = core.pc;
   enable_update();  
+  uint32_t inst_curr = core.inst;
   IFONE(CONFIG_ITRACE, inst_trace(core)); // before pc update
   one_cycle();
   one_cycle();
-  IFONE(CONFIG_DIFFTEST, difftest_step(pc_curr)); // after calcuation but need pc before update
+  IFONE(CONFIG_IQUEUE, iqueue_record(pc_curr, inst_curr, core.pc)); // raw, formatted only on errors
+  IFONE(CONFIG_DIFFTEST, difftest_step(pc_curr, inst_curr)); // after calcuation but need pc before update
+  IFONE(CONFIG_WATCHPOINT, wp_check());
 }
 
 void sim_exec(uint64_t n) {
@@ -76,11 +95,15 @@ void sim_exec(uint64_t n) {
   for (;n > 0; n --) {
     exec_once();
     guest_inst++;
+    IFONE(CONFIG_PROFILE, if (guest_inst >= profile_next) profile_sample(core.pc));
+    if (unlikely(nr_bp > 0)) bp_check(core.pc);
     if (sim_state.state != SIM_RUNNING) {
       break;
     }
-    IFONE(CONFIG_DEVICE, device_update()); 
+    IFONE(CONFIG_DEVICE, event_update());
   }
+  // the last batch of difftest, before the state is reported
+  IFONE(CONFIG_DIFFTEST, difftest_sync());
 
   uint64_t timer_end = get_time();
   sim_time += timer_end - timer_start;
@@ -1,9 +1,54 @@
 #include "memory/paddr.h"
+#include "memory/vaddr.h"
 #include "emulator/simulate.h"
 #include "device/mmio.h"
 
 void mem_read_trace(paddr_t addr, int len);
 void mem_write_trace(paddr_t addr, int len, word_t data);
+void wp_mem_write(paddr_t addr, int len);
+
+#if CONFIG_WATCHPOINT
+// number of watched words in each page, the last entry catches accesses crossing the end of pmem
+static uint8_t watched_page[(CONFIG_MSIZE >> PAGE_SHIFT) + 1] = {};
+#define watched(addr) watched_page[((addr) - CONFIG_MBASE) >> PAGE_SHIFT]
+
+/* Watchpoints on memory are re-evaluated only when their pages are written */
+void paddr_watch(paddr_t addr, int len, bool watch) {
+  watched(addr) += (watch ? 1 : -1);
+  if ((addr >> PAGE_SHIFT) != ((addr + len - 1) >> PAGE_SHIFT)) watched(addr + len - 1) += (watch ? 1 : -1);
+}
+#endif
+
+#if CONFIG_DIFFTEST_MEM
+/* Pages of pmem written since the last pmem_dirty_clear(), so that difftest only compares those */
+static bool dirty_page[CONFIG_MSIZE >> PAGE_SHIFT] = {};
+static paddr_t dirty_list[CONFIG_MSIZE >> PAGE_SHIFT];
+static int nr_dirty = 0;
+#define dirty(addr) dirty_page[((addr) - CONFIG_MBASE) >> PAGE_SHIFT]
+
+static inline void mark_dirty(paddr_t addr) {
+  if (likely(dirty(addr))) return;
+  dirty(addr) = true;
+  dirty_list[nr_dirty++] = addr & ~(paddr_t)PAGE_MASK;
+}
+
+static inline void pmem_mark_dirty(paddr_t addr, int len) {
+  mark_dirty(addr);
+  if (unlikely((addr >> PAGE_SHIFT) != ((addr + len - 1) >> PAGE_SHIFT)) && in_pmem(addr + len - 1)) {
+    mark_dirty(addr + len - 1);
+  }
+}
+
+int pmem_dirty_pages(paddr_t **pages) {
+  *pages = dirty_list;
+  return nr_dirty;
+}
+
+void pmem_dirty_clear() {
+  for (int i = 0; i < nr_dirty; i++) dirty(dirty_list[i]) = false;
+  nr_dirty = 0;
+}
+#endif
 
 static word_t pmem_read(paddr_t addr, int len) {
   word_t ret = host_read(guest_to_host(addr), len);
@@ -32,7 +77,10 @@ word_t paddr_read(paddr_t addr, int len) {
 void paddr_write(paddr_t addr, int len, word_t data) {
   IFONE(CONFIG_MTRACE, mem_write_trace(addr, len, data));
   if (likely(in_pmem(addr))) {
-    pmem_write(addr, len, data); return;
+    pmem_write(addr, len, data);
+    IFONE(CONFIG_DIFFTEST_MEM, pmem_mark_dirty(addr, len));
+    IFONE(CONFIG_WATCHPOINT, if (unlikely(watched(addr) || watched(addr + len - 1))) wp_mem_write(addr, len));
+    return;
   }
   IFONE(CONFIG_DEVICE, mmio_write(addr, len, data); return);
   out_of_bound(addr);
@@ -0,0 +1,157 @@
+#include "monitor/checkpoint.h"
+#include "memory/paddr.h"
+#include "emulator/simulate.h"
+#include "emulator/difftest.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* The core starts from the reset vector with its registers cleared, and
+*  they can only be written by executing instructions. So the restorer is
+*    lui  x1, %hi(pc - 4 * N); jalr x0, %lo(pc - 4 * N)(x1)
+*  followed by N instructions that set every csr (through x1) and every gpr,
+*  ending right at the restored pc. They are fed to the core by inst_fetch()
+*  without touching pmem, and the REF is synced by skipping them.
+*/
+#define CKPT_PAGE 4096
+#define MAX_RESTORER (2 + 3 * csr_num + 2 * 16)
+
+extern uint64_t guest_inst;
+
+bool ckpt_restoring = false;
+static word_t restorer[MAX_RESTORER] = {};
+static int nr_restorer = 0;
+static uint64_t restore_inst = 0; // guest_inst to report after restoring
+static uint64_t sample_len = 0;
+
+static const uint32_t csr_addr[csr_num] = { 0x300, 0x305, 0x341, 0x342 };
+
+static inline word_t hi20(word_t v) { return (v + 0x800) & ~0xfffu; }
+static inline word_t lo12(word_t v) { return v & 0xfff; }
+
+static void emit_li(int rd, word_t v) {
+  restorer[nr_restorer ++] = hi20(v) | (rd << 7) | 0x37;                    // lui rd, hi
+  restorer[nr_restorer ++] = (lo12(v) << 20) | (rd << 15) | (rd << 7) | 0x13; // addi rd, rd, lo
+}
+
+static void build_restorer(const word_t *gpr, vaddr_t pc, const word_t *csr) {
+  int len = 3 * csr_num + 2 * 15;
+  vaddr_t start = pc - 4 * len;
+  nr_restorer = 0;
+  restorer[nr_restorer ++] = hi20(start) | (1 << 7) | 0x37;             // lui x1, hi
+  restorer[nr_restorer ++] = (lo12(start) << 20) | (1 << 15) | 0x67;    // jalr x0, lo(x1)
+  for (int i = 0; i < csr_num; i ++) {
+    emit_li(1, csr[i]);
+    restorer[nr_restorer ++] = (csr_addr[i] << 20) | (1 << 15) | (1 << 12) | 0x73; // csrrw x0, csr, x1
+  }
+  for (int i = 1; i < 16; i ++) emit_li(i, gpr[i]);
+  assert(nr_restorer == 2 + len);
+}
+
+// return false once the restorer has been run
+bool checkpoint_restorer_fetch(word_t *inst) {
+  if (guest_inst == (uint64_t)nr_restorer) {
+    ckpt_restoring = false;
+    guest_inst = restore_inst;
+    return false;
+  }
+  IFONE(CONFIG_DIFFTEST, difftest_skip_ref());
+  *inst = restorer[guest_inst];
+  return true;
+}
+
+uint64_t checkpoint_sample_len() {
+  return (sample_len != 0 ? sample_len : -1);
+}
+
+// whether the runs of pmem are in the run table, pmem and the file
+static bool check_pmem(CkptRegion *r, CkptRun *run, uint32_t nr_run, uint64_t file_size) {
+  if ((uint64_t)r->first_run + r->nr_run > nr_run) return false;
+  for (uint32_t i = r->first_run; i < r->first_run + r->nr_run; i ++) {
+    if (run[i].len > CONFIG_MSIZE || run[i].offset > CONFIG_MSIZE - run[i].len) return false;
+    // a mapped page past the end of the file would raise SIGBUS when it is touched
+    if (run[i].len > file_size || run[i].file_offset > file_size - run[i].len) return false;
+  }
+  return true;
+}
+
+// only called after check_pmem()
+static bool load_pmem(int fd, CkptRegion *r, CkptRun *run) {
+  uint8_t *base = guest_to_host(PMEM_LEFT);
+  if (mmap(base, CONFIG_MSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) return false;
+  for (uint32_t i = r->first_run; i < r->first_run + r->nr_run; i ++) {
+    if (((run[i].len | run[i].file_offset) & (CKPT_PAGE - 1)) == 0) {
+      void *p = mmap(base + run[i].offset, run[i].len, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_FIXED, fd, run[i].file_offset);
+      if (p == MAP_FAILED) return false;
+    } else if (pread(fd, base + run[i].offset, run[i].len, run[i].file_offset) != (ssize_t)run[i].len) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool checkpoint_load(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  CkptHeader hdr;
+  bool ok = false;
+  word_t *cpu = NULL;
+  CkptRegion *region = NULL;
+  CkptRun *run = NULL;
+  off_t off = sizeof(hdr);
+  struct stat st;
+  uint64_t file_size;
+
+  if (fstat(fd, &st) != 0) goto out;
+  if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic)) != 0) goto out;
+  if (hdr.version != CKPT_VERSION || hdr.nr_gpr < 16 || hdr.cpu_size < sizeof(word_t) * (hdr.nr_gpr + 1 + csr_num) ||
+      hdr.mbase != CONFIG_MBASE || hdr.msize != CONFIG_MSIZE) {
+    Log("Checkpoint %s does not match this core", path);
+    goto out;
+  }
+  file_size = st.st_size;
+  if (hdr.nr_region == 0 || sizeof(hdr) + (uint64_t)hdr.cpu_size + sizeof(CkptRegion) * (uint64_t)hdr.nr_region +
+      sizeof(CkptRun) * (uint64_t)hdr.nr_run > file_size) {
+    Log("Checkpoint %s is truncated or corrupt", path);
+    goto out;
+  }
+
+  cpu = (word_t *)malloc(hdr.cpu_size);
+  region = (CkptRegion *)malloc(sizeof(CkptRegion) * hdr.nr_region);
+  run = (CkptRun *)malloc(sizeof(CkptRun) * hdr.nr_run);
+  assert(cpu && region && run);
+  if (pread(fd, cpu, hdr.cpu_size, off) != hdr.cpu_size) goto out;
+  off += hdr.cpu_size;
+  if (pread(fd, region, sizeof(CkptRegion) * hdr.nr_region, off) != (ssize_t)(sizeof(CkptRegion) * hdr.nr_region)) goto out;
+  off += sizeof(CkptRegion) * hdr.nr_region;
+  if (pread(fd, run, sizeof(CkptRun) * hdr.nr_run, off) != (ssize_t)(sizeof(CkptRun) * hdr.nr_run)) goto out;
+
+  for (uint32_t i = 16; i < hdr.nr_gpr; i ++) {
+    if (cpu[i] != 0) { Log("Checkpoint %s uses x%d, which is not in RV32E", path, i); goto out; }
+  }
+  // device states of nemu are skipped, only pmem is restored, after all of it is checked
+  region[0].name[CKPT_NAME_LEN - 1] = '\0';
+  if (strcmp(region[0].name, "pmem") != 0 || !check_pmem(&region[0], run, hdr.nr_run, file_size)) {
+    Log("Checkpoint %s is truncated or corrupt", path);
+    goto out;
+  }
+  if (!load_pmem(fd, &region[0], run)) panic("Can not read checkpoint %s, pmem is partly restored", path);
+  IFONE(CONFIG_DIFFTEST, difftest_restore());
+
+  build_restorer(cpu, cpu[hdr.nr_gpr], cpu + hdr.nr_gpr + 1);
+  ckpt_restoring = true;
+  restore_inst = hdr.nr_guest_inst;
+  sample_len = hdr.sample_len;
+  Log("Checkpoint restored from %s at %" PRIu64 " instructions, pc = " FMT_WORD, path, restore_inst, cpu[hdr.nr_gpr]);
+  if (sample_len != 0) Log("Sample of %" PRIu64 " instructions, weight = %f", sample_len, hdr.weight);
+  ok = true;
+
+out:
+  free(cpu);
+  free(region);
+  free(run);
+  close(fd);
+  return ok;
+}
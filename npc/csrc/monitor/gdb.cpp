@@ -0,0 +1,350 @@
+#include "emulator/simulate.h"
+#include "memory/paddr.h"
+#include "emulator/difftest.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+/* A stub of the GDB remote serial protocol. With --gdb=PORT, npc waits for
+*  GDB on PORT, and serves it instead of sdb. The registers live in the RTL,
+*  so GDB can read them but not write them.
+*/
+#define GDB_PKT_SIZE 4096
+#define GDB_RUN_CHUNK (1 << 16) // instructions between two polls for an interrupt from GDB
+#define GDB_NR_GPR ARRLEN(core.gpr)
+#define GDB_PC GDB_NR_GPR       // register number of pc
+
+int bp_insert(vaddr_t pc, bool temporary);
+bool bp_remove(vaddr_t pc);
+bool bp_at(vaddr_t pc);
+int wp_add_write(vaddr_t addr);
+bool wp_remove(int no);
+bool wp_triggered(vaddr_t *addr);
+
+static int gdb_fd = -1;
+static bool no_ack = false;
+static char in_buf[GDB_PKT_SIZE];
+static int in_pos = 0, in_len = 0;
+static char pkt[GDB_PKT_SIZE];
+static char reply[GDB_PKT_SIZE * 2];
+static char stop_reason[64] = "S05";
+
+// breakpoints and watchpoints set by GDB, to find the one to remove by its address
+static struct { vaddr_t addr; int no; } gdb_bp[32], gdb_wp[32];
+
+// --- packets ---
+static int gdb_getc() {
+  if (in_pos == in_len) {
+    ssize_t n = recv(gdb_fd, in_buf, sizeof(in_buf), 0);
+    if (n <= 0) return -1;
+    in_pos = 0;
+    in_len = n;
+  }
+  return (uint8_t)in_buf[in_pos++];
+}
+
+// whether GDB asks to stop the running guest with ^C, or is gone
+static bool gdb_interrupted() {
+  if (in_pos == in_len) {
+    ssize_t n = recv(gdb_fd, in_buf, sizeof(in_buf), MSG_DONTWAIT);
+    if (n <= 0) return n == 0;
+    in_pos = 0;
+    in_len = n;
+  }
+  if (in_buf[in_pos] != 0x03) return false;
+  in_pos++;
+  return true;
+}
+
+// receive a packet into pkt, returning false if GDB is gone
+static bool recv_packet() {
+  while (true) {
+    int c, len = 0;
+    uint8_t sum = 0;
+    // skip acks, and ^C which comes too late
+    while ((c = gdb_getc()) != '$') {
+      if (c < 0) return false;
+    }
+    while ((c = gdb_getc()) != '#') {
+      if (c < 0) return false;
+      if (len < GDB_PKT_SIZE - 1) pkt[len++] = c;
+      sum += c;
+    }
+    pkt[len] = '\0';
+    char hex[3] = {};
+    hex[0] = gdb_getc();
+    hex[1] = gdb_getc();
+    if (no_ack) return true;
+    bool ok = (strtoul(hex, NULL, 16) == sum);
+    send(gdb_fd, (ok ? "+" : "-"), 1, 0);
+    if (ok) return true;
+  }
+}
+
+static void send_packet(const char *data) {
+  static char out[sizeof(reply) + 8];
+  int len = strlen(data);
+  uint8_t sum = 0;
+  for (int i = 0; i < len; i++) sum += data[i];
+  out[0] = '$';
+  memcpy(out + 1, data, len);
+  snprintf(out + 1 + len, 4, "#%02x", sum);
+  do {
+    send(gdb_fd, out, len + 4, 0);
+  } while (!no_ack && gdb_getc() == '-');
+}
+
+// --- registers and memory ---
+static char *put_hex_word(char *p, word_t v) {
+  for (int i = 0; i < (int)sizeof(word_t); i++) p += sprintf(p, "%02x", (v >> (i * 8)) & 0xff);
+  return p;
+}
+
+static const word_t *gdb_reg(int no) {
+  if (no < (int)GDB_NR_GPR) return &core.gpr[no];
+  return (no == GDB_PC ? &core.pc : NULL);
+}
+
+static void gdb_read_mem(paddr_t addr, int len) {
+  char *p = reply;
+  len = (len < GDB_PKT_SIZE / 2 ? len : GDB_PKT_SIZE / 2);
+  // mmio is not read by the debugger, as reads may have side effects
+  for (int i = 0; i < len && in_pmem(addr + i); i++) {
+    p += sprintf(p, "%02x", *guest_to_host(addr + i));
+  }
+  if (p == reply) strcpy(reply, "E14");
+}
+
+static void gdb_write_mem(paddr_t addr, int len, const char *data) {
+  if (!in_pmem(addr) || !in_pmem(addr + len - 1)) {
+    strcpy(reply, "E14");
+    return;
+  }
+  // the checker of difftest must be done with the REF before it is written
+  IFONE(CONFIG_DIFFTEST, difftest_sync());
+  for (int i = 0; i < len; i++) {
+    char byte[3] = { data[i * 2], data[i * 2 + 1], '\0' };
+    // through paddr_write(), so that watchpoints see it
+    paddr_write(addr + i, 1, strtoul(byte, NULL, 16));
+  }
+  IFONE(CONFIG_DIFFTEST, difftest_pmem_write(addr, len));
+  strcpy(reply, "OK");
+}
+
+static const char *target_xml() {
+  static char xml[GDB_PKT_SIZE];
+  if (xml[0] != '\0') return xml;
+  char *p = xml;
+  p += sprintf(p, "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+      "<target version=\"1.0\"><architecture>riscv:rv32</architecture>"
+      "<feature name=\"org.gnu.gdb.riscv.cpu\">");
+  for (int i = 0; i < (int)GDB_NR_GPR; i++) {
+    p += sprintf(p, "<reg name=\"x%d\" bitsize=\"32\" type=\"int\" regnum=\"%d\"/>", i, i);
+  }
+  sprintf(p, "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\" regnum=\"%d\"/></feature></target>", (int)GDB_PC);
+  return xml;
+}
+
+// qXfer:features:read:target.xml:OFFSET,LENGTH
+static void gdb_read_xml(const char *args) {
+  const char *xml = target_xml();
+  int off = 0, len = 0, size = strlen(xml);
+  sscanf(args, "%x,%x", &off, &len);
+  if (off >= size) { strcpy(reply, "l"); return; }
+  if (len > GDB_PKT_SIZE - 2) len = GDB_PKT_SIZE - 2;
+  bool last = (off + len >= size);
+  snprintf(reply, sizeof(reply), "%c%.*s", (last ? 'l' : 'm'), (last ? size - off : len), xml + off);
+}
+
+// --- breakpoints and watchpoints ---
+// a breakpoint of sdb at the same pc is left to sdb, GDB does not remove it
+static void gdb_break(bool insert, vaddr_t addr) {
+  int k = 0;
+  if (insert) {
+    if (bp_at(addr)) return;
+    while (k < (int)ARRLEN(gdb_bp) && gdb_bp[k].no >= 0) k++;
+    int no = (k < (int)ARRLEN(gdb_bp) ? bp_insert(addr, false) : -1);
+    if (no < 0) strcpy(reply, "E01");
+    else gdb_bp[k].addr = addr, gdb_bp[k].no = no;
+  } else {
+    while (k < (int)ARRLEN(gdb_bp) && (gdb_bp[k].no < 0 || gdb_bp[k].addr != addr)) k++;
+    if (k < (int)ARRLEN(gdb_bp)) bp_remove(addr), gdb_bp[k].no = -1;
+    else if (!bp_at(addr)) strcpy(reply, "E01");
+  }
+}
+
+// Z/z TYPE,ADDR,KIND
+static void gdb_point(bool insert, const char *args) {
+  int type = 0, len = 0;
+  vaddr_t addr = 0;
+  sscanf(args, "%d,%x,%x", &type, &addr, &len);
+  strcpy(reply, "OK");
+  if (type == 0 || type == 1) {
+    // software and hardware breakpoints are the same pc breakpoints
+    gdb_break(insert, addr);
+  } else if (type == 2 && CONFIG_WATCHPOINT) {
+    // GDB splits a write watchpoint into words, and checks for a change itself
+    int k = 0;
+    if (insert) {
+      while (k < (int)ARRLEN(gdb_wp) && gdb_wp[k].no >= 0) k++;
+      int no = (k < (int)ARRLEN(gdb_wp) ? wp_add_write(addr) : -1);
+      if (no < 0) strcpy(reply, "E01");
+      else gdb_wp[k].addr = addr, gdb_wp[k].no = no;
+    } else {
+      while (k < (int)ARRLEN(gdb_wp) && (gdb_wp[k].no < 0 || gdb_wp[k].addr != addr)) k++;
+      if (k == (int)ARRLEN(gdb_wp)) strcpy(reply, "E01");
+      else wp_remove(gdb_wp[k].no), gdb_wp[k].no = -1;
+    }
+  } else {
+    // read and access watchpoints are not supported, GDB falls back to single steps
+    reply[0] = '\0';
+  }
+}
+
+// --- execution ---
+static void gdb_resume(bool step) {
+  bool watch = false, interrupted = false;
+  vaddr_t watch_addr = 0;
+  if (step) {
+    sim_exec(1);
+    watch = wp_triggered(&watch_addr);
+  } else {
+    // breakpoints and watchpoints stop the core in the middle of a chunk
+    do {
+      sim_exec(GDB_RUN_CHUNK);
+      watch = wp_triggered(&watch_addr);
+    } while (sim_state.state == SIM_STOP && !watch && !bp_at(core.pc) &&
+        !(interrupted = gdb_interrupted()));
+  }
+
+  switch (sim_state.state) {
+    case SIM_END: snprintf(stop_reason, sizeof(stop_reason), "W%02x", sim_state.halt_ret & 0xff); break;
+    case SIM_ABORT: strcpy(stop_reason, "X06"); break;
+    default:
+      if (watch && watch_addr != 0) snprintf(stop_reason, sizeof(stop_reason), "T05watch:%x;", watch_addr);
+      else strcpy(stop_reason, (interrupted ? "S02" : "S05"));
+  }
+  send_packet(stop_reason);
+}
+
+// the core can only resume where it stopped
+static void gdb_resume_at(const char *addr, bool step) {
+  if (*addr != '\0' && strtoul(addr, NULL, 16) != core.pc) send_packet("E01");
+  else gdb_resume(step);
+}
+
+// --- commands ---
+static void gdb_query(const char *q) {
+  if (strncmp(q, "qSupported", 10) == 0) {
+    snprintf(reply, sizeof(reply), "PacketSize=%x;qXfer:features:read+;swbreak+;"
+        "vContSupported+;QStartNoAckMode+", GDB_PKT_SIZE - 1);
+  } else if (strncmp(q, "qXfer:features:read:target.xml:", 31) == 0) gdb_read_xml(q + 31);
+  else if (strcmp(q, "qAttached") == 0) strcpy(reply, "1");
+  else if (strcmp(q, "qC") == 0) strcpy(reply, "QC1");
+  else if (strcmp(q, "qfThreadInfo") == 0) strcpy(reply, "m1");
+  else if (strcmp(q, "qsThreadInfo") == 0) strcpy(reply, "l");
+  else if (strcmp(q, "QStartNoAckMode") == 0) {
+    send_packet("OK");
+    no_ack = true;
+    return;
+  }
+  else reply[0] = '\0';
+  send_packet(reply);
+}
+
+// vCont;ACTION[:THREAD]..., with the only thread taking the first action
+static bool gdb_vcont(const char *v) {
+  if (strcmp(v, "vCont?") == 0) { send_packet("vCont;c;C;s;S"); return true; }
+  if (strncmp(v, "vCont;", 6) != 0) return false;
+  char action = v[6];
+  if (action == 'c' || action == 'C') gdb_resume(false);
+  else if (action == 's' || action == 'S') gdb_resume(true);
+  else send_packet("");
+  return true;
+}
+
+// serve one packet, returning false when the session is over
+static bool gdb_serve() {
+  if (!recv_packet()) return false;
+  vaddr_t addr = 0;
+  int len = 0, no = 0;
+  char *p;
+  reply[0] = '\0';
+  switch (pkt[0]) {
+    case '?': send_packet(stop_reason); return true;
+    case 'g':
+      p = reply;
+      for (int i = 0; i <= (int)GDB_PC; i++) p = put_hex_word(p, *gdb_reg(i));
+      break;
+    case 'p':
+      no = strtoul(pkt + 1, NULL, 16);
+      if (gdb_reg(no) == NULL) strcpy(reply, "E01");
+      else put_hex_word(reply, *gdb_reg(no));
+      break;
+    case 'G': case 'P': strcpy(reply, "E01"); break;
+    case 'm':
+      sscanf(pkt + 1, "%x,%x", &addr, &len);
+      gdb_read_mem(addr, len);
+      break;
+    case 'M':
+      sscanf(pkt + 1, "%x,%x", &addr, &len);
+      p = strchr(pkt, ':');
+      if (p == NULL || (int)strlen(p + 1) < len * 2) strcpy(reply, "E01");
+      else gdb_write_mem(addr, len, p + 1);
+      break;
+    case 'c': gdb_resume_at(pkt + 1, false); return true;
+    case 's': gdb_resume_at(pkt + 1, true); return true;
+    case 'v':
+      if (gdb_vcont(pkt)) return true;
+      break;
+    case 'Z': case 'z': gdb_point(pkt[0] == 'Z', pkt + 1); break;
+    case 'q': case 'Q': gdb_query(pkt); return true;
+    case 'H': case 'T': strcpy(reply, "OK"); break;
+    case 'k':
+      sim_state.state = SIM_QUIT;
+      return false;
+    case 'D':
+      send_packet("OK");
+      return false;
+  }
+  send_packet(reply);
+  return true;
+}
+
+void gdb_init(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  Assert(fd >= 0, "cannot create a socket for GDB");
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  Assert(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0, "cannot bind to port %d for GDB", port);
+  listen(fd, 1);
+  Log("Waiting for GDB on port %d, connect with 'target remote :%d'", port, port);
+  gdb_fd = accept(fd, NULL, NULL);
+  close(fd);
+  Assert(gdb_fd >= 0, "cannot accept the connection from GDB");
+  // packets are small and answered one by one
+  setsockopt(gdb_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  for (int i = 0; i < (int)ARRLEN(gdb_wp); i++) gdb_bp[i].no = gdb_wp[i].no = -1;
+  Log("GDB connected");
+}
+
+/* serve GDB until it kills or detaches from the core, returning false if
+*  GDB is not used. The core runs freely after GDB detaches.
+*/
+bool gdb_mainloop() {
+  if (gdb_fd < 0) return false;
+  while (gdb_serve());
+  close(gdb_fd);
+  gdb_fd = -1;
+  if (sim_state.state != SIM_QUIT && sim_state.state != SIM_END && sim_state.state != SIM_ABORT) {
+    Log("GDB detached");
+    sim_exec(-1);
+  }
+  return true;
+}
@@ -1,4 +1,5 @@
 #include "memory/paddr.h"
+#include "monitor/checkpoint.h"
 
 void sdb_set_batch_mode();
 void difftest_init(char *ref_so_file, long img_size, int port);
@@ -7,12 +8,20 @@ void log_init(const char *log_file);
 void mem_init();
 void sdb_init();
 void device_init();
+void trace_event_init(const char *file);
+void profile_init(uint64_t interval, const char *file);
+void gdb_init(int port);
 
 static char *elf_file = NULL;
 static char *log_file = NULL;
 static char *img_file = NULL;
 static char *diff_so_file = NULL;
 static int difftest_port = 3614;
+static char *restore_file = NULL;
+static char *ftrace_json_file = NULL;
+static char *profile_file = NULL;
+static uint64_t profile_n = 0;
+static int gdb_port = 0;
 
 void welcome() {
   Log("ITrace: %s", MUXONE(CONFIG_ITRACE, ANSI_FMT("ON", ANSI_FG_GREEN), ANSI_FMT("OFF", ANSI_FG_RED)));
@@ -56,16 +65,32 @@ static int parse_args(int argc, char *argv[]) {
     {"log"      , required_argument, NULL, 'l'},
     {"elf"      , required_argument, NULL, 'e'},
     {"diff"     , required_argument, NULL, 'd'},
+    {"restore"  , required_argument, NULL, 'r'},
+    {"ftrace-json", required_argument, NULL, 'j'},
+    {"profile"  , required_argument, NULL, 'P'},
+    {"gdb"      , required_argument, NULL, 'g'},
     {"help"     , no_argument      , NULL, 'h'},
     {0          , 0                , NULL,  0 },
   };
   int o;
-  while ( (o = getopt_long(argc, argv, "-bl:e:d:h", table, NULL)) != -1) {
+  while ( (o = getopt_long(argc, argv, "-bl:e:d:r:j:P:g:h", table, NULL)) != -1) {
     switch (o) {
       case 'b': sdb_set_batch_mode(); break;
       case 'l': log_file = optarg; break;
       case 'e': elf_file = optarg; break;
       case 'd': diff_so_file = optarg; break;
+      case 'r': restore_file = optarg; break;
+      case 'j': ftrace_json_file = optarg; break;
+      case 'P':
+        profile_file = strchr(optarg, ',');
+        if (profile_file == NULL) {
+          printf("'%s' should be N,FILE\n", optarg);
+          exit(1);
+        }
+        profile_n = strtoull(optarg, NULL, 0);
+        profile_file++;
+        break;
+      case 'g': sscanf(optarg, "%d", &gdb_port); break;
       case 1: img_file = optarg; return 0;
       default:
         printf("Usage: %s [OPTION...] IMAGE [args]\n\n", argv[0]);
@@ -73,6 +98,10 @@ static int parse_args(int argc, char *argv[]) {
         printf("\t-l,--log=FILE           output log to FILE\n");   // output log
         printf("\t-e,--elf=FILE           parse given ELF FILE\n"); // parse elf  
         printf("\t-d,--diff=REF_SO        run DiffTest with reference REF_SO\n");  // diffset
+        printf("\t-r,--restore=FILE       restore the checkpoint FILE taken by nemu\n");
+        printf("\t-j,--ftrace-json=FILE   write function calls as Chrome trace events to FILE\n");
+        printf("\t-P,--profile=N,FILE     sample the guest function every N instructions, write collapsed stacks to FILE\n");
+        printf("\t-g,--gdb=PORT           wait for GDB on PORT, and serve it instead of sdb\n");
         printf("\n");
         exit(0);
     }
@@ -88,7 +117,11 @@ void monitor_init(int argc, char *argv[]) {
   log_init(log_file);
 
   /* Parse elf file. */
-  IFONE(CONFIG_FTRACE, parse_elf(elf_file));
+  if (CONFIG_FTRACE || (CONFIG_PROFILE && profile_file != NULL)) {
+    parse_elf(elf_file);
+  }
+  IFONE(CONFIG_FTRACE, if (ftrace_json_file != NULL) trace_event_init(ftrace_json_file));
+  IFONE(CONFIG_PROFILE, if (profile_file != NULL) profile_init(profile_n, profile_file));
 
   /* Initialize memory. */
   mem_init();  
@@ -99,6 +132,12 @@ void monitor_init(int argc, char *argv[]) {
   /* Initialize differential testing. */
   IFONE(CONFIG_DIFFTEST, difftest_init(diff_so_file, img_size, difftest_port));
 
+  /* Restore the checkpoint. This will overwrite the image. */
+  if (restore_file != NULL) {
+    Assert(MUXONE(CONFIG_CHECKPOINT, checkpoint_load(restore_file), false),
+        "Can not restore checkpoint '%s'", restore_file);
+  }
+
   IFONE(CONFIG_DEVICE, device_init());
 
   /* Display welcome message. */
@@ -106,4 +145,7 @@ void monitor_init(int argc, char *argv[]) {
 
   /* Initialize the simple debugger. */
   sdb_init();
+
+  /* Wait for GDB. */
+  IFONE(CONFIG_GDBSTUB, if (gdb_port != 0) gdb_init(gdb_port));
 }
\ No newline at end of file
@@ -0,0 +1,125 @@
+#include "monitor/sdb.h"
+
+#define NR_BP 32 // max num of breakpoint
+#define BP_HASH_SIZE 64 // must be a power of 2 and larger than NR_BP
+
+typedef struct {
+  int NO;
+  bool used;
+  bool temporary; // set by tbreak, deleted once hit
+  vaddr_t pc;
+} BP;
+
+static BP bp_pool[NR_BP] = {};
+// open addressing on the pc, rebuilt whenever a breakpoint is added or deleted
+static BP *bp_hash[BP_HASH_SIZE] = {};
+int nr_bp = 0;
+
+#define bp_index(k) ((k) & (BP_HASH_SIZE - 1))
+
+static BP *bp_find(vaddr_t pc) {
+  for (uint32_t k = pc >> 2; bp_hash[bp_index(k)] != NULL; k++) {
+    if (bp_hash[bp_index(k)]->pc == pc) return bp_hash[bp_index(k)];
+  }
+  return NULL;
+}
+
+static void bp_rehash() {
+  memset(bp_hash, 0, sizeof(bp_hash));
+  nr_bp = 0;
+  for (int i = 0; i < NR_BP; i++) {
+    if (!bp_pool[i].used) continue;
+    uint32_t k = bp_pool[i].pc >> 2;
+    while (bp_hash[bp_index(k)] != NULL) k++;
+    bp_hash[bp_index(k)] = &bp_pool[i];
+    nr_bp++;
+  }
+}
+
+/* stop before running the instruction at pc if there is a breakpoint,
+*  only called when nr_bp > 0
+*/
+void bp_check(vaddr_t pc) {
+  BP *bp = bp_find(pc);
+  if (bp == NULL) return;
+
+  printf("%s %d at " FMT_WORD "\n", (bp->temporary ? "Temporary breakpoint" : "Breakpoint"), bp->NO, pc);
+  sim_state.state = SIM_STOP;
+  if (bp->temporary) {
+    bp->used = false;
+    bp_rehash();
+  }
+}
+
+/* add a breakpoint at pc, returning its NO, or -1 if the pool is full */
+int bp_insert(vaddr_t pc, bool temporary) {
+  BP *bp = bp_find(pc);
+  if (bp != NULL) return bp->NO;
+
+  int i = 0;
+  while (i < NR_BP && bp_pool[i].used) i++;
+  if (i == NR_BP) return -1;
+
+  bp_pool[i] = (BP){i, true, temporary, pc};
+  bp_rehash();
+  return i;
+}
+
+/* remove the breakpoint at pc, returning false if there is none */
+bool bp_remove(vaddr_t pc) {
+  BP *bp = bp_find(pc);
+  if (bp == NULL) return false;
+  bp->used = false;
+  bp_rehash();
+  return true;
+}
+
+/* whether there is a breakpoint at pc */
+bool bp_at(vaddr_t pc) {
+  return nr_bp > 0 && bp_find(pc) != NULL;
+}
+
+void bp_add(vaddr_t pc, bool temporary) {
+  BP *bp = bp_find(pc);
+  if (bp != NULL) {
+    printf("Breakpoint %d is already at " FMT_WORD "\n", bp->NO, pc);
+    return;
+  }
+
+  int no = bp_insert(pc, temporary);
+  if (no < 0) {
+    printf("No idle breakpoints in pool\n");
+    return;
+  }
+  printf("%s %d at " FMT_WORD "\n", (temporary ? "Temporary breakpoint" : "Breakpoint"), no, pc);
+}
+
+/* delete the breakpoint with the given NO, or all of them if no < 0 */
+void bp_delete(int no) {
+  if (no >= NR_BP || (no >= 0 && !bp_pool[no].used)) {
+    printf("Breakpoint %d not found\n", no);
+    return;
+  }
+
+  for (int i = 0; i < NR_BP; i++) {
+    if (no < 0 || i == no) bp_pool[i].used = false;
+  }
+  bp_rehash();
+  if (no >= 0) printf("Breakpoint %d deleted\n", no);
+  else printf("All breakpoints deleted\n");
+}
+
+/* Print info of each breakpoint */
+void bp_display() {
+  if (nr_bp == 0) {
+    printf("No breakpoint\n");
+    return;
+  }
+
+  printf("Num    Type     Address\n");
+  for (int i = 0; i < NR_BP; i++) {
+    if (bp_pool[i].used) {
+      printf("%-6d %-8s " FMT_WORD "\n", i, (bp_pool[i].temporary ? "tbreak" : "break"), bp_pool[i].pc);
+    }
+  }
+}
@@ -79,6 +79,13 @@ typedef enum {
   PAREN_NOT_MATCHED   // not enclosed and unmatched, throw it away
 } Paren_Status;
 
+/* a '-' or '*' is binary only if it follows an operand */
+static bool follows_operand() {
+  if (nr_token == 0) return false;
+  int type = tokens[nr_token - 1].type;
+  return type == TK_NUMS || type == TK_HEX || type == TK_REG || type == TK_RB;
+}
+
 /* parse the input string into an array of tokens, handling negative signs, pointer symbols */
 static bool make_token(char *e) {
   int position = 0;
@@ -108,6 +115,10 @@ static bool make_token(char *e) {
 
         /* record tokens*/
         if (rules[i].token_type != TK_NOTYPE) {
+          if (nr_token == ARRLEN(tokens)) {
+            printf("too many tokens in the expression\n");
+            return false;
+          }
 
           tokens[nr_token].type = rules[i].token_type;
 
@@ -117,20 +128,13 @@ static bool make_token(char *e) {
             substr_len = sizeof(tokens[nr_token].str) - 1;
           }
 
-          Assert(nr_token < 65536, "storage cant hold that much tokens");
           Assert(substr_len < sizeof(tokens[nr_token].str), "single token overflow");
           strncpy(tokens[nr_token].str, substr_start, substr_len);   // record str into tokens
           tokens[nr_token].str[substr_len] = '\0';   // add stop sign
           
           // check if - is negative sign or minus sign
           if (tokens[nr_token].type == '-') {
-            if (nr_token == 0 ||
-                tokens[nr_token - 1].type == TK_LB || 
-                tokens[nr_token - 1].type == TK_NEGATIVE ||
-                tokens[nr_token - 1].type == '-' ||
-                tokens[nr_token - 1].type == '+' ||
-                tokens[nr_token - 1].type == '*' ||
-                tokens[nr_token - 1].type == '/') {
+            if (!follows_operand()) {
                   // count consecutive negative signs
                   neg_count++;
                   while (e[position] == '-') {
@@ -152,13 +156,7 @@ static bool make_token(char *e) {
 
           // check if * is multiply sign or pointer sign
           if (tokens[nr_token].type == '*') {
-            if (nr_token == 0 || 
-                tokens[nr_token - 1].type == TK_LB || 
-                tokens[nr_token - 1].type == TK_NEGATIVE ||
-                tokens[nr_token - 1].type == '-' ||
-                tokens[nr_token - 1].type == '+' ||
-                tokens[nr_token - 1].type == '*' ||
-                tokens[nr_token - 1].type == '/') {
+            if (!follows_operand()) {
                   tokens[nr_token].type = TK_POINTER;
                   Log("A pointer sign decected");
                 }
@@ -234,6 +232,7 @@ int get_operator_priority(int token_type) {
       return 5;
     case TK_NEGATIVE:
     case TK_POINTER:
+    case TK_NOT:
       return 6;
     default:
       return INT_MAX;
@@ -249,7 +248,14 @@ bool is_operator(int type) {
   return result;
 }
 
-/* return the location of main operator, it cannot inside the brackets */
+bool is_unary_operator(int type) {
+  return (type == TK_NEGATIVE || type == TK_POINTER || type == TK_NOT);
+}
+
+/* return the location of main operator, it cannot inside the brackets.
+*  It is the last binary operator with the lowest priority, or the first
+*  unary operator if there is no binary one.
+*/
 int find_main_operator(int p, int q) {
   int op = -1;
   int min_priority = INT_MAX;
@@ -266,7 +272,7 @@ int find_main_operator(int p, int q) {
     }
 
     int priority = get_operator_priority(tokens[i].type);
-    if (priority < min_priority) {
+    if (priority < min_priority || (priority == min_priority && !is_unary_operator(tokens[i].type))) {
       min_priority = priority;
       op = i;
     }
@@ -276,139 +282,184 @@ int find_main_operator(int p, int q) {
   return op;
 }
 
-bool is_unary_operator(int type) {
-  return (type == TK_NEGATIVE || type == TK_POINTER || type == TK_NOT);
-}
-
-#define STACK_SIZE 1000
-word_t vaddr_read(vaddr_t addr, int len);
+/* An expression is compiled once into postfix bytecode over constants,
+*  registers and memory, and then evaluated with a small stack. This is what
+*  watchpoints run after every cycle.
+*/
+enum {
+  OP_IMM, OP_REG, OP_DEREF, OP_NEG, OP_NOT,
+  OP_ADD, OP_SUB, OP_MUL, OP_DIV,
+  OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE, OP_AND, OP_OR,
+};
 
 typedef struct {
-  int p, q;
-  int stage; // 0: initial stage, 1: left operand processed, 2: right operand processed
-  word_t left_val;
   int op;
-} StackFrame;
-
-/* evaluate expression value recursively, dealing divide-by-zero detection */
-word_t eval(int p, int q) {
-  StackFrame stack[STACK_SIZE];
-  int sp = 0; // stack pointer
-  word_t result = 0;
-  bool error = false;
-  
-  stack[sp++] = (StackFrame){p, q, 0, 0, -1};
-
-  while (sp > 0 && !error) {
-    StackFrame *frame = &stack[sp-1];
-
-    if (frame->stage == 0) {
-      // initial stage, check if the expression is valid
-      if (frame->p > frame->q) {
-        error = true;
-        sp--;
-        continue;
-      }
+  word_t imm;         // OP_IMM
+  const word_t *reg;  // OP_REG
+} ExprOp;
 
-      Paren_Status status = check_parentheses(frame->p, frame->q);
-      if (status == PAREN_ENCLOSED) {
-        // handle enclosed expression
-        frame->p++;
-        frame->q--;
-        continue;
-      }
+struct ExprCode {
+  int nr_op;
+  ExprOp op[ARRLEN(tokens)];
+};
 
-      int op = find_main_operator(frame->p, frame->q);
-      if (op == -1) {
-        /* Single token.
-        * For now this token should be a number.
-        * Return the value of the number.
-        */
-        if (tokens[frame->p].type == TK_NUMS) {
-          result = atoi(tokens[frame->p].str);
-        } else if (tokens[frame->p].type == TK_HEX) {
-          result = strtol(tokens[frame->p].str, NULL, 16);
-        } else if (tokens[frame->p].type == TK_REG) {
-          bool suc = false;
-          word_t val = reg_str2val(tokens[frame->p].str, &suc);
-          if (suc == true) {
-            result = val;
-          } else {
-            panic("Invalid register");
-          }
-        }
-        sp--;
-        continue;
-      }
+word_t vaddr_read(vaddr_t addr, int len);
 
-      if (is_unary_operator(tokens[op].type)) {
-        // handel unary operator, stack the right operand
-        frame->op = op;
-        stack[sp++] = (StackFrame){op+1, frame->q, 0, 0, -1};
-        frame->stage = 1;
-      } else {
-        // handle binary operator, deal with left operand first
-        frame->op = op;
-        stack[sp++] = (StackFrame){frame->p, op-1, 0, 0, -1};
-        frame->stage = 2;
-      }
-    } else if (frame->stage == 1) {
-      // unary operator
-      word_t val = result;
-      switch (tokens[frame->op].type) {
-        case TK_NEGATIVE: result = -val; break;
-        case TK_POINTER:  result = vaddr_read(val, 4); break;
-        case TK_NOT:      result = !val; break;
-        default: panic("Unknown unary operator type: %d", tokens[frame->op].type);
-      }
-      sp--;
-    } else if (frame->stage == 2) {
-      // binary operator, left operand processed, deal with right operand
-      frame->left_val = result;
-      stack[sp++] = (StackFrame){frame->op+1, frame->q, 0, 0, -1};
-      frame->stage = 3;
-    } else if (frame->stage == 3) {
-      // binary operator, right operand processed, calculate the result
-      word_t right_val = result;
-      if (tokens[frame->op].type == '/' && right_val == 0) {
-        error = true;
-        sp--;
-        Log("Division by zero detected"); 
-        break;
-      }
-      switch (tokens[frame->op].type) {
-        case '+': result = frame->left_val + right_val; break;
-        case '-': result = frame->left_val - right_val; break;
-        case '*': result = frame->left_val * right_val; break;
-        case '/': result = (sword_t)frame->left_val / (sword_t)right_val; break;
-        case TK_EQ: result = frame->left_val == right_val; break;
-        case TK_NOTEQ: result = frame->left_val != right_val; break;
-        case TK_LT: result = frame->left_val < right_val; break;
-        case TK_LE: result = frame->left_val <= right_val; break;
-        case TK_GT: result = frame->left_val > right_val; break;
-        case TK_GE: result = frame->left_val >= right_val; break;
-        case TK_AND: result = frame->left_val && right_val; break;
-        case TK_OR: result = frame->left_val || right_val; break;
-        default: panic("Unknown operator type: %d", tokens[frame->op].type);
+static bool emit(ExprCode *c, int op, word_t imm = 0, const word_t *reg = NULL) {
+  if (c->nr_op == ARRLEN(c->op)) return false;
+  c->op[c->nr_op++] = (ExprOp){op, imm, reg};
+  return true;
+}
+
+static word_t expr_calc(int op, word_t v1, word_t v2) {
+  switch (op) {
+    case OP_NEG: return -v1;
+    case OP_NOT: return !v1;
+    case OP_ADD: return v1 + v2;
+    case OP_SUB: return v1 - v2;
+    case OP_MUL: return v1 * v2;
+    case OP_DIV:
+      if (v2 == 0) panic("Division by zero detected");
+      return (sword_t)v1 / (sword_t)v2;
+    case OP_EQ:  return v1 == v2;
+    case OP_NE:  return v1 != v2;
+    case OP_LT:  return v1 < v2;
+    case OP_LE:  return v1 <= v2;
+    case OP_GT:  return v1 > v2;
+    case OP_GE:  return v1 >= v2;
+    case OP_AND: return v1 && v2;
+    case OP_OR:  return v1 || v2;
+    default: panic("Unknown operator type: %d", op);
+  }
+}
+
+/* emit an operator, folding it into a constant if its operands are constants,
+*  so that e.g. *(0x80000000 + 4) loads from a known address
+*/
+static bool emit_op(ExprCode *c, int op) {
+  int nr_src = (op >= OP_ADD ? 2 : 1);
+  ExprOp *src = &c->op[c->nr_op - nr_src];
+  bool is_const = (op != OP_DEREF && src[0].op == OP_IMM && (nr_src == 1 || src[1].op == OP_IMM));
+  if (is_const && !(op == OP_DIV && src[1].imm == 0)) {
+    src[0].imm = expr_calc(op, src[0].imm, (nr_src == 2 ? src[1].imm : 0));
+    c->nr_op -= nr_src - 1;
+    return true;
+  }
+  return emit(c, op);
+}
+
+/* compile tokens[p..q] recursively, returning false for a bad expression */
+static bool compile(int p, int q, ExprCode *c) {
+  if (p > q) return false;
+
+  if (check_parentheses(p, q) == PAREN_ENCLOSED) {
+    return compile(p + 1, q - 1, c);
+  }
+
+  int op = find_main_operator(p, q);
+  if (op == -1) {
+    /* Single token: a number or a register. */
+    if (p != q) return false;
+    switch (tokens[p].type) {
+      case TK_NUMS: return emit(c, OP_IMM, atoi(tokens[p].str));
+      case TK_HEX:  return emit(c, OP_IMM, strtol(tokens[p].str, NULL, 16));
+      case TK_REG: {
+        const word_t *reg = reg_str2ptr(tokens[p].str);
+        if (reg == NULL) printf("Invalid register %s\n", tokens[p].str);
+        return reg != NULL && emit(c, OP_REG, 0, reg);
       }
-      sp--;
+      default: return false;
     }
   }
 
-  if (error) {
-    panic("Evaluation error");
+  if (is_unary_operator(tokens[op].type)) {
+    if (op != p || !compile(op + 1, q, c)) return false;
+    switch (tokens[op].type) {
+      case TK_NEGATIVE: return emit_op(c, OP_NEG);
+      case TK_POINTER:  return emit_op(c, OP_DEREF);
+      case TK_NOT:      return emit_op(c, OP_NOT);
+      default: return false;
+    }
+  }
+
+  if (!compile(p, op - 1, c) || !compile(op + 1, q, c)) return false;
+  switch (tokens[op].type) {
+    case '+':      return emit_op(c, OP_ADD);
+    case '-':      return emit_op(c, OP_SUB);
+    case '*':      return emit_op(c, OP_MUL);
+    case '/':      return emit_op(c, OP_DIV);
+    case TK_EQ:    return emit_op(c, OP_EQ);
+    case TK_NOTEQ: return emit_op(c, OP_NE);
+    case TK_LT:    return emit_op(c, OP_LT);
+    case TK_LE:    return emit_op(c, OP_LE);
+    case TK_GT:    return emit_op(c, OP_GT);
+    case TK_GE:    return emit_op(c, OP_GE);
+    case TK_AND:   return emit_op(c, OP_AND);
+    case TK_OR:    return emit_op(c, OP_OR);
+    default: return false;
   }
-  return result;
 }
 
-/* parse and evaluate the value of an expression */
-word_t expr(char *e, bool *success) {
+/* parse and compile an expression, which is freed by the caller */
+ExprCode *expr_compile(char *e, bool *success) {
   *success = false;
-  if (!make_token(e)) {
+  if (!make_token(e) || nr_token == 0) {
     printf("Expression parse failed at: %s\n", e);
-    return 0;
+    return NULL;
   }
 
+  ExprCode *c = (ExprCode *)malloc(sizeof(ExprCode));
+  c->nr_op = 0;
+  if (!compile(0, nr_token - 1, c)) {
+    free(c);
+    return NULL;
+  }
   *success = true;
-  return eval(0, nr_token - 1);
-}
\ No newline at end of file
+  return c;
+}
+
+word_t expr_eval(const ExprCode *c) {
+  word_t stack[ARRLEN(c->op)];
+  int sp = 0;
+  for (const ExprOp *o = c->op; o < c->op + c->nr_op; o++) {
+    switch (o->op) {
+      case OP_IMM:   stack[sp++] = o->imm; break;
+      case OP_REG:   stack[sp++] = *o->reg; break;
+      case OP_DEREF: stack[sp - 1] = vaddr_read(stack[sp - 1], 4); break;
+      case OP_NEG: case OP_NOT: stack[sp - 1] = expr_calc(o->op, stack[sp - 1], 0); break;
+      default: sp--; stack[sp - 1] = expr_calc(o->op, stack[sp - 1], stack[sp]); break;
+    }
+  }
+  return stack[0];
+}
+
+/* Tell which registers and which memory words a compiled expression reads.
+*  Only loads from constant addresses can be listed, deps->polled is set if
+*  there is any other load, or too many dependencies.
+*/
+void expr_deps(const ExprCode *c, ExprDeps *deps) {
+  deps->nr_reg = deps->nr_mem = 0;
+  deps->polled = false;
+  for (int i = 0; i < c->nr_op; i++) {
+    const ExprOp *o = &c->op[i];
+    if (o->op == OP_REG) {
+      int k = 0;
+      while (k < deps->nr_reg && deps->reg[k] != o->reg) k++;
+      if (k < deps->nr_reg) continue;
+      if (deps->nr_reg == ARRLEN(deps->reg)) deps->polled = true;
+      else deps->reg[deps->nr_reg++] = o->reg;
+    } else if (o->op == OP_DEREF) {
+      if (i == 0 || c->op[i - 1].op != OP_IMM || deps->nr_mem == ARRLEN(deps->mem)) deps->polled = true;
+      else deps->mem[deps->nr_mem++] = c->op[i - 1].imm;
+    }
+  }
+}
+
+/* parse and evaluate the value of an expression */
+word_t expr(char *e, bool *success) {
+  ExprCode *c = expr_compile(e, success);
+  if (c == NULL) return 0;
+  word_t val = expr_eval(c);
+  free(c);
+  return val;
+}
@@ -1,4 +1,5 @@
 #include "monitor/sdb.h"
+#include "monitor/checkpoint.h"
 #include <readline/readline.h>
 #include <readline/history.h>
 
@@ -15,12 +16,19 @@ static int cmd_x(char *args);
 static int cmd_p(char *args);
 static int cmd_w(char *args);
 static int cmd_d(char *args);
+static int cmd_b(char *args);
+static int cmd_tbreak(char *args);
+static int cmd_delete(char *args);
 
 void regex_init();
 void wp_pool_init();
 void wp_display();
 void wp_add(char *expr, word_t val);
 void wp_delete(int no);
+void bp_display();
+void bp_add(vaddr_t pc, bool temporary);
+void bp_delete(int no);
+bool gdb_mainloop();
 
 static struct {
   const char *name;
@@ -34,13 +42,17 @@ static struct {
   { "info", "Print program status\n"
     "Usage:\n"
     "-r: Print register status\n"
-    "-w: Print watchpoint status\n", cmd_info },
+    "-w: Print watchpoint status\n"
+    "-b: Print breakpoint status\n", cmd_info },
   { "x", "Find the value of given expression, and output [N] consecutive 4-byte outputs in hexadecimal\n"
     "Usage:\n"
     "x [N] [EXPR]", cmd_x },
   { "p", "Evaluate the given [EXPR] and return its result in decimal and hexadecimal formats" , cmd_p },
   { "w", "Set a watchpoint at [EXPR], and pause the program when it changes", cmd_w },
-  { "d", "Delete watchpoint with serial number [N]", cmd_d }
+  { "d", "Delete watchpoint with serial number [N]", cmd_d },
+  { "b", "Set a breakpoint at the address [EXPR], and pause the program before running it", cmd_b },
+  { "tbreak", "Set a breakpoint at the address [EXPR], which is deleted once it is hit", cmd_tbreak },
+  { "delete", "Delete breakpoint with serial number [N], or all breakpoints without [N]", cmd_delete }
   /* Add more commands */
 };
 
@@ -96,7 +108,7 @@ static int cmd_si(char *args) {
 static int cmd_info(char *args) {
   char *arg = strtok(NULL, " ");
   if (arg == NULL) {
-    printf("Usage: info [r | w]\n");
+    printf("Usage: info [r | w | b]\n");
     return 0;
   }
 
@@ -107,6 +119,9 @@ static int cmd_info(char *args) {
     case 'w':
       wp_display();
       break;
+    case 'b':
+      bp_display();
+      break;
     default:
       printf("Unknown option: %s\n", arg);
   }
@@ -196,6 +211,34 @@ static int cmd_d(char *args) {
   return 0;
 }
 
+/* b [EXPR], tbreak [EXPR] */
+static int set_bp(char *args, bool temporary) {
+  if (args == NULL) {
+    printf("No address provided\n");
+    return 0;
+  }
+
+  bool success;
+  word_t pc = expr(args, &success);
+  if (!success) {
+    printf("Invaild expression: %s\n", args);
+    return 0;
+  }
+
+  bp_add(pc, temporary);
+  return 0;
+}
+
+static int cmd_b(char *args) { return set_bp(args, false); }
+static int cmd_tbreak(char *args) { return set_bp(args, true); }
+
+/* delete [N] */
+static int cmd_delete(char *args) {
+  char *arg = strtok(args, " ");
+  bp_delete(arg == NULL ? -1 : strtol(arg, NULL, 10));
+  return 0;
+}
+
 /* We use the `readline' library to provide more flexibility to read from stdin. */
 static char* rl_gets() {
   static char *line_read = NULL;
@@ -219,8 +262,16 @@ void sdb_set_batch_mode() {
 }
 
 void sdb_mainloop() {
+  IFONE(CONFIG_GDBSTUB, if (gdb_mainloop()) return);
+
   if (is_batch_mode) {
-    cmd_c(NULL);
+    // a restored sample only runs its own interval
+    uint64_t n = MUXONE(CONFIG_CHECKPOINT, checkpoint_sample_len(), -1);
+    sim_exec(n);
+    if (n != (uint64_t)-1 && sim_state.state == SIM_STOP) {
+      Log("The sample ends after %" PRIu64 " instructions", n);
+      sim_state.state = SIM_QUIT;
+    }
     return;
   }
 
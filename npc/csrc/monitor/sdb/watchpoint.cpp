@@ -1,4 +1,5 @@
 #include "monitor/sdb.h"
+#include "memory/paddr.h"
 
 #define NR_WP 32 // max num of watchpoint
 
@@ -10,6 +11,11 @@ typedef struct watchpoint {
 
   word_t value;
   char *expression;
+  ExprCode *code; // compiled once, and evaluated only when what it reads may have changed
+  ExprDeps deps;
+  word_t reg_value[EXPR_NR_DEP]; // registers in deps when last checked
+  bool dirty;      // a watched memory word has been written
+  bool on_write;   // triggered by any write to the watched word, set by the GDB stub
 
 } WP;
 
@@ -19,6 +25,8 @@ typedef struct watchpoint {
 */
 static WP wp_pool[NR_WP] = {};
 static WP *head = NULL, *free_ = NULL;
+static bool triggered = false;  // since the last wp_triggered()
+static vaddr_t triggered_addr = 0;
 
 void wp_pool_init() {
   int i;
@@ -63,8 +71,13 @@ void wp_free(WP* wp) {
     }
   }
 
-  // Free the expression string
+  if (!wp->deps.polled) {
+    for (int i = 0; i < wp->deps.nr_mem; i++) IFONE(CONFIG_WATCHPOINT, paddr_watch(wp->deps.mem[i], 4, false));
+  }
+
+  // Free the expression string and its code
   free(wp->expression);
+  free(wp->code);
 
   wp->next = free_;
   free_ = wp;
@@ -85,52 +98,112 @@ void wp_display() {
   }
 }
 
+static void wp_init(WP *wp, char *expr, word_t val) {
+  bool success;
+  wp->expression = strdup(expr);
+  wp->code = expr_compile(expr, &success);
+  Assert(success, "Fail to compile the expression of watchpoint");
+  wp->value = val;
+  wp->dirty = false;
+  wp->on_write = false;
+
+  // loads from pmem are hooked, other loads (e.g. mmio) are polled
+  expr_deps(wp->code, &wp->deps);
+  for (int i = 0; i < wp->deps.nr_mem; i++) {
+    if (!in_pmem(wp->deps.mem[i])) wp->deps.polled = true;
+  }
+  if (!wp->deps.polled) {
+    for (int i = 0; i < wp->deps.nr_mem; i++) IFONE(CONFIG_WATCHPOINT, paddr_watch(wp->deps.mem[i], 4, true));
+  }
+  for (int i = 0; i < wp->deps.nr_reg; i++) wp->reg_value[i] = *wp->deps.reg[i];
+}
+
 /* generate a watchpoint and set its expr and val as given value */
 void wp_add(char *expr, word_t val){
   WP* wp = wp_new();
   Assert(wp != NULL, "Fail to add watchpoint, no idle watchpoint");
 
-  wp->expression = strdup(expr);
-  wp->value = val;
-
+  wp_init(wp, expr, val);
   printf("Watchpoint %d: %s\n", wp->NO, expr);
 }
 
+/* watch every write to the word at addr in pmem, returning the NO or -1 */
+int wp_add_write(vaddr_t addr) {
+  if (free_ == NULL || !in_pmem(addr) || !in_pmem(addr + 3)) return -1;
+
+  char e[32];
+  snprintf(e, sizeof(e), "*" FMT_WORD, addr);
+  WP *wp = wp_new();
+  wp_init(wp, e, host_read(guest_to_host(addr), 4));
+  wp->on_write = true;
+  return wp->NO;
+}
+
+/* remove a watchpoint from list based on the given NO, returning false if not found */
+bool wp_remove(int no) {
+  for (WP *wp = head; wp != NULL; wp = wp->next) {
+    if (wp->NO == no) {
+      wp_free(wp);
+      return true;
+    }
+  }
+  return false;
+}
+
 /* delete a watchpoint from list based on the given NO */
 void wp_delete(int no) {
   Assert(no < NR_WP, "Invalid watchpoint No");
 
-  WP* wp = head;
-  WP* prev = NULL;
+  if (wp_remove(no)) printf("Watchpoint %d deleted\n", no);
+  else printf("Watchpoint %d not found\n", no);
+}
 
-  while (wp != NULL) {
-    if (wp->NO == no) {
-      if (prev == NULL) {
-        head = wp->next;
-      } else {
-        prev->next = wp->next;
-      }
+/* whether a watchpoint has been triggered since the last call, and the word
+*  it watches if it is triggered by writes
+*/
+bool wp_triggered(vaddr_t *addr) {
+  bool ret = triggered;
+  *addr = triggered_addr;
+  triggered = false;
+  return ret;
+}
 
-      wp_free(wp);
-      printf("Watchpoint %d deleted\n", no);
-      return;
+/* called by paddr_write() for stores into watched pages */
+void wp_mem_write(paddr_t addr, int len) {
+  for (WP *wp = head; wp != NULL; wp = wp->next) {
+    for (int i = 0; i < wp->deps.nr_mem; i++) {
+      if (addr < wp->deps.mem[i] + 4 && wp->deps.mem[i] < addr + len) wp->dirty = true;
     }
-    prev = wp;
-    wp = wp->next;
   }
+}
 
-  printf("Watchpoint %d not found\n", no);
+/* whether a register read by the watchpoint has been written since the last check */
+static bool reg_changed(WP *wp) {
+  bool changed = false;
+  for (int i = 0; i < wp->deps.nr_reg; i++) {
+    if (*wp->deps.reg[i] != wp->reg_value[i]) {
+      wp->reg_value[i] = *wp->deps.reg[i];
+      changed = true;
+    }
+  }
+  return changed;
 }
 
 /* iterate through the watchpoint list, check and report changes in expression values */
 void wp_check() {
   WP* wp = head;
   while (wp != NULL) {
-    bool success;
-    word_t new_value = expr(wp->expression, &success);
-    assert(success);
+    if (!reg_changed(wp) && !wp->dirty && !wp->deps.polled) {
+      wp = wp->next;
+      continue;
+    }
+    bool written = wp->on_write && wp->dirty;
+    wp->dirty = false;
+    word_t new_value = expr_eval(wp->code);
 
-    if (new_value != wp->value) {
+    if (new_value != wp->value || written) {
+      triggered = true;
+      triggered_addr = (wp->on_write ? wp->deps.mem[0] : 0);
       printf("Watchpoint %d triggered: %s\n", wp->NO, wp->expression);
       printf("Old value = %u\n", wp->value);
       printf("New value = %u\n", new_value);
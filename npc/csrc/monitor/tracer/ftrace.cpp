@@ -3,14 +3,27 @@
 static bool elf_parse_flag = false;
 
 typedef struct {
-    char name[32];  // symbol name
+    char *name;   // symbol name
     paddr_t addr; // address of the function head 
     Elf32_Xword size;
 } Symbol;
 
-Symbol *symbol = NULL;  // dynamic allocation of symbol array
+Symbol *symbol = NULL;  // dynamic allocation of symbol array, sorted by address
 int func_num = 0;       // function counter
-int depth = 1;          // function stack depth
+
+bool trace_event_enabled();
+void trace_event(const char *name, char ph);
+
+/* shadow call stack, so that a return is matched with its call without a lookup */
+typedef struct {
+    int func_index; // -1 if the callee is not a known function
+    vaddr_t ret_addr;
+} CallFrame;
+
+#define MAX_UNWIND_DEPTH 64
+
+static CallFrame *call_stack = NULL;
+static int depth = 0, call_stack_size = 0; // function stack depth
 
 /*  assist function to handle file reading errors  */
 void check_read(int n, size_t size, FILE *fp, const char *msg) {
@@ -22,6 +35,13 @@ void check_read(int n, size_t size, FILE *fp, const char *msg) {
   }
 }
 
+/* order by address, and the largest one of the functions at the same address comes last */
+static int symbol_cmp(const void *a, const void *b) {
+  const Symbol *x = (const Symbol *)a, *y = (const Symbol *)b;
+  if (x->addr != y->addr) return (x->addr < y->addr ? -1 : 1);
+  return (x->size < y->size ? -1 : (x->size > y->size));
+}
+
 /*  parse ELF file and extract function symbols  */
 void parse_elf(const char *elf_file) {
   if (elf_file == NULL) {
@@ -51,31 +71,25 @@ void parse_elf(const char *elf_file) {
         return;
   }
 
+  char *string_table = NULL;
+  Elf32_Sym *symbol_table = NULL;
+
   // read section headers
   fseek(fp, elf_header.e_shoff, SEEK_SET); // move offset pointer to the beginning
   Elf32_Shdr *section_headers = (Elf32_Shdr *)malloc(sizeof(Elf32_Shdr) * elf_header.e_shnum); // section struct * num of section
   check_read(fread(section_headers, sizeof(Elf32_Shdr), elf_header.e_shnum, fp), 
               elf_header.e_shnum, fp, "Fail to read section headers");
 
-  // get the string table 
-  char *string_table = NULL;
-  for (int i = 0; i < elf_header.e_shnum; i++) {
-    if (section_headers[i].sh_type == SHT_STRTAB) {
-      // find string table
-      string_table = (char *)malloc(section_headers[i].sh_size);
-      fseek(fp, section_headers[i].sh_offset, SEEK_SET); // move offset pointer to the begin of string table
-      check_read(fread(string_table, section_headers[i].sh_size, 1, fp), // fread it to string_table
-                  1, fp, "Fail to read string table");
-      break;
-    }
-  }
-
-  // get the symbol table
-  fseek(fp, elf_header.e_shoff, SEEK_SET);
-  Elf32_Sym *symbol_table = NULL;
+  // get the symbol table, and the string table linked to it
   for (int i = 0; i < elf_header.e_shnum; i++) {
     if (section_headers[i].sh_type == SHT_SYMTAB) {
       // find symbol table
+      Elf32_Shdr *strtab = &section_headers[section_headers[i].sh_link];
+      string_table = (char *)malloc(strtab->sh_size);
+      fseek(fp, strtab->sh_offset, SEEK_SET); // move offset pointer to the begin of string table
+      check_read(fread(string_table, strtab->sh_size, 1, fp), // fread it to string_table
+                  1, fp, "Fail to read string table");
+
       fseek(fp, section_headers[i].sh_offset, SEEK_SET); // move offset pointer to the begin of symbol table
       size_t symbol_count = section_headers[i].sh_size / section_headers[i].sh_entsize; // size of symbol table / size of single symbol
       symbol_table = (Elf32_Sym *)malloc(sizeof(Elf32_Sym) * symbol_count);  // allocate for symbol table
@@ -87,8 +101,7 @@ void parse_elf(const char *elf_file) {
       for (size_t j = 0; j < symbol_count; j++) {
         if (ELF32_ST_TYPE(symbol_table[j].st_info) == STT_FUNC) {
           // symbol type is FUNC
-          const char *name = string_table + symbol_table[j].st_name; // func name = string_table + st_name(offset/index) 
-          strncpy(symbol[func_num].name, name, sizeof(symbol[func_num].name) - 1); // copy func name to symbol.name
+          symbol[func_num].name = strdup(string_table + symbol_table[j].st_name); // func name = string_table + st_name(offset/index) 
           symbol[func_num].addr = symbol_table[j].st_value; // get func initial addr
           symbol[func_num].size = symbol_table[j].st_size;  // get func size
           func_num++;
@@ -98,6 +111,9 @@ void parse_elf(const char *elf_file) {
     }
   }
 
+  // sort the functions for binary search in find_func()
+  qsort(symbol, func_num, sizeof(Symbol), symbol_cmp);
+
   elf_parse_flag = true;  // set flag to true
 
   // close the file and clean up
@@ -109,17 +125,22 @@ void parse_elf(const char *elf_file) {
 
 
 int find_func(vaddr_t addr) {
-  for(int i = 0; i < func_num; i++) {
-      if(addr >= symbol[i].addr && addr < (symbol[i].addr + symbol[i].size)) {
-          return i;
-      }
+  // find the last function starting at or before addr
+  int lo = 0, hi = func_num;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (symbol[mid].addr <= addr) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo > 0 && addr < symbol[lo - 1].addr + symbol[lo - 1].size) {
+    return lo - 1;
   }
   return -1; // unfind
 }
 
 void print_trace(vaddr_t addr_curr, int func_index, const char* type) {
   printf("0x%08x:", addr_curr);
-  for(int k = 0; k < depth; k++) printf("  ");
+  for(int k = 0; k <= depth; k++) printf("  ");
   printf("%s  [%s@0x%08x]\n", type, symbol[func_index].name, symbol[func_index].addr);
 }
 
@@ -129,26 +150,183 @@ void func_call_trace(vaddr_t addr_curr, vaddr_t addr_func) {
     return;
   }
 
-  int func_index = find_func(addr_func);
-  if (func_index == -1) {
-    return;
-  } 
+  if (depth == call_stack_size) {
+    call_stack_size = (call_stack_size == 0 ? 1024 : call_stack_size * 2);
+    call_stack = (CallFrame *)realloc(call_stack, sizeof(CallFrame) * call_stack_size);
+  }
 
-  print_trace(addr_curr, func_index, "call");
+  // every call is pushed, so that the return of an unknown function does not pop its caller
+  int func_index = find_func(addr_func);
+  if (func_index != -1) {
+    if (trace_event_enabled()) {
+      trace_event(symbol[func_index].name, 'B');
+    } else {
+      print_trace(addr_curr, func_index, "call");
+    }
+  }
+  call_stack[depth].func_index = func_index;
+  call_stack[depth].ret_addr = addr_curr + 4;
   depth++; // add depth after printing, make sure call and ret of sigle function keep in same level
 }
 
-void func_ret_trace(vaddr_t addr_curr) {
+void func_ret_trace(vaddr_t addr_curr, vaddr_t addr_ret) {
   if (!elf_parse_flag) {
     printf("ELF file not parsed, ftrace invalid\n");
     return;
   }
-  
-  int func_index = find_func(addr_curr);
-  if (func_index == -1) {
+
+  // unwind to the call returning to addr_ret, which also drops the frames left by longjmp,
+  // but do not search too deep for a return without a call (e.g. switching the context)
+  int i = depth - 1, bottom = (depth > MAX_UNWIND_DEPTH ? depth - MAX_UNWIND_DEPTH : 0);
+  while (i >= bottom && call_stack[i].ret_addr != addr_ret) i--;
+  if (i < bottom) {
+    return; // not returning from a traced call
+  }
+
+  if (trace_event_enabled()) {
+    // also end the functions whose frames are dropped, to keep the timeline nested
+    for (int k = depth - 1; k >= i; k--) {
+      if (call_stack[k].func_index != -1) {
+        trace_event(symbol[call_stack[k].func_index].name, 'E');
+      }
+    }
+    depth = i;
     return;
   }
 
-  depth--; // sub depth before ret printing 
-  print_trace(addr_curr, func_index, "ret");
+  depth = i; // sub depth before ret printing 
+  if (call_stack[i].func_index != -1) {
+    print_trace(addr_curr, call_stack[i].func_index, "ret");
+  }
+}
+
+/* Sampling profiler. The pc is sampled every profile_interval instructions,
+*  and each sample is weighted by the instructions executed since the last
+*  one, so that the profile counts instructions. A sample is
+*  attributed to the function containing the pc, and to the functions on the
+*  shadow call stack, which is only maintained with CONFIG_FTRACE.
+*/
+#define PROFILE_TOP_N 10
+#define PROFILE_MAX_FRAMES 64
+
+extern uint64_t guest_inst;
+
+typedef struct {
+  char *stack; // collapsed stack of function names separated by ';'
+  uint64_t hash, count;
+} StackSample;
+
+uint64_t profile_next = UINT64_MAX; // checked by sim_exec()
+static uint64_t profile_interval = 0, profile_last = 0, profile_total = 0;
+static const char *profile_file = NULL;
+static uint64_t *profile_flat = NULL; // samples of each function, and the unknown ones at [func_num]
+static StackSample *profile_stacks = NULL;
+static int profile_stacks_size = 0, profile_stacks_nr = 0;
+
+static uint64_t hash_str(const char *s) {
+  uint64_t h = 0xcbf29ce484222325ull; // FNV-1a
+  for (; *s; s++) h = (h ^ (uint8_t)*s) * 0x100000001b3ull;
+  return h;
+}
+
+static StackSample *stack_slot(StackSample *table, int size, const char *stack, uint64_t hash) {
+  int i = hash & (size - 1);
+  while (table[i].stack != NULL && (table[i].hash != hash || strcmp(table[i].stack, stack) != 0)) {
+    i = (i + 1) & (size - 1);
+  }
+  return &table[i];
+}
+
+static void profile_add_stack(const char *stack, uint64_t count) {
+  if (2 * (profile_stacks_nr + 1) > profile_stacks_size) {
+    int size = (profile_stacks_size == 0 ? 1024 : profile_stacks_size * 2);
+    StackSample *table = (StackSample *)calloc(size, sizeof(StackSample));
+    for (int i = 0; i < profile_stacks_size; i++) {
+      StackSample *e = &profile_stacks[i];
+      if (e->stack != NULL) *stack_slot(table, size, e->stack, e->hash) = *e;
+    }
+    free(profile_stacks);
+    profile_stacks = table;
+    profile_stacks_size = size;
+  }
+  uint64_t hash = hash_str(stack);
+  StackSample *e = stack_slot(profile_stacks, profile_stacks_size, stack, hash);
+  if (e->stack == NULL) {
+    e->stack = strdup(stack);
+    e->hash = hash;
+    profile_stacks_nr++;
+  }
+  e->count += count;
+}
+
+static char *append_frame(char *p, char *end, int func_index, const char *sep) {
+  const char *name = (func_index == -1 ? "[unknown]" : symbol[func_index].name);
+  int n = snprintf(p, end - p, "%s%s", sep, name);
+  return (n < end - p ? p + n : end - 1);
+}
+
+void profile_sample(vaddr_t pc) {
+  uint64_t count = guest_inst - profile_last;
+  profile_last = guest_inst;
+  profile_next = guest_inst + profile_interval;
+  profile_total += count;
+
+  int leaf = find_func(pc);
+  profile_flat[leaf == -1 ? func_num : leaf] += count;
+
+  char stack[4096], *p = stack, *end = stack + sizeof(stack);
+  const char *sep = "";
+  int bottom = (depth > PROFILE_MAX_FRAMES ? depth - PROFILE_MAX_FRAMES : 0);
+  if (bottom > 0) {
+    p += snprintf(p, end - p, "[truncated]");
+    sep = ";";
+  }
+  for (int i = bottom; i < depth; i++, sep = ";") {
+    p = append_frame(p, end, call_stack[i].func_index, sep);
+  }
+  // the leaf is usually the callee of the top frame
+  if (depth == 0 || call_stack[depth - 1].func_index != leaf) {
+    p = append_frame(p, end, leaf, sep);
+  }
+  profile_add_stack(stack, count);
+}
+
+static int flat_cmp(const void *a, const void *b) {
+  uint64_t x = profile_flat[*(const int *)a], y = profile_flat[*(const int *)b];
+  return (x < y) - (x > y);
+}
+
+void profile_report() {
+  if (profile_interval == 0 || profile_total == 0) return;
+
+  FILE *fp = fopen(profile_file, "w");
+  if (fp != NULL) {
+    for (int i = 0; i < profile_stacks_size; i++) {
+      StackSample *e = &profile_stacks[i];
+      if (e->stack != NULL) fprintf(fp, "%s %" PRIu64 "\n", e->stack, e->count);
+    }
+    fclose(fp);
+    Log("Collapsed stacks for flamegraph.pl are written to %s", profile_file);
+  }
+
+  int *order = (int *)malloc(sizeof(int) * (func_num + 1));
+  for (int i = 0; i <= func_num; i++) order[i] = i;
+  qsort(order, func_num + 1, sizeof(int), flat_cmp);
+  Log("top functions by sampled instructions:");
+  for (int i = 0; i < PROFILE_TOP_N && i <= func_num && profile_flat[order[i]] > 0; i++) {
+    uint64_t n = profile_flat[order[i]];
+    Log("%6.2f%% %12" PRIu64 "  %s", 100.0 * n / profile_total, n,
+        (order[i] == func_num ? "[unknown]" : symbol[order[i]].name));
+  }
+  free(order);
+}
+
+void profile_init(uint64_t interval, const char *file) {
+  profile_interval = (interval > 0 ? interval : 1);
+  profile_file = file;
+  profile_flat = (uint64_t *)calloc(func_num + 1, sizeof(uint64_t));
+  profile_last = guest_inst;
+  profile_next = guest_inst + profile_interval;
+  Log("Profiling every %" PRIu64 " instructions%s", interval,
+      (func_num == 0 ? ", but no symbols are loaded with --elf" : ""));
 }
@@ -1,43 +1,19 @@
 #include "monitor/tracer.h"
 
-#define MAX_SIZE_RING_BUFFER 16
-
+// the recently executed instructions are kept raw, and formatted only when an error is reported
 typedef struct {
-  char buffer[MAX_SIZE_RING_BUFFER][128]; // store the log
-  int head;  // point to the newest writting 
-  int size;  // the num of log inside
-} RingBuffer;
-RingBuffer ring_buffer = {{{0}}, 0, 0};
+  vaddr_t pc, dnpc;
+  uint32_t inst;
+} IQueueEntry;
 
-void print_ring_buffer() {
-  printf("Error occurred, recent instructions:\n");
+static IQueueEntry iqueue[CONFIG_IQUEUE_SIZE];
+static uint64_t iqueue_nr = 0; // number of instructions ever recorded
 
-  for (int i = 0; i < ring_buffer.size; i++) {
-    int index = (ring_buffer.head - ring_buffer.size + i + MAX_SIZE_RING_BUFFER) % MAX_SIZE_RING_BUFFER;
-    if (i == ring_buffer.size - 1) { // the latest instruction
-      printf("--> %s\n", ring_buffer.buffer[index]); // the error instruction
-    } else {
-      printf("    %s\n", ring_buffer.buffer[index]);
-    }
-  }
-}
-
-void write_ring_buffer(const char *logbuf) {
-  // ring_buffer.buffer => array, ring_buffer.head => current index 
-  // combine them => specific element at current index in array
-  snprintf(ring_buffer.buffer[ring_buffer.head], sizeof(ring_buffer.buffer[ring_buffer.head]), "%s", logbuf);
-  ring_buffer.head = (ring_buffer.head + 1) % MAX_SIZE_RING_BUFFER; // ring loop
-  if (ring_buffer.size < MAX_SIZE_RING_BUFFER) {
-    ring_buffer.size++;
-  }
-}
-
-void inst_trace(CORE_state core) {
-  char *p = core.logbuf;
-  uint32_t inst = core.inst;
+static void format_inst(char *buf, int size, vaddr_t pc, uint32_t inst) {
+  char *p = buf;
 
   // output the pc
-  p += snprintf(p, sizeof(core.logbuf), FMT_WORD ":", core.pc); // write current pc into logbuf and move to next
+  p += snprintf(p, size, FMT_WORD ":", pc); // write current pc into logbuf and move to next
 
   // output the instruction 
   int ilen = (inst & 0x3) == 0x3 ? 4 : 2; // get length of the instruction, default is 4 but 2 for compressed
@@ -53,16 +29,43 @@ void inst_trace(CORE_state core) {
   p += snprintf(p, space_len + 1, "%*s", space_len, ""); // add spaces
 
   // disassemble the instrucion 
-  disassemble(p, core.logbuf + sizeof(core.logbuf) - p, core.pc, inst_bytes, ilen);
+  disassemble(p, buf + size - p, pc, inst_bytes, ilen);
+}
+
+void print_ring_buffer() {
+  printf("Error occurred, recent instructions:\n");
+
+  uint64_t nr = (iqueue_nr < CONFIG_IQUEUE_SIZE ? iqueue_nr : CONFIG_IQUEUE_SIZE);
+  for (uint64_t i = iqueue_nr - nr; i < iqueue_nr; i++) {
+    IQueueEntry *e = &iqueue[i & (CONFIG_IQUEUE_SIZE - 1)];
+    char buf[128];
+    format_inst(buf, sizeof(buf), e->pc, e->inst);
+    // the latest instruction is the error instruction, and jumps are followed by their targets
+    printf("%s %s", (i == iqueue_nr - 1 ? "-->" : "   "), buf);
+    int ilen = (e->inst & 0x3) == 0x3 ? 4 : 2;
+    if (e->dnpc != e->pc + ilen) {
+      printf("  => " FMT_WORD, e->dnpc);
+    }
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+void iqueue_record(vaddr_t pc, uint32_t inst, vaddr_t dnpc) {
+  IQueueEntry *e = &iqueue[iqueue_nr++ & (CONFIG_IQUEUE_SIZE - 1)];
+  e->pc = pc;
+  e->dnpc = dnpc;
+  e->inst = inst;
+}
+
+void inst_trace(CORE_state core) {
+  format_inst(core.logbuf, sizeof(core.logbuf), core.pc, core.inst);
 
   // output the log buffer
   printf("%s\n", core.logbuf);
 
-  // write the log buffer into ring buffer
-  write_ring_buffer(core.logbuf);
-
   // write the log buffer into log file
   if (CONFIG_LOG) {
     log_write("%s\n", core.logbuf);
   }
-}
\ No newline at end of file
+}
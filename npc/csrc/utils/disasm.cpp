@@ -22,6 +22,7 @@
 #include "llvm/MC/MCContext.h"
 #include "llvm/MC/MCDisassembler/MCDisassembler.h"
 #include "llvm/MC/MCInstPrinter.h"
+#include "llvm/MC/MCInstrInfo.h"
 #if LLVM_VERSION_MAJOR >= 14
 #include "llvm/MC/TargetRegistry.h"
 #if LLVM_VERSION_MAJOR >= 15
@@ -45,6 +46,24 @@ using namespace llvm;
 static llvm::MCDisassembler *gDisassembler = nullptr;
 static llvm::MCSubtargetInfo *gSTI = nullptr;
 static llvm::MCInstPrinter *gIP = nullptr;
+static llvm::MCInstrInfo *gMII = nullptr;
+
+/* Formatted instructions are cached in a direct-mapped table keyed by their
+*  bytes. Instructions with pc-relative operands (branch targets are printed
+*  as addresses) are keyed by their pc as well.
+*/
+#define DISASM_CACHE_SIZE 4096 // must be a power of 2
+
+typedef struct {
+  uint64_t pc;
+  uint8_t code[16];
+  uint8_t nbyte; // 0 if the entry is empty
+  bool pcrel;
+  char str[78];
+} DisasmEntry;
+
+static DisasmEntry disasm_cache[DISASM_CACHE_SIZE] = {};
+static uint64_t disasm_hit = 0, disasm_miss = 0;
 
 extern "C" void disasm_init(const char *triple) {
   // only change the naming of function
@@ -56,7 +75,6 @@ extern "C" void disasm_init(const char *triple) {
   std::string errstr;
   std::string gTriple(triple);
 
-  llvm::MCInstrInfo *gMII = nullptr;
   llvm::MCRegisterInfo *gMRI = nullptr;
   auto target = llvm::TargetRegistry::lookupTarget(gTriple, errstr);
   if (!target) {
@@ -93,11 +111,11 @@ extern "C" void disasm_init(const char *triple) {
     gIP->applyTargetSpecificCLOption("no-aliases");
 }
 
-extern "C" void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte) {
+static void disassemble_llvm(char *str, int size, uint64_t pc, uint8_t *code, int nbyte, bool *pcrel) {
   MCInst inst;
   llvm::ArrayRef<uint8_t> arr(code, nbyte);
   uint64_t dummy_size = 0;
-  gDisassembler->getInstruction(inst, dummy_size, arr, pc, llvm::nulls());
+  bool ok = gDisassembler->getInstruction(inst, dummy_size, arr, pc, llvm::nulls()) == MCDisassembler::Success;
 
   std::string s;
   raw_string_ostream os(s);
@@ -107,4 +125,58 @@ extern "C" void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int
   const char *p = s.c_str() + skip;
   assert((int)s.length() - skip < size);
   strcpy(str, p);
+
+  *pcrel = false;
+  if (ok) {
+    for (const MCOperandInfo &op : gMII->get(inst.getOpcode()).operands()) {
+      if (op.OperandType == MCOI::OPERAND_PCREL) *pcrel = true;
+    }
+  }
+}
+
+static inline uint32_t disasm_hash(uint64_t pc, uint8_t *code, int nbyte, bool pcrel) {
+  uint64_t h = 0xcbf29ce484222325ull; // FNV-1a
+  for (int i = 0; i < nbyte; i ++) h = (h ^ code[i]) * 0x100000001b3ull;
+  if (pcrel) h = (h ^ pc) * 0x9e3779b97f4a7c15ull;
+  return (h ^ (h >> 32)) & (DISASM_CACHE_SIZE - 1);
+}
+
+static inline bool disasm_match(DisasmEntry *e, uint64_t pc, uint8_t *code, int nbyte, bool pcrel) {
+  return e->nbyte == nbyte && e->pcrel == pcrel && (!pcrel || e->pc == pc) && memcmp(e->code, code, nbyte) == 0;
+}
+
+extern "C" void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte) {
+  if (nbyte <= 0 || nbyte > (int)sizeof(disasm_cache[0].code)) {
+    bool pcrel;
+    disassemble_llvm(str, size, pc, code, nbyte, &pcrel);
+    return;
+  }
+  // an instruction is in one of the two slots, depending on whether it is pc-relative
+  DisasmEntry *e = &disasm_cache[disasm_hash(pc, code, nbyte, false)];
+  if (!disasm_match(e, pc, code, nbyte, false)) {
+    e = &disasm_cache[disasm_hash(pc, code, nbyte, true)];
+    if (!disasm_match(e, pc, code, nbyte, true)) e = nullptr;
+  }
+  if (e != nullptr) {
+    disasm_hit ++;
+    assert((int)strlen(e->str) < size);
+    strcpy(str, e->str);
+    return;
+  }
+
+  disasm_miss ++;
+  bool pcrel;
+  disassemble_llvm(str, size, pc, code, nbyte, &pcrel);
+  if (strlen(str) >= sizeof(e->str)) return;
+  e = &disasm_cache[disasm_hash(pc, code, nbyte, pcrel)];
+  e->pc = pc;
+  memcpy(e->code, code, nbyte);
+  e->nbyte = nbyte;
+  e->pcrel = pcrel;
+  strcpy(e->str, str);
+}
+
+extern "C" void disasm_statistic(uint64_t *hit, uint64_t *miss) {
+  *hit = disasm_hit;
+  *miss = disasm_miss;
 }